@@ -0,0 +1,110 @@
+#include "types.h"
+#include "mmap.h"
+#include "graphics.h"
+#include "hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// gbbench
+// Usage: gbbench [frames]
+// Times how long the PPU takes to draw a frame with 1, 2 and 4 threads,
+// then the whole PPU per frame with the scanline and pixel FIFO renderers
+// The scene is random tiles and sprites with the window over the
+// bottom half and SCX changed on every line, VRAM is only written in VBlank
+
+// One GameBoy frame
+const int FRAME_CYCLES = 70224;
+
+// Runs the PPU for frames frames and returns the host seconds spent drawing
+// total is set to the host seconds spent in the PPU as a whole
+// hash is set to a hash of every frame drawn
+static double runFrames(int threads, bool pixelFifo, int frames, double& total, unsigned long long& hash)
+{
+	MemoryMap* mMap = new MemoryMap();
+	PPU* ppu = new PPU();
+	ppu->setMemoryMap(mMap);
+	ppu->setFrameSkip(0);
+	ppu->setSpeedLimit(false);
+	ppu->setRenderThreads(threads);
+	ppu->setPixelFifo(pixelFifo);
+
+	srand(1);
+	for (Word address = 0x8000; address < 0xA000; address++)
+		mMap->writeMemory(address, rand());
+	for (Word address = 0xFE00; address < 0xFEA0; address++)
+		mMap->writeMemory(address, rand());
+
+	// LCD, BG, window and 8x8 sprites on
+	mMap->writeMemory(0xFF40, 0xF3);
+	mMap->writeMemory(0xFF47, 0xE4);
+	mMap->writeMemory(0xFF48, 0xD2);
+	mMap->writeMemory(0xFF49, 0x1B);
+	mMap->writeMemory(0xFF4A, 72);
+	mMap->writeMemory(0xFF4B, 7);
+
+	hash = 0;
+	Uint64 ticks = 0;
+	for (int frame = 0; frame < frames; frame++)
+	{
+		// Stepped like instructions would step it
+		Uint64 start = SDL_GetPerformanceCounter();
+		for (int cycles = 0; cycles < FRAME_CYCLES; cycles += 4)
+		{
+			ppu->executePPU(4);
+			mMap->writeMemory(0xFF43, mMap->getRegLY() + frame);
+		}
+		ticks += SDL_GetPerformanceCounter() - start;
+
+		// Scroll a tile row like a game would during VBlank
+		for (Word address = 0x9800; address < 0x9820; address++)
+			mMap->writeMemory(address, rand());
+
+		hash = hash * 31 + hashBytes(ppu->getFrameBuffer(), 160 * 144);
+	}
+
+	total = (double)ticks / SDL_GetPerformanceFrequency();
+	double seconds = (double)ppu->getRenderTicks() / SDL_GetPerformanceFrequency();
+	ppu->close();
+	delete ppu;
+	delete mMap;
+	return seconds;
+}
+
+int main(int argc, char** argv)
+{
+	int frames = (argc > 1) ? atoi(argv[1]) : 600;
+	if (frames <= 0)
+	{
+		printf("Usage: %s [frames]\n", argv[0]);
+		return 1;
+	}
+
+	unsigned long long serialHash = 0;
+	int threadCounts[] = { 1, 2, 4 };
+	for (int threads : threadCounts)
+	{
+		unsigned long long hash;
+		double total;
+		double seconds = runFrames(threads, false, frames, total, hash);
+		if (threads == 1)
+			serialHash = hash;
+
+		printf("%d thread%s: %8.1f us per frame%s\n", threads, (threads == 1) ? " " : "s", seconds * 1000000 / frames, (hash == serialHash) ? "" : "  FRAMES DIFFER");
+		if (hash != serialHash)
+			return 1;
+	}
+
+	// The cost of accuracy
+	// Frames are not compared, the renderers differ where the scanline
+	// renderer approximates, such as OBJ behind BG priority
+	const char* renderers[] = { "scanline", "pixel FIFO" };
+	for (int fifo = 0; fifo < 2; fifo++)
+	{
+		unsigned long long hash;
+		double total;
+		runFrames(1, fifo, frames, total, hash);
+		printf("%-10s: %8.1f us per frame for the whole PPU\n", renderers[fifo], total * 1000000 / frames);
+	}
+
+	return 0;
+}
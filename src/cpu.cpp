@@ -1,6 +1,14 @@
 #include "types.h"
 #include "cpu.h"
 #include <stdio.h>
+#include <algorithm>
+#include <cstring>
+#include <bit>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
 #ifndef DEBUG
 #define debugPrint(...)
 #endif
@@ -48,10 +56,6 @@ CPU::CPU()
 	reg_HL.dat = 0x0000;
 	reg_SP.dat = 0x0000;
 
-	// set the timer_counters
-	timer_counter.div = 0;
-	timer_counter.tima = 0;
-
 	// Set isLowPower to false
 	isLowPower = false;
 
@@ -62,6 +66,19 @@ CPU::CPU()
 	IMEFlag = -1;
 
 	IMEReg = false;
+
+	// No recompiled module until one is loaded
+	recompiledBlocks = nullptr;
+	recompiledModule = nullptr;
+
+	ppu = nullptr;
+
+	// Nothing cached until the first fetch
+	pcPage = nullptr;
+	pcPageNumber = -1;
+
+	fusionEnabled = true;
+	interruptCycles = 0;
 }
 
 // NOP just adds 4 cycles
@@ -81,7 +98,7 @@ int CPU::LD_BC_u16()
 	// Left shift the second byte by 8 bits
 	// OR the first byte
 	// Due to endianness, the first byte is the least significant byte
-	reg_BC.dat = ((*mMap)[reg_PC.dat + 2] << 8) | (*mMap)[reg_PC.dat + 1];
+	reg_BC.dat = fetchWord(1);
 	reg_PC.dat += 3;
 	debugPrint("LD BC, u16\n");
 	return 12;
@@ -156,7 +173,7 @@ int CPU::DEC_B()
 // Loads an 8 bit immediate value into B
 int CPU::LD_B_u8()
 {
-	reg_BC.hi = (*mMap)[reg_PC.dat + 1];
+	reg_BC.hi = fetchByte(1);
 	reg_PC.dat += 2;
 	debugPrint("LD B, u8\n");
 	return 8;
@@ -189,11 +206,10 @@ int CPU::LD_u16_SP()
 	// Left shift the second byte by 8 bits
 	// OR the first byte
 	// Due to endianness
-	Word address = ((*mMap)[reg_PC.dat + 2] << 8) | (*mMap)[reg_PC.dat + 1];
+	Word address = fetchWord(1);
 
 	// Write the contents of SP into the memory address pointed to by the next 2 bytes
-	mMap->writeMemory(address, reg_SP.lo);
-	mMap->writeMemory(address + 1, reg_SP.hi);
+	mMap->writeWord(address, reg_SP.dat);
 
 	// Increment the program counter
 	reg_PC.dat += 3;
@@ -290,7 +306,7 @@ int CPU::DEC_C()
 // Loads an 8 bit immediate value into C
 int CPU::LD_C_u8()
 {
-	reg_BC.lo = (*mMap)[reg_PC.dat + 1];
+	reg_BC.lo = fetchByte(1);
 	reg_PC.dat += 2;
 	debugPrint("LD C, u8\n");
 	return 8;
@@ -334,7 +350,7 @@ int CPU::STOP()
 // Loads a 16 bit immediate value into DE
 int CPU::LD_DE_u16()
 {
-	reg_DE.dat = ((*mMap)[reg_PC.dat + 2] << 8) | (*mMap)[reg_PC.dat + 1];
+	reg_DE.dat = fetchWord(1);
 	reg_PC.dat += 3;
 	debugPrint("LD DE, u16\n");
 	return 12;
@@ -404,7 +420,7 @@ int CPU::DEC_D()
 // Loads an 8 bit immediate value into D
 int CPU::LD_D_u8()
 {
-	reg_DE.hi = (*mMap)[reg_PC.dat + 1];
+	reg_DE.hi = fetchByte(1);
 	reg_PC.dat += 2;
 	debugPrint("LD D, u8\n");
 	return 8;
@@ -439,7 +455,7 @@ int CPU::RLA()
 // Add a signed 8 bit immediate value to the program counter
 int CPU::JR_i8()
 {
-	reg_PC.dat += (SByte)(*mMap)[reg_PC.dat + 1] + 2;
+	reg_PC.dat += (SByte)fetchByte(1) + 2;
 	debugPrint("JR i8\n");
 	return 12;
 }
@@ -532,7 +548,7 @@ int CPU::DEC_E()
 // Loads an 8 bit immediate value into E
 int CPU::LD_E_u8()
 {
-	reg_DE.lo = (*mMap)[reg_PC.dat + 1];
+	reg_DE.lo = fetchByte(1);
 	reg_PC.dat += 2;
 	debugPrint("LD E, u8\n");
 	return 8;
@@ -574,7 +590,7 @@ int CPU::JR_NZ_i8()
 
 	if (!(reg_AF.lo & FLAG_ZERO_z))
 	{
-		reg_PC.dat += (SByte)(*mMap)[reg_PC.dat + 1] + 2;
+		reg_PC.dat += (SByte)fetchByte(1) + 2;
 		return 12;
 	}
 
@@ -586,7 +602,7 @@ int CPU::JR_NZ_i8()
 // Loads a 16 bit immediate value into HL
 int CPU::LD_HL_u16()
 {
-	reg_HL.dat = ((*mMap)[reg_PC.dat + 2] << 8) | (*mMap)[reg_PC.dat + 1];
+	reg_HL.dat = fetchWord(1);
 	reg_PC.dat += 3;
 	debugPrint("LD HL, u16\n");
 	return 12;
@@ -657,7 +673,7 @@ int CPU::DEC_H()
 // Loads an 8 bit immediate value into H
 int CPU::LD_H_u8()
 {
-	reg_HL.hi = (*mMap)[reg_PC.dat + 1];
+	reg_HL.hi = fetchByte(1);
 	reg_PC.dat += 2;
 	debugPrint("LD H, u8\n");
 	return 8;
@@ -710,7 +726,7 @@ int CPU::JR_Z_r8()
 	debugPrint("JR Z, i8\n");
 	if (reg_AF.lo & FLAG_ZERO_z)
 	{
-		reg_PC.dat += (SByte)(*mMap)[reg_PC.dat + 1] + 2;
+		reg_PC.dat += (SByte)fetchByte(1) + 2;
 		return 12;
 	}
 	reg_PC.dat += 2;
@@ -805,7 +821,7 @@ int CPU::DEC_L()
 // Loads an 8 bit immediate value into L
 int CPU::LD_L_u8()
 {
-	reg_HL.lo = (*mMap)[reg_PC.dat + 1];
+	reg_HL.lo = fetchByte(1);
 	reg_PC.dat += 2;
 	debugPrint("LD L, u8\n");
 	return 8;
@@ -836,7 +852,7 @@ int CPU::JR_NC_i8()
 	debugPrint("JR NC, i8\n");
 	if (!(reg_AF.lo & FLAG_CARRY_c))
 	{
-		reg_PC.dat += (SByte)(*mMap)[reg_PC.dat + 1] + 2;
+		reg_PC.dat += (SByte)fetchByte(1) + 2;
 		return 12;
 	}
 	reg_PC.dat += 2;
@@ -848,7 +864,7 @@ int CPU::JR_NC_i8()
 // Loads a 16 bit immediate value into SP
 int CPU::LD_SP_u16()
 {
-	reg_SP.dat = ((*mMap)[reg_PC.dat + 2] << 8) | (*mMap)[reg_PC.dat + 1];
+	reg_SP.dat = fetchWord(1);
 	reg_PC.dat += 3;
 	debugPrint("LD SP, u16\n");
 	return 12;
@@ -924,7 +940,7 @@ int CPU::DEC_HLp()
 // Loads an 8 bit immediate value into the memory address pointed to by HL
 int CPU::LD_HLp_u8()
 {
-	mMap->writeMemory(reg_HL.dat, (*mMap)[reg_PC.dat + 1]);
+	mMap->writeMemory(reg_HL.dat, fetchByte(1));
 	reg_PC.dat += 2;
 	debugPrint("LD (HL), u8\n");
 	return 12;
@@ -956,7 +972,7 @@ int CPU::JR_C_r8()
 	debugPrint("JR C, i8\n");
 	if (reg_AF.lo & FLAG_CARRY_c)
 	{
-		reg_PC.dat += (SByte)(*mMap)[reg_PC.dat + 1] + 2;
+		reg_PC.dat += (SByte)fetchByte(1) + 2;
 		return 12;
 	}
 	reg_PC.dat += 2;
@@ -1053,7 +1069,7 @@ int CPU::DEC_A()
 // Loads an 8 bit immediate value into A
 int CPU::LD_A_u8()
 {
-	reg_AF.hi = (*mMap)[reg_PC.dat + 1];
+	reg_AF.hi = fetchByte(1);
 	reg_PC.dat += 2;
 	debugPrint("LD A, u8\n");
 	return 8;
@@ -1638,13 +1654,13 @@ int CPU::HALT()
 	// The interrupt is handled, but returned back to HALT
 	// so HALT gets called twice
 
-	if ((!IMEReg) && ((mMap->getRegIE() & mMap->getRegIF()) & 0x1F))
+	if ((!IMEReg) && mMap->getPendingInterrupts())
 	{
 		// Check if EI executed just before HALT
 		// Pass through without a PC increment if true
 		if (IMEFlag == 1)
 			return 4;
-		return 4 + executeInstruction((*mMap)[reg_PC.dat + 1]);
+		return 4 + executeInstruction(fetchByte(1));
 	}
 
 	// If interrupts are enabled, go in HALT mode
@@ -3190,8 +3206,7 @@ int CPU::RET_NZ()
 {
 	if (!GET_ZERO_FLAG)
 	{
-		reg_PC.dat = (*mMap)[reg_SP.dat] | ((*mMap)[reg_SP.dat + 1] << 8);
-		reg_SP.dat += 2;
+		reg_PC.dat = mMap->pop16(reg_SP.dat);
 		debugPrint("RET NZ\n");
 		return 20;
 	}
@@ -3207,8 +3222,7 @@ int CPU::RET_NZ()
 // Pop two bytes off the stack and store them in BC.
 int CPU::POP_BC()
 {
-	reg_BC.dat = (*mMap)[reg_SP.dat] | ((*mMap)[reg_SP.dat + 1] << 8);
-	reg_SP.dat += 2;
+	reg_BC.dat = mMap->pop16(reg_SP.dat);
 	reg_PC.dat += 1;
 	debugPrint("POP BC\n");
 	return 12;
@@ -3220,7 +3234,7 @@ int CPU::JP_NZ_u16()
 {
 	if (!GET_ZERO_FLAG)
 	{
-		reg_PC.dat = ((*mMap)[reg_PC.dat + 2] << 8) | ((*mMap)[reg_PC.dat + 1]);
+		reg_PC.dat = fetchWord(1);
 		debugPrint("JP NZ, %04X\n", reg_PC.dat);
 		return 16;
 	}
@@ -3236,7 +3250,7 @@ int CPU::JP_NZ_u16()
 // Jump to address u16.
 int CPU::JP_u16()
 {
-	reg_PC.dat = ((*mMap)[reg_PC.dat + 2] << 8) | (*mMap)[reg_PC.dat + 1];
+	reg_PC.dat = fetchWord(1);
 	debugPrint("JP %04X\n", reg_PC.dat);
 	return 16;
 }
@@ -3247,9 +3261,8 @@ int CPU::CALL_NZ_u16()
 {
 	if (!GET_ZERO_FLAG)
 	{
-		mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 3) >> 8);
-		mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 3) & 0xFF);
-		reg_PC.dat = (*mMap)[reg_PC.dat + 1] | ((*mMap)[reg_PC.dat + 2] << 8);
+		mMap->push16(reg_SP.dat, reg_PC.dat + 3);
+		reg_PC.dat = fetchWord(1);
 		debugPrint("CALL NZ, %04X\n", reg_PC.dat);
 		return 24;
 	}
@@ -3265,8 +3278,7 @@ int CPU::CALL_NZ_u16()
 // Push BC onto the stack.
 int CPU::PUSH_BC()
 {
-	mMap->writeMemory(--reg_SP.dat, reg_BC.hi);
-	mMap->writeMemory(--reg_SP.dat, reg_BC.lo);
+	mMap->push16(reg_SP.dat, reg_BC.dat);
 	reg_PC.dat += 1;
 	debugPrint("PUSH BC\n");
 	return 16;
@@ -3280,17 +3292,17 @@ int CPU::ADD_A_u8()
 	UNSET_SUBTRACT_FLAG;
 
 	// Set carry flag if A + u8 > 0xFF
-	reg_AF.hi + (*mMap)[reg_PC.dat + 1] > 0xFF ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
+	reg_AF.hi + fetchByte(1) > 0xFF ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
 
 	// Set zero flag if A + u8 == 0
-	(reg_AF.hi + (*mMap)[reg_PC.dat + 1]) & 0xFF ? UNSET_ZERO_FLAG : SET_ZERO_FLAG;
+	(reg_AF.hi + fetchByte(1)) & 0xFF ? UNSET_ZERO_FLAG : SET_ZERO_FLAG;
 
 	// Set half carry flag if lower nibble of A + lower nibble of u8 > 0xF
-	(reg_AF.hi & 0x0F) + ((*mMap)[reg_PC.dat + 1] & 0x0F) > 0xF ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
+	(reg_AF.hi & 0x0F) + (fetchByte(1) & 0x0F) > 0xF ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
 
-	reg_AF.hi += (*mMap)[reg_PC.dat + 1];
+	reg_AF.hi += fetchByte(1);
 	reg_PC.dat += 2;
-	debugPrint("ADD A, %02X\n", (*mMap)[reg_PC.dat + 1]);
+	debugPrint("ADD A, %02X\n", fetchByte(1));
 	return 8;
 }
 
@@ -3298,8 +3310,7 @@ int CPU::ADD_A_u8()
 // Call subroutine at address 0x0000.
 int CPU::RST_00H()
 {
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) >> 8);
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) & 0xFF);
+	mMap->push16(reg_SP.dat, reg_PC.dat + 1);
 	reg_PC.dat = 0x0000;
 	debugPrint("RST 00H\n");
 	return 16;
@@ -3311,8 +3322,7 @@ int CPU::RET_Z()
 {
 	if (GET_ZERO_FLAG)
 	{
-		reg_PC.dat = (*mMap)[reg_SP.dat] | ((*mMap)[reg_SP.dat + 1] << 8);
-		reg_SP.dat += 2;
+		reg_PC.dat = mMap->pop16(reg_SP.dat);
 		debugPrint("RET Z\n");
 		return 20;
 	}
@@ -3328,8 +3338,7 @@ int CPU::RET_Z()
 // Return.
 int CPU::RET()
 {
-	reg_PC.dat = (*mMap)[reg_SP.dat] | ((*mMap)[reg_SP.dat + 1] << 8);
-	reg_SP.dat += 2;
+	reg_PC.dat = mMap->pop16(reg_SP.dat);
 	debugPrint("RET\n");
 	return 16;
 }
@@ -3340,7 +3349,7 @@ int CPU::JP_Z_u16()
 {
 	if (GET_ZERO_FLAG)
 	{
-		reg_PC.dat = (*mMap)[reg_PC.dat + 1] | ((*mMap)[reg_PC.dat + 2] << 8);
+		reg_PC.dat = fetchWord(1);
 		debugPrint("JP Z, %04X\n", reg_PC.dat);
 		return 16;
 	}
@@ -3368,9 +3377,8 @@ int CPU::CALL_Z_u16()
 {
 	if (GET_ZERO_FLAG)
 	{
-		mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 3) >> 8);
-		mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 3) & 0xFF);
-		reg_PC.dat = (*mMap)[reg_PC.dat + 1] | ((*mMap)[reg_PC.dat + 2] << 8);
+		mMap->push16(reg_SP.dat, reg_PC.dat + 3);
+		reg_PC.dat = fetchWord(1);
 		debugPrint("CALL Z, %04X\n", reg_PC.dat);
 		return 24;
 	}
@@ -3386,9 +3394,8 @@ int CPU::CALL_Z_u16()
 // Call subroutine at address u16.
 int CPU::CALL_u16()
 {
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 3) >> 8);
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 3) & 0xFF);
-	reg_PC.dat = (*mMap)[reg_PC.dat + 1] | ((*mMap)[reg_PC.dat + 2] << 8);
+	mMap->push16(reg_SP.dat, reg_PC.dat + 3);
+	reg_PC.dat = fetchWord(1);
 	debugPrint("CALL %04X\n", reg_PC.dat);
 	return 24;
 }
@@ -3400,19 +3407,19 @@ int CPU::ADC_A_u8()
 	// Unset subtract flag
 	UNSET_SUBTRACT_FLAG;
 
-	Word temp = (Word)reg_AF.hi + GET_CARRY_FLAG + (*mMap)[reg_PC.dat + 1];
+	Word temp = (Word)reg_AF.hi + GET_CARRY_FLAG + fetchByte(1);
 
 	// Set zero flag if A + u8 + carry flag == 0
-	(reg_AF.hi + (*mMap)[reg_PC.dat + 1] + GET_CARRY_FLAG) & 0xFF ? UNSET_ZERO_FLAG : SET_ZERO_FLAG;
+	(reg_AF.hi + fetchByte(1) + GET_CARRY_FLAG) & 0xFF ? UNSET_ZERO_FLAG : SET_ZERO_FLAG;
 
 	// Set half carry flag if lower nibble of A + lower nibble of u8 + carry flag > 0xF
-	(reg_AF.hi & 0x0F) + ((*mMap)[reg_PC.dat + 1] & 0x0F) + GET_CARRY_FLAG > 0xF ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
+	(reg_AF.hi & 0x0F) + (fetchByte(1) & 0x0F) + GET_CARRY_FLAG > 0xF ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
 
 	0xFF < temp ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
 
 	reg_AF.hi = temp;
 	reg_PC.dat += 2;
-	debugPrint("ADC A, %02X\n", (*mMap)[reg_PC.dat + 1]);
+	debugPrint("ADC A, %02X\n", fetchByte(1));
 	return 8;
 }
 
@@ -3420,8 +3427,7 @@ int CPU::ADC_A_u8()
 // Call subroutine at address 0x0008.
 int CPU::RST_08H()
 {
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) >> 8);
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) & 0xFF);
+	mMap->push16(reg_SP.dat, reg_PC.dat + 1);
 	reg_PC.dat = 0x0008;
 	debugPrint("RST 08H\n");
 	return 16;
@@ -3433,8 +3439,7 @@ int CPU::RET_NC()
 {
 	if (!GET_CARRY_FLAG)
 	{
-		reg_PC.dat = (*mMap)[reg_SP.dat] | ((*mMap)[reg_SP.dat + 1] << 8);
-		reg_SP.dat += 2;
+		reg_PC.dat = mMap->pop16(reg_SP.dat);
 		debugPrint("RET NC\n");
 		return 20;
 	}
@@ -3450,8 +3455,7 @@ int CPU::RET_NC()
 // Pop 16-bit value from stack into DE.
 int CPU::POP_DE()
 {
-	reg_DE.dat = (*mMap)[reg_SP.dat] | ((*mMap)[reg_SP.dat + 1] << 8);
-	reg_SP.dat += 2;
+	reg_DE.dat = mMap->pop16(reg_SP.dat);
 	reg_PC.dat += 1;
 	debugPrint("POP DE\n");
 	return 12;
@@ -3463,7 +3467,7 @@ int CPU::JP_NC_u16()
 {
 	if (!GET_CARRY_FLAG)
 	{
-		reg_PC.dat = (*mMap)[reg_PC.dat + 1] | ((*mMap)[reg_PC.dat + 2] << 8);
+		reg_PC.dat = fetchWord(1);
 		debugPrint("JP NC, %04X\n", reg_PC.dat);
 		return 16;
 	}
@@ -3488,9 +3492,8 @@ int CPU::NC_u16()
 {
 	if (!GET_CARRY_FLAG)
 	{
-		mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 3) >> 8);
-		mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 3) & 0xFF);
-		reg_PC.dat = (*mMap)[reg_PC.dat + 1] | ((*mMap)[reg_PC.dat + 2] << 8);
+		mMap->push16(reg_SP.dat, reg_PC.dat + 3);
+		reg_PC.dat = fetchWord(1);
 		debugPrint("NCALL %04X\n", reg_PC.dat);
 		return 24;
 	}
@@ -3506,8 +3509,7 @@ int CPU::NC_u16()
 // Push 16-bit value from DE onto stack.
 int CPU::PUSH_DE()
 {
-	mMap->writeMemory(--reg_SP.dat, reg_DE.hi);
-	mMap->writeMemory(--reg_SP.dat, reg_DE.lo);
+	mMap->push16(reg_SP.dat, reg_DE.dat);
 	reg_PC.dat += 1;
 	debugPrint("PUSH DE\n");
 	return 16;
@@ -3521,18 +3523,18 @@ int CPU::SUB_u8()
 	SET_SUBTRACT_FLAG;
 
 	// Set carry flag if A < u8
-	reg_AF.hi < (*mMap)[reg_PC.dat + 1] ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
+	reg_AF.hi < fetchByte(1) ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
 
 	// Set zero flag if A == u8
-	reg_AF.hi == (*mMap)[reg_PC.dat + 1] ? SET_ZERO_FLAG : UNSET_ZERO_FLAG;
+	reg_AF.hi == fetchByte(1) ? SET_ZERO_FLAG : UNSET_ZERO_FLAG;
 
 	// Set half carry flag if lower nibble of A < lower nibble of u8
-	(reg_AF.hi & 0x0F) < ((*mMap)[reg_PC.dat + 1] & 0x0F) ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
+	(reg_AF.hi & 0x0F) < (fetchByte(1) & 0x0F) ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
 
-	reg_AF.hi -= (*mMap)[reg_PC.dat + 1];
+	reg_AF.hi -= fetchByte(1);
 
 	reg_PC.dat += 2;
-	debugPrint("SUB %02X\n", (*mMap)[reg_PC.dat - 1]);
+	debugPrint("SUB %02X\n", fetchByte(-1));
 	return 8;
 }
 
@@ -3540,8 +3542,7 @@ int CPU::SUB_u8()
 // Call subroutine at address 0x0010.
 int CPU::RST_10H()
 {
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) >> 8);
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) & 0xFF);
+	mMap->push16(reg_SP.dat, reg_PC.dat + 1);
 	reg_PC.dat = 0x0010;
 	debugPrint("RST 10H\n");
 	return 16;
@@ -3553,8 +3554,7 @@ int CPU::RET_C()
 {
 	if (GET_CARRY_FLAG)
 	{
-		reg_PC.dat = (*mMap)[reg_SP.dat] | ((*mMap)[reg_SP.dat + 1] << 8);
-		reg_SP.dat += 2;
+		reg_PC.dat = mMap->pop16(reg_SP.dat);
 		debugPrint("RET C\n");
 		return 20;
 	}
@@ -3570,8 +3570,7 @@ int CPU::RET_C()
 // Return and enable interrupts.
 int CPU::RETI()
 {
-	reg_PC.dat = (*mMap)[reg_SP.dat] | ((*mMap)[reg_SP.dat + 1] << 8);
-	reg_SP.dat += 2;
+	reg_PC.dat = mMap->pop16(reg_SP.dat);
 	// Instantly enable interrupts
 	// as RETI is basically EI then RET
 	// So 1 opcode delay of EI is taken care of
@@ -3588,7 +3587,7 @@ int CPU::JP_C_u16()
 {
 	if (GET_CARRY_FLAG)
 	{
-		reg_PC.dat = (*mMap)[reg_PC.dat + 1] | ((*mMap)[reg_PC.dat + 2] << 8);
+		reg_PC.dat = fetchWord(1);
 		debugPrint("JP C, %04X\n", reg_PC.dat);
 		return 16;
 	}
@@ -3606,9 +3605,8 @@ int CPU::CALL_C_u16()
 {
 	if (GET_CARRY_FLAG)
 	{
-		mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 3) >> 8);
-		mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 3) & 0xFF);
-		reg_PC.dat = (*mMap)[reg_PC.dat + 1] | ((*mMap)[reg_PC.dat + 2] << 8);
+		mMap->push16(reg_SP.dat, reg_PC.dat + 3);
+		reg_PC.dat = fetchWord(1);
 		debugPrint("CALL C, %04X\n", reg_PC.dat);
 		return 24;
 	}
@@ -3630,18 +3628,18 @@ int CPU::SBC_A_u8()
 	Byte temp = reg_AF.hi;
 
 	// Set half carry flag if lower nibble of A < lower nibble of u8 + carry flag
-	(reg_AF.hi & 0x0F) < ((*mMap)[reg_PC.dat + 1] & 0x0F) + GET_CARRY_FLAG ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
+	(reg_AF.hi & 0x0F) < (fetchByte(1) & 0x0F) + GET_CARRY_FLAG ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
 
-	reg_AF.hi -= ((*mMap)[reg_PC.dat + 1] + GET_CARRY_FLAG);
+	reg_AF.hi -= (fetchByte(1) + GET_CARRY_FLAG);
 
 	// Set carry flag if A < u8 + carry flag
-	temp < ((*mMap)[reg_PC.dat + 1] + GET_CARRY_FLAG) ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
+	temp < (fetchByte(1) + GET_CARRY_FLAG) ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
 
 	// Set zero flag if A == u8 + carry flag
 	reg_AF.hi == 0 ? SET_ZERO_FLAG : UNSET_ZERO_FLAG;
 
 	reg_PC.dat += 2;
-	debugPrint("SBC A, %02X\n", (*mMap)[reg_PC.dat + 1]);
+	debugPrint("SBC A, %02X\n", fetchByte(1));
 	return 8;
 }
 
@@ -3649,8 +3647,7 @@ int CPU::SBC_A_u8()
 // Call subroutine at address 0x0018.
 int CPU::RST_18H()
 {
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) >> 8);
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) & 0xFF);
+	mMap->push16(reg_SP.dat, reg_PC.dat + 1);
 	reg_PC.dat = 0x0018;
 	debugPrint("RST 18H\n");
 	return 16;
@@ -3659,9 +3656,9 @@ int CPU::RST_18H()
 // Load A into (0xFF00 + a8)
 int CPU::LDH_a8_A()
 {
-	mMap->writeMemory(0xFF00 + (*mMap)[reg_PC.dat + 1], reg_AF.hi);
+	mMap->writeMemory(0xFF00 + fetchByte(1), reg_AF.hi);
 	reg_PC.dat += 2;
-	debugPrint("LDH (%02X), A\n", (*mMap)[reg_PC.dat + 1]);
+	debugPrint("LDH (%02X), A\n", fetchByte(1));
 	return 12;
 }
 
@@ -3669,8 +3666,7 @@ int CPU::LDH_a8_A()
 // Pop 16-bit value from stack into HL.
 int CPU::POP_HL()
 {
-	reg_HL.dat = (*mMap)[reg_SP.dat] | ((*mMap)[reg_SP.dat + 1] << 8);
-	reg_SP.dat += 2;
+	reg_HL.dat = mMap->pop16(reg_SP.dat);
 	reg_PC.dat += 1;
 	debugPrint("POP HL\n");
 	return 12;
@@ -3690,8 +3686,7 @@ int CPU::LDH_C_A()
 // Push HL onto stack.
 int CPU::PUSH_HL()
 {
-	mMap->writeMemory(--reg_SP.dat, reg_HL.hi);
-	mMap->writeMemory(--reg_SP.dat, reg_HL.lo);
+	mMap->push16(reg_SP.dat, reg_HL.dat);
 	reg_PC.dat += 1;
 	debugPrint("PUSH HL\n");
 	return 16;
@@ -3700,7 +3695,7 @@ int CPU::PUSH_HL()
 //
 int CPU::AND_A_u8()
 {
-	reg_AF.hi &= (*mMap)[reg_PC.dat + 1];
+	reg_AF.hi &= fetchByte(1);
 	reg_PC.dat += 2;
 
 	// Set flags
@@ -3715,8 +3710,7 @@ int CPU::AND_A_u8()
 // Call subroutine at address 0x0020.
 int CPU::RST_20H()
 {
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) >> 8);
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) & 0xFF);
+	mMap->push16(reg_SP.dat, reg_PC.dat + 1);
 	reg_PC.dat = 0x0020;
 	debugPrint("RST 20H\n");
 	return 16;
@@ -3730,12 +3724,12 @@ int CPU::ADD_SP_i8()
 	UNSET_SUBTRACT_FLAG;
 
 	// Set half carry flag if overflowed 3rd bit
-	((reg_SP.dat & 0x0F) + ((SByte)(*mMap)[reg_PC.dat + 1] & 0x0F)) & 0x10 ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
+	((reg_SP.dat & 0x0F) + ((SByte)fetchByte(1) & 0x0F)) & 0x10 ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
 
 	// Set carry flag if overflowed 7th bit
-	((reg_SP.dat & 0xFF) + ((SByte)(*mMap)[reg_PC.dat + 1] & 0xFF)) & 0x100 ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
+	((reg_SP.dat & 0xFF) + ((SByte)fetchByte(1) & 0xFF)) & 0x100 ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
 
-	reg_SP.dat += (SByte)(*mMap)[reg_PC.dat + 1];
+	reg_SP.dat += (SByte)fetchByte(1);
 
 	reg_PC.dat += 2;
 	debugPrint("ADD SP, i8\n");
@@ -3754,9 +3748,9 @@ int CPU::JP_HL()
 // Load A into (u16)
 int CPU::LD_u16_A()
 {
-	// u16 is ((*mMap)[reg_PC.dat + 1] << 8) | (*mMap)[reg_PC.dat + 2]
+	// u16 follows the opcode, low byte first
 	// Writing the value of A into the (u16)
-	mMap->writeMemory((*mMap)[reg_PC.dat + 2] << 8 | (*mMap)[reg_PC.dat + 1], reg_AF.hi);
+	mMap->writeMemory(fetchWord(1), reg_AF.hi);
 	reg_PC.dat += 3;
 	debugPrint("LD (u16), A\n");
 	return 16;
@@ -3773,13 +3767,13 @@ int CPU::XOR_A_u8()
 	// Unset half carry flag
 	UNSET_HALF_CARRY_FLAG;
 
-	reg_AF.hi ^= (*mMap)[reg_PC.dat + 1];
+	reg_AF.hi ^= fetchByte(1);
 
 	// Set zero flag if A == u8
 	reg_AF.hi ? UNSET_ZERO_FLAG : SET_ZERO_FLAG;
 
 	reg_PC.dat += 2;
-	debugPrint("XOR A, %02X\n", (*mMap)[reg_PC.dat + 1]);
+	debugPrint("XOR A, %02X\n", fetchByte(1));
 	return 8;
 }
 
@@ -3787,8 +3781,7 @@ int CPU::XOR_A_u8()
 // Call subroutine at address 0x0028.
 int CPU::RST_28H()
 {
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) >> 8);
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) & 0xFF);
+	mMap->push16(reg_SP.dat, reg_PC.dat + 1);
 	reg_PC.dat = 0x0028;
 	debugPrint("RST 28H\n");
 	return 16;
@@ -3798,9 +3791,9 @@ int CPU::RST_28H()
 // Load (0xFF00 + a8) into A
 int CPU::LDH_A_a8()
 {
-	reg_AF.hi = (*mMap)[0xFF00 + (*mMap)[reg_PC.dat + 1]];
+	reg_AF.hi = (*mMap)[0xFF00 + fetchByte(1)];
 	reg_PC.dat += 2;
-	debugPrint("LD A, (FF00+%02X)\n", (*mMap)[reg_PC.dat + 1]);
+	debugPrint("LD A, (FF00+%02X)\n", fetchByte(1));
 	return 12;
 }
 
@@ -3808,8 +3801,8 @@ int CPU::LDH_A_a8()
 // Pop 16-bit value from stack into AF.
 int CPU::POP_AF()
 {
-	reg_AF.dat = (*mMap)[reg_SP.dat] & 0xF0 | ((*mMap)[reg_SP.dat + 1] << 8);
-	reg_SP.dat += 2;
+	// The lower 4 bits of F always read 0
+	reg_AF.dat = mMap->pop16(reg_SP.dat) & 0xFFF0;
 	reg_PC.dat += 1;
 	debugPrint("POP AF\n");
 	return 12;
@@ -3841,8 +3834,7 @@ int CPU::DI()
 // Push AF onto stack.
 int CPU::PUSH_AF()
 {
-	mMap->writeMemory(--reg_SP.dat, reg_AF.hi);
-	mMap->writeMemory(--reg_SP.dat, reg_AF.lo);
+	mMap->push16(reg_SP.dat, reg_AF.dat);
 	reg_PC.dat += 1;
 	debugPrint("PUSH AF\n");
 	return 16;
@@ -3859,13 +3851,13 @@ int CPU::OR_A_u8()
 	// Unset half carry flag
 	UNSET_HALF_CARRY_FLAG;
 
-	reg_AF.hi |= (*mMap)[reg_PC.dat + 1];
+	reg_AF.hi |= fetchByte(1);
 
 	// Set zero flag if A == u8
 	reg_AF.hi ? UNSET_ZERO_FLAG : SET_ZERO_FLAG;
 
 	reg_PC.dat += 2;
-	debugPrint("OR A, %02X\n", (*mMap)[reg_PC.dat + 1]);
+	debugPrint("OR A, %02X\n", fetchByte(1));
 	return 8;
 }
 
@@ -3873,8 +3865,7 @@ int CPU::OR_A_u8()
 // Call subroutine at address 0x0030.
 int CPU::RST_30H()
 {
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) >> 8);
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) & 0xFF);
+	mMap->push16(reg_SP.dat, reg_PC.dat + 1);
 	reg_PC.dat = 0x0030;
 	debugPrint("RST 30H\n");
 	return 16;
@@ -3888,12 +3879,12 @@ int CPU::LD_HL_SP_i8()
 	UNSET_SUBTRACT_FLAG;
 
 	// Set half carry flag if overflowed 3rd bit
-	((reg_SP.dat & 0x0F) + ((SByte)(*mMap)[reg_PC.dat + 1] & 0x0F)) & 0x10 ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
+	((reg_SP.dat & 0x0F) + ((SByte)fetchByte(1) & 0x0F)) & 0x10 ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
 
 	// Set carry flag if overflowed 7th bit
-	((reg_SP.dat & 0xFF) + ((SByte)(*mMap)[reg_PC.dat + 1] & 0xFF)) & 0x100 ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
+	((reg_SP.dat & 0xFF) + ((SByte)fetchByte(1) & 0xFF)) & 0x100 ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
 
-	reg_HL.dat = reg_SP.dat + (SByte)(*mMap)[reg_PC.dat + 1];
+	reg_HL.dat = reg_SP.dat + (SByte)fetchByte(1);
 	reg_PC.dat += 2;
 	return 12;
 }
@@ -3911,7 +3902,7 @@ int CPU::LD_SP_HL()
 // Load (u16) into A
 int CPU::LD_A_u16()
 {
-	reg_AF.hi = (*mMap)[((*mMap)[reg_PC.dat + 2] << 8) | (*mMap)[reg_PC.dat + 1]];
+	reg_AF.hi = (*mMap)[fetchWord(1)];
 	reg_PC.dat += 3;
 	debugPrint("LD A, (HL)\n");
 	return 16;
@@ -3937,16 +3928,16 @@ int CPU::CP_u8()
 	SET_SUBTRACT_FLAG;
 
 	// Set half carry flag if lower nibble of A is less than lower nibble of u8
-	(reg_AF.hi & 0x0F) < ((*mMap)[reg_PC.dat + 1] & 0x0F) ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
+	(reg_AF.hi & 0x0F) < (fetchByte(1) & 0x0F) ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
 
 	// Set carry flag if A is less than u8
-	reg_AF.hi < (*mMap)[reg_PC.dat + 1] ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
+	reg_AF.hi < fetchByte(1) ? SET_CARRY_FLAG : UNSET_CARRY_FLAG;
 
 	// Set zero flag if A == u8
-	reg_AF.hi == (*mMap)[reg_PC.dat + 1] ? SET_ZERO_FLAG : UNSET_ZERO_FLAG;
+	reg_AF.hi == fetchByte(1) ? SET_ZERO_FLAG : UNSET_ZERO_FLAG;
 
 	reg_PC.dat += 2;
-	debugPrint("CP A, %02X\n", (*mMap)[reg_PC.dat + 1]);
+	debugPrint("CP A, %02X\n", fetchByte(1));
 	return 8;
 }
 
@@ -3954,13 +3945,27 @@ int CPU::CP_u8()
 // Call subroutine at address 0x0038.
 int CPU::RST_38H()
 {
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) >> 8);
-	mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) & 0xFF);
+	mMap->push16(reg_SP.dat, reg_PC.dat + 1);
 	reg_PC.dat = 0x0038;
 	debugPrint("RST 38H\n");
 	return 16;
 }
 
+// Fetches through readMemory and caches the page of address
+// if it can be read directly, see CPU::fetchByte()
+Byte CPU::fetchByteSlow(Word address)
+{
+	pcPage = mMap->getReadPage(address >> 8);
+	if (!pcPage)
+	{
+		pcPageNumber = -1;
+		return mMap->readMemory(address);
+	}
+
+	pcPageNumber = address >> 8;
+	return pcPage[address & 0xFF];
+}
+
 int CPU::executeInstruction(Byte opcode)
 {
 	return (this->*method_pointer[opcode])();
@@ -3968,18 +3973,201 @@ int CPU::executeInstruction(Byte opcode)
 
 int CPU::executeNextInstruction()
 {
+	// Run the recompiled block starting at PC if there is one
+	// Anything else falls back to the interpreter, as does
+	// everything during OAM DMA, when ROM is off the bus
+	// Modules are built from bank 1, other banks are interpreted
+	if (recompiledBlocks && reg_PC.dat < RECOMPILED_ROM_SIZE && recompiledBlocks[reg_PC.dat] && !mMap->isDMAActive()
+		&& (reg_PC.dat < 0x4000 || mMap->getRomBank() == 1))
+		return recompiledBlocks[reg_PC.dat](this);
+
 	// Get the opcode
-	Byte opcode = (*mMap)[reg_PC.dat];
+	Byte opcode = fetchByte(0);
+
+	// Loops start with one of these opcodes
+	if (fusionEnabled && (opcode == 0x22 || opcode == 0x2A || opcode == 0x32 || opcode == 0xF0))
+	{
+		int cycles = executeFused(opcode);
+		if (cycles)
+			return cycles;
+	}
+
 	return (this->*method_pointer[opcode])();
 }
 
 int CPU::executePrefixedInstruction()
 {
 	// Get the opcode
-	Byte opcode = (*mMap)[reg_PC.dat];
+	Byte opcode = fetchByte(0);
 	return (this->*prefixed_method_pointer[opcode])();
 }
 
+// Cycles a fused loop or a recompiled block may take
+// Nothing outside the CPU may change memory or raise an
+// interrupt in that time, so the loop can't observe the difference
+int CPU::cyclesToNextEvent()
+{
+	int budget = maxFusedCycles;
+
+	// The PPU is run with the cycles of the last interrupt too
+	if (ppu)
+		budget = std::min(budget, ppu->getCyclesToNextEvent() - interruptCycles);
+
+	// TIMA must not overflow nor OAM DMA end, see MemoryMap::advanceClock()
+	budget = (int)std::min<unsigned long long>(budget, mMap->getCyclesToTimerEvent() - 1);
+
+	return budget;
+}
+
+// Runs the loop starting at PC as one operation
+// Returns the cycles taken, or 0 to interpret the opcode instead
+int CPU::executeFused(Byte opcode)
+{
+	// A pending interrupt would be serviced after the first opcode
+	if (mMap->getPendingInterrupts())
+		return 0;
+
+	switch (opcode)
+	{
+	case 0x2A:
+		return fuseCopyLoop();
+	case 0x22:
+	case 0x32:
+		return fuseFillLoop(opcode);
+	case 0xF0:
+		return fusePollLoop();
+	default:
+		return 0;
+	}
+}
+
+// memcpy
+// LD A, (HL+)
+// LD (DE), A
+// INC DE
+// DEC BC
+// LD A, B
+// OR C
+// JR NZ, -8
+int CPU::fuseCopyLoop()
+{
+	static const Byte pattern[8] = { 0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1, 0x20, 0xF8 };
+	for (int i = 1; i < 8; i++)
+		if (fetchByte(i) != pattern[i])
+			return 0;
+
+	// 52 cycles an iteration, 48 for the last as the jump is not taken
+	int count = reg_BC.dat ? reg_BC.dat : 0x10000;
+	int iterations = std::min(count, cyclesToNextEvent() / 52);
+	if (iterations <= 0 || !mMap->copyBlock(reg_DE.dat, reg_HL.dat, iterations))
+		return 0;
+
+	reg_HL.dat += iterations;
+	reg_DE.dat += iterations;
+	reg_BC.dat -= iterations;
+
+	// LD A, B and OR C leave B | C in A
+	// OR unsets every flag but zero
+	reg_AF.hi = reg_BC.hi | reg_BC.lo;
+	reg_AF.lo = reg_AF.hi ? 0x00 : FLAG_ZERO_z;
+
+	debugPrint("Fused copy of %d bytes\n", iterations);
+	if (iterations == count)
+	{
+		reg_PC.dat += 8;
+		return (iterations * 52) - 4;
+	}
+	return iterations * 52;
+}
+
+// memset
+// LD (HL+), A or LD (HL-), A
+// DEC B or DEC C
+// JR NZ, -4
+int CPU::fuseFillLoop(Byte opcode)
+{
+	Byte decrement = fetchByte(1);
+	if ((decrement != 0x05 && decrement != 0x0D) || fetchByte(2) != 0x20 || fetchByte(3) != 0xFC)
+		return 0;
+
+	Byte& counter = (decrement == 0x05) ? reg_BC.hi : reg_BC.lo;
+	int step = (opcode == 0x22) ? 1 : -1;
+
+	// 24 cycles an iteration, 20 for the last as the jump is not taken
+	int count = counter ? counter : 0x100;
+	int iterations = std::min(count, cyclesToNextEvent() / 24);
+	if (iterations <= 0 || !mMap->fillBlock(reg_HL.dat, reg_AF.hi, iterations, step))
+		return 0;
+
+	reg_HL.dat += iterations * step;
+	counter -= iterations;
+
+	// Flags of the last DEC, carry is left alone
+	reg_AF.lo = (reg_AF.lo & FLAG_CARRY_c) | FLAG_SUBTRACT_n;
+	counter ? UNSET_ZERO_FLAG : SET_ZERO_FLAG;
+	((counter & 0x0F) == 0x0F) ? SET_HALF_CARRY_FLAG : UNSET_HALF_CARRY_FLAG;
+
+	debugPrint("Fused fill of %d bytes\n", iterations);
+	if (iterations == count)
+	{
+		reg_PC.dat += 4;
+		return (iterations * 24) - 4;
+	}
+	return iterations * 24;
+}
+
+// Polling an I/O register or a variable in high RAM
+// LDH A, (u8)
+// AND u8 or CP u8
+// JR Z, -6 or JR NZ, -6
+int CPU::fusePollLoop()
+{
+	Byte port = fetchByte(1);
+	Byte operation = fetchByte(2);
+	Byte operand = fetchByte(3);
+	Byte jump = fetchByte(4);
+	if ((operation != 0xE6 && operation != 0xFE) || (jump != 0x28 && jump != 0x20) || fetchByte(5) != 0xFA)
+		return 0;
+
+	// DIV and TIMA count on their own between events
+	if (port == 0x04 || port == 0x05)
+		return 0;
+
+	// The value can't change until the next event
+	// so every iteration reads it and sets the same flags
+	Byte value = (*mMap)[0xFF00 + port];
+	Byte flags;
+	if (operation == 0xE6)
+	{
+		value &= operand;
+		flags = (value ? 0x00 : FLAG_ZERO_z) | FLAG_HALF_CARRY_h;
+	}
+	else
+	{
+		flags = FLAG_SUBTRACT_n;
+		flags |= (value == operand) ? FLAG_ZERO_z : 0x00;
+		flags |= ((value & 0x0F) < (operand & 0x0F)) ? FLAG_HALF_CARRY_h : 0x00;
+		flags |= (value < operand) ? FLAG_CARRY_c : 0x00;
+	}
+
+	// Leaving the loop is left to the interpreter
+	bool zero = flags & FLAG_ZERO_z;
+	if (zero != (jump == 0x28))
+		return 0;
+
+	// 32 cycles an iteration
+	// Input isn't an event, so come back every scanline to see it
+	int iterations = std::min(cyclesToNextEvent(), maxPollCycles) / 32;
+	if (iterations <= 0)
+		return 0;
+
+	reg_AF.hi = value;
+	reg_AF.lo = flags;
+
+	debugPrint("Fused %d polls of %02X\n", iterations, port);
+	return iterations * 32;
+}
+
 // RLC B
 // Rotate B left
 int CPU::RLC_B()
@@ -7776,6 +7964,8 @@ int CPU::SET_7_A()
 // Behaviour source: https://gbdev.io/pandocs/Interrupts.html
 int CPU::performInterrupt()
 {
+	interruptCycles = 0;
+
 	// check if interrupts must be enabled
 	// after execution of opcode after EI
 	// look at CPU::EI() for more info
@@ -7787,11 +7977,18 @@ int CPU::performInterrupt()
 	if (!IMEFlag)
 		IMEFlag = 1;
 
+	// Nothing requested and enabled, the common case
+	// IE & IF is kept up to date by the memory map
+	Byte pending = mMap->getPendingInterrupts();
+	if (!pending)
+		return 0;
+
 	// If IME is disabled
 	// don't perform interrupt
+	// but a pending interrupt still ends HALT
 	if (!IMEReg)
 	{
-		if (isHalted && ((mMap->getRegIE() & mMap->getRegIF()) & 0x1F))
+		if (isHalted)
 		{
 			isHalted = false;
 			reg_PC.dat += 1;
@@ -7799,84 +7996,126 @@ int CPU::performInterrupt()
 		return 0;
 	}
 
-	// Loop through all interrupts
-	// In the priority order listed above
-	for (int i = 0; i < 5; i++)
+	// The lowest set bit has the highest priority
+	// in the order listed in cpu.h
+	int i = std::countr_zero(pending);
+
+	// Disable IME
+	// Also cancel an enable still pending from EI or RETI
+	// or IME would come back on inside the handler
+	IMEReg = false;
+	IMEFlag = -1;
+
+	// Clear the interrupt flag as we are servicing it
+	mMap->writeMemory(0xFF0F, mMap->getRegIF() ^ (1 << i));
+
+	// Push PC onto stack if not halted
+	// if halted, push PC + 1
+	// and resume CPU execution
+	if (!isHalted)
 	{
-		// Check if interrupt is enabled (IE at 0xFFFF), requested (IF at 0xFF0F) and IME is enabled
-		if (((mMap->getRegIF() >> i) & 1) && ((mMap->getRegIE() >> i) & 1))
-		{
-			// Disable IME
-			IMEReg = false;
-
-			// Clear the interrupt flag as we are servicing it
-			mMap->writeMemory(0xFF0F, mMap->getRegIF() ^ (1 << i));
-
-			// Push PC onto stack if not halted
-			// if halted, push PC + 1
-			// and resume CPU execution
-			if (!isHalted)
-			{
-				mMap->writeMemory(--reg_SP.dat, (reg_PC.dat) >> 8);
-				mMap->writeMemory(--reg_SP.dat, (reg_PC.dat) & 0xFF);
-			}
-			else
-			{
-				mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) >> 8);
-				mMap->writeMemory(--reg_SP.dat, (reg_PC.dat + 1) & 0xFF);
-				isHalted = false;
-			}
-
-			// Jump to interrupt address
-			// given in the interrupts array in cpu.h
-			reg_PC.dat = interrupts[i];
-
-			// Return 20 cycles
-			return 20;
-		}
+		mMap->push16(reg_SP.dat, reg_PC.dat);
+	}
+	else
+	{
+		mMap->push16(reg_SP.dat, reg_PC.dat + 1);
+		isHalted = false;
 	}
 
-	// No interrupt to service
-	// Return 0 cycles
-	return 0;
+	// Jump to interrupt address
+	// given in the interrupts array in cpu.h
+	reg_PC.dat = interrupts[i];
+
+	// Return 20 cycles
+	interruptCycles = 20;
+	return 20;
 }
 
 // Updates the DIV and TIMA timers
-// Calls for interrupts if necessary
+// They are computed from the clock when read, only a TIMA overflow
+// does any work here, see MemoryMap::advanceClock()
 // Behaviour source: https://gbdev.io/pandocs/Timer_and_Divider_Registers.html
 void CPU::updateTimers(int cycles)
 {
-	// Update the reg_DIV register
-	// Every 256 cycles
-	timer_counter.div += cycles;
+	mMap->advanceClock(cycles);
+}
 
-	if (timer_counter.div >= 0xFF)
+// Returns the architectural state of the CPU
+// While halted the PC is kept on the HALT opcode, see CPU::HALT()
+// but architecturally it already points past it
+CPUState CPU::getState()
+{
+	CPUState state;
+	state.AF = reg_AF.dat;
+	state.BC = reg_BC.dat;
+	state.DE = reg_DE.dat;
+	state.HL = reg_HL.dat;
+	state.SP = reg_SP.dat;
+	state.PC = isHalted ? reg_PC.dat + 1 : reg_PC.dat;
+	state.IME = IMEReg;
+	state.halted = isHalted;
+	return state;
+}
+
+// Sets the architectural state of the CPU
+// The inverse of CPU::getState()
+void CPU::setState(const CPUState& state)
+{
+	reg_AF.dat = state.AF;
+	reg_BC.dat = state.BC;
+	reg_DE.dat = state.DE;
+	reg_HL.dat = state.HL;
+	reg_SP.dat = state.SP;
+	isHalted = state.halted;
+	reg_PC.dat = isHalted ? state.PC - 1 : state.PC;
+	IMEReg = state.IME;
+	IMEFlag = state.IME ? 1 : -1;
+}
+
+// Loads a shared library built by gbrecomp
+// Modules built from another ROM or another revision of the CPU are rejected
+bool CPU::loadRecompiledModule(const char* path, unsigned long long romHash)
+{
+	typedef const RecompiledModule* (*module_function)();
+
+#ifdef _WIN32
+	HMODULE handle = LoadLibraryA(path);
+	if (!handle)
 	{
-		timer_counter.div -= 0xFF;
-		mMap->updateDividerRegister();
+		printf("Recompiled module %s not loaded\n", path);
+		return false;
 	}
-
-	// check if timer is enabled
-	if (mMap->getRegTAC() & 0x04)
+	module_function getModule = (module_function)GetProcAddress(handle, RECOMPILED_MODULE_SYMBOL);
+#else
+	void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
 	{
-		// get the frequency from reg_TAC
-		int freq = timer_counter.time_modes[mMap->getRegTAC() & 0x03];
+		printf("Recompiled module %s not loaded: %s\n", path, dlerror());
+		return false;
+	}
+	module_function getModule = (module_function)dlsym(handle, RECOMPILED_MODULE_SYMBOL);
+#endif
 
-		// check if TIMA has been overwritten by code
-		if ((timer_counter.tima / freq) != mMap->getRegTIMA())
-			timer_counter.tima = ((mMap->getRegTIMA()) * freq) + (timer_counter.tima % freq);
+	const RecompiledModule* module = getModule ? getModule() : nullptr;
+	if (!module || module->version != RECOMPILED_MODULE_VERSION || !module->abi[0] || strcmp(module->abi, RECOMPILED_MODULE_ABI) != 0 || module->romHash != romHash)
+	{
+		printf("Recompiled module %s does not match this ROM or build\n", path);
+#ifdef _WIN32
+		FreeLibrary(handle);
+#else
+		dlclose(handle);
+#endif
+		return false;
+	}
 
-		// increment the counter
-		timer_counter.tima += cycles;
+	if (!recompiledBlocks)
+		recompiledBlocks = new RecompiledFunction[RECOMPILED_ROM_SIZE];
+	std::fill(recompiledBlocks, recompiledBlocks + RECOMPILED_ROM_SIZE, nullptr);
 
-		// reset reg_TIMA by value of reg_TMA if overflow and call interrupt
-		if (timer_counter.tima > (0xFF * freq))
-		{
-			timer_counter.tima = (mMap->getRegTMA() * freq);
-			mMap->setRegIF(TIMER);
-		}
+	for (unsigned int i = 0; i < module->blockCount; i++)
+		recompiledBlocks[module->blocks[i].address] = module->blocks[i].execute;
 
-		// Write reg_TIMA value by calculting from our counter
-		mMap->setRegTIMA(timer_counter.tima / freq);
-	}
+	recompiledModule = (void*)handle;
+	printf("Loaded %u recompiled blocks from %s\n", module->blockCount, path);
+	return true;
 }
\ No newline at end of file
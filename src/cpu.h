@@ -2,6 +2,7 @@
 #include "types.h"
 #include "mmap.h"
 #include "graphics.h"
+#include "recompiled.h"
 
 // CPU Register
 // Pulled from https://gbdev.io/pandocs/CPU_Registers_and_Flags.html
@@ -18,11 +19,35 @@ union Register
 	};
 };
 
+// Architectural state of a CPU
+// Used to compare CPU engines and to start them from a known state
+struct CPUState
+{
+	Word AF;
+	Word BC;
+	Word DE;
+	Word HL;
+	Word SP;
+	Word PC;
+
+	// Interrupt master enable
+	bool IME;
+
+	// Waiting for an interrupt after HALT
+	bool halted;
+};
+
+// The registers the DMG boot ROM leaves
+// Pulled from https://gbdev.io/pandocs/Power_Up_Sequence.html#cpu-registers
+const CPUState POST_BOOT_STATE = { 0x01B0, 0x0013, 0x00D8, 0x014D, 0xFFFE, 0x0100, false, false };
+
 // CPU
 // Pulled from https://gbdev.io/pandocs/CPU_Registers_and_Flags.html
 // Contains all the registers and flags
 class CPU
 {
+	// Blocks emitted by gbrecomp call the opcode methods directly
+	friend struct RecompiledBlocks;
 
 private:
 	// Accumulator and Flags
@@ -89,24 +114,64 @@ private:
 		JOYPAD = 0x10
 	};
 
-	// Timer counter structs
-	// Pulled from https://gbdev.io/pandocs/Timer_and_Divider_Registers.html
-	// div increments mMap->reg_DIV at 16384Hz
-	// tima increments mMap->reg_TIMA at the frequency specified by mMap->reg_TAC
-	// time_modes is the frequency of the timer corresponding to
-	// first two bits of mMap->reg_TAC
-	struct
-	{
-		int div;
-		int tima;
-		int time_modes[4] = { 1024, 16, 64, 256 };
-	} timer_counter;
-
 	// Memory Map
 	MemoryMap* mMap;
 
 	PPU* ppu;
 
+	// Recompiled blocks indexed by address
+	// nullptr where no block starts or no module is loaded
+	RecompiledFunction* recompiledBlocks;
+
+	// Handle of the loaded recompiled module
+	void* recompiledModule;
+
+	// Page of memory PC was last fetched from
+	// Opcodes and immediates are read straight from it while
+	// PC stays in the page, see MemoryMap::getReadPage()
+	// pcPageNumber is -1 when nothing is cached, the memory map
+	// sets it so whenever pages are remapped
+	Byte* pcPage;
+	int pcPageNumber;
+
+	// Reads the byte at PC + offset
+	Byte fetchByte(Word offset)
+	{
+		Word address = reg_PC.dat + offset;
+		if ((address >> 8) == pcPageNumber)
+			return pcPage[address & 0xFF];
+		return fetchByteSlow(address);
+	}
+
+	// Reads the little endian word at PC + offset
+	Word fetchWord(Word offset)
+	{
+		Word address = reg_PC.dat + offset;
+		if ((address >> 8) == pcPageNumber && (address & 0xFF) != 0xFF)
+			return pcPage[address & 0xFF] | (pcPage[(address & 0xFF) + 1] << 8);
+		return fetchByte(offset) | (fetchByte(offset + 1) << 8);
+	}
+
+	Byte fetchByteSlow(Word address);
+
+	// Superinstructions
+	// Common loops are recognised at their first opcode and run
+	// for as many whole iterations as fit before the next PPU or
+	// timer event, taking exactly the cycles the single opcodes would
+	bool fusionEnabled;
+
+	// Cycles of the last interrupt dispatch
+	// The update loop hands them to the PPU with the next instruction
+	int interruptCycles;
+
+	// Most cycles a fused loop may take without a PPU to bound it
+	const int maxFusedCycles = 4096;
+
+	// Most cycles a fused polling loop may take, one scanline
+	// Input is only picked up between instructions, so a loop
+	// waiting on it must not run much longer than the interpreter would
+	const int maxPollCycles = 456;
+
 	// ISA
 	// Pulled from https://izik1.github.io/gbops/index.html
 	typedef int (CPU::*method_function)();
@@ -1132,6 +1197,15 @@ private:
 	int SET_7_HLp();
 	int SET_7_A();
 
+	// Fused loops, see CPU::executeFused()
+	// Return 0 when the loop can't be fused
+	// Recompiled blocks use cyclesToNextEvent() too
+	int cyclesToNextEvent();
+	int executeFused(Byte opcode);
+	int fuseCopyLoop();
+	int fuseFillLoop(Byte opcode);
+	int fusePollLoop();
+
 public:
 	const int clockSpeed = 4194304; // 4.194304 MHz CPU
 	const int clockSpeedPerFrame = 70224; // 4194304 / 59.73fps
@@ -1139,11 +1213,19 @@ public:
 	CPU();
 
 	// set the memory map
-	void setMemory(MemoryMap* memory) { mMap = memory; }
+	void setMemory(MemoryMap* memory)
+	{
+		mMap = memory;
+		mMap->addPageCache(&pcPageNumber);
+		pcPageNumber = -1;
+	}
 
 	// set the PPU
 	void setPPU(PPU* ppu_arg) { ppu = ppu_arg; }
 
+	// enable or disable superinstructions
+	void setFusion(bool enabled) { fusionEnabled = enabled; }
+
 	// set the Accumulator
 	void set_reg_A(Byte value) { reg_AF.hi = value; }
 
@@ -1170,4 +1252,14 @@ public:
 
 	// update the timers
 	void updateTimers(int cycles);
+
+	// get the architectural state
+	CPUState getState();
+
+	// set the architectural state
+	void setState(const CPUState& state);
+
+	// load blocks built by gbrecomp for the ROM with the given hash
+	// must only be called once the boot ROM is unmapped
+	bool loadRecompiledModule(const char* path, unsigned long long romHash);
 };
@@ -1,10 +1,57 @@
 #include "types.h"
 #include "cpu.h"
 #include "gameBoy.h"
+#include "hash.h"
+#include <cstring>
+#include <string>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 
 int GBE::s_Cycles;
 
-GBE::GBE()
+// Boot snapshot files start with this header
+// followed by the CPU, MemoryMap and PPU state
+// The sizes reject snapshots saved by another build, the version
+// changes with what is saved where the sizes don't show it
+struct BootSnapshotHeader
+{
+	char magic[8];
+	int version;
+	unsigned long long key;
+
+	// Sizes of the classes saved, like recompiled modules check
+	unsigned int cpuStateSize;
+	unsigned int memoryMapSize;
+	unsigned int ppuSize;
+
+	// Bytes MemoryMap::saveState() and PPU::saveState() wrote
+	long memoryStateSize;
+	long ppuStateSize;
+};
+
+static const char BOOT_SNAPSHOT_MAGIC[8] = "GBEBOOT";
+static const int BOOT_SNAPSHOT_VERSION = 2;
+
+// Returns the header a snapshot for key saved by this build starts with
+// The state sizes are left to be filled in
+static BootSnapshotHeader makeBootSnapshotHeader(unsigned long long key)
+{
+	BootSnapshotHeader header;
+	memset(&header, 0x00, sizeof(header));
+	memcpy(header.magic, BOOT_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = BOOT_SNAPSHOT_VERSION;
+	header.key = key;
+	header.cpuStateSize = sizeof(CPUState);
+	header.memoryMapSize = sizeof(MemoryMap);
+	header.ppuSize = sizeof(PPU);
+	return header;
+}
+
+GBE::GBE(bool skipBoot, int frameSkip)
 {
 	// Initialize the CPU
 	gbe_cpu = new CPU();
@@ -23,19 +70,28 @@ GBE::GBE()
 
 	// Unify the PPU and MmeoryMap
 	gbe_graphics->setMemoryMap(gbe_mMap);
+	gbe_graphics->setFrameSkip(frameSkip);
 
 	gbe_graphics->init();
 
 	// Open the Boot ROM
-	if ((bootROM = fopen("../src/dmg_boot.gb", "rb")) == NULL)
-		printf("boot rom file not opened");
+	// Without one the game starts from the state it leaves
+	bootROM = NULL;
+	bootROMPath = "../src/dmg_boot.gb";
+	if (!skipBoot && (bootROM = fopen(bootROMPath, "rb")) == NULL)
+	{
+		printf("boot rom file not opened, skipping boot\n");
+		skipBoot = true;
+	}
 
 	// Open the Game ROM
-	if ((gameROM = fopen("../tests/halt_bug.gb", "rb")) == NULL)
+	gameROMPath = "../tests/halt_bug.gb";
+	if ((gameROM = fopen(gameROMPath, "rb")) == NULL)
 		printf("game rom file not opened");
 
 	// Set the Boot ROM
-	gbe_mMap->setBootRomFile(bootROM);
+	if (bootROM)
+		gbe_mMap->setBootRomFile(bootROM);
 
 	// Set the Game ROM
 	gbe_mMap->setRomFile(gameROM);
@@ -43,11 +99,60 @@ GBE::GBE()
 	// Map to ROMs to mMap
 	gbe_mMap->mapRom();
 
+	// Battery backed RAM lives in a save file next to the ROM
+	gbe_mMap->loadSaveRam((std::string(gameROMPath) + ".sav").c_str());
+
 	s_Cycles = 0;
 
+	if (skipBoot)
+		skipBootROM();
+	else
+		executeBootROM();
+
+	loadRecompiledModule();
+
+	update();
+}
+
+void GBE::update()
+{
+	// Update function of the GBE
+	// Will be called every frame
+	// GB has 59.73 frames per second
+	unsigned long long nextSaveFlush = gbe_mMap->getClock() + gbe_cpu->clockSpeed;
+	while (true)
+	{
+		// Execute the next instruction
+		s_Cycles += gbe_cpu->executeNextInstruction();
+
+		// update the DIV and TIMA timers
+		gbe_cpu->updateTimers(s_Cycles);
+		gbe_graphics->executePPU(s_Cycles);
+		s_Cycles = 0;
+		s_Cycles += gbe_cpu->performInterrupt();
+		if (gbe_graphics->pollEvents())
+			break;
+
+		// Hand changed save RAM to the system once a second
+		if (gbe_mMap->getClock() >= nextSaveFlush)
+		{
+			gbe_mMap->flushSaveRam(false);
+			nextSaveFlush += gbe_cpu->clockSpeed;
+		}
+	}
+
+	// Wait for the save to reach the disk before quitting
+	gbe_mMap->flushSaveRam(true);
+}
+
+void GBE::executeBootROM()
+{
+	// The boot ROM is mapped over the start of the header
+	// Hashed before the logo patch, which is the same for every ROM
+	unsigned long long key = hashBytes(gbe_mMap->getRomBank0(), 0x150);
+
 	// Adding the Nintendo Logo to ROM
 	// to pass the Boot check
-
 	gbe_mMap->debugWriteMemory(0x104, 0xCE);
 	gbe_mMap->debugWriteMemory(0x105, 0xED);
 	gbe_mMap->debugWriteMemory(0x106, 0x66);
@@ -97,40 +202,137 @@ GBE::GBE()
 	gbe_mMap->debugWriteMemory(0x132, 0x33);
 	gbe_mMap->debugWriteMemory(0x133, 0x3E);
 
-	executeBootROM();
-
-	update();
-}
+	// Another run with the same boot ROM and header already went through it
+	std::string snapshot = getBootSnapshotPath(key);
+	if (loadBootSnapshot(snapshot, key))
+	{
+		gbe_mMap->unloadBootRom();
+		return;
+	}
 
-void GBE::update()
-{
-	// Update function of the GBE
-	// Will be called every frame
-	// GB has 59.73 frames per second
-	while (true)
+	while (gbe_mMap->readMemory(0xFF50) == 0x00)
 	{
-		// Execute the next instruction
 		s_Cycles += gbe_cpu->executeNextInstruction();
-
-		// update the DIV and TIMA timers
 		gbe_cpu->updateTimers(s_Cycles);
 		gbe_graphics->executePPU(s_Cycles);
 		s_Cycles = 0;
 		s_Cycles += gbe_cpu->performInterrupt();
-		gbe_graphics->pollEvents();
 	}
+
+	storeBootSnapshot(snapshot, key);
+	gbe_mMap->unloadBootRom();
 }
 
-void GBE::executeBootROM()
+std::string GBE::getBootSnapshotPath(unsigned long long key)
 {
-	while (gbe_mMap->readMemory(0xFF50) == 0x00)
+	// The renderers keep different state
+	char name[32];
+	snprintf(name, sizeof(name), ".%016llX%s.snap", key, gbe_graphics->getPixelFifo() ? ".fifo" : "");
+
+	const char* file = strrchr(bootROMPath, '/');
+	return std::string(file ? file + 1 : bootROMPath) + name;
+}
+
+bool GBE::loadBootSnapshot(const std::string& path, unsigned long long key)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == NULL)
+		return false;
+
+	// Check the header and that the whole file is there
+	BootSnapshotHeader expected = makeBootSnapshotHeader(key);
+	BootSnapshotHeader header;
+	bool valid = fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0
+		&& header.version == expected.version
+		&& header.key == expected.key
+		&& header.cpuStateSize == expected.cpuStateSize
+		&& header.memoryMapSize == expected.memoryMapSize
+		&& header.ppuSize == expected.ppuSize;
+	fseek(file, 0, SEEK_END);
+	valid = valid && ftell(file) == (long)(sizeof(header) + sizeof(CPUState)) + header.memoryStateSize + header.ppuStateSize;
+	fseek(file, sizeof(header), SEEK_SET);
+
+	CPUState state;
+	valid = valid && fread(&state, sizeof(state), 1, file) == 1;
+
+	// Keep the machine as it is, to go back to if the state fails to load
+	FILE* backup = valid ? tmpfile() : NULL;
+	valid = backup && gbe_mMap->saveState(backup) && gbe_graphics->saveState(backup);
+
+	// Each part must take as many bytes as it was saved with
+	long start = ftell(file);
+	valid = valid && gbe_mMap->loadState(file)
+		&& ftell(file) == start + header.memoryStateSize
+		&& gbe_graphics->loadState(file)
+		&& ftell(file) == start + header.memoryStateSize + header.ppuStateSize;
+	fclose(file);
+
+	if (!valid && backup)
 	{
-		s_Cycles += gbe_cpu->executeNextInstruction();
-		gbe_cpu->updateTimers(s_Cycles);
-		gbe_graphics->executePPU(s_Cycles);
-		s_Cycles = 0;
-		s_Cycles += gbe_cpu->performInterrupt();
+		rewind(backup);
+		gbe_mMap->loadState(backup);
+		gbe_graphics->loadState(backup);
 	}
+	if (backup)
+		fclose(backup);
 
-	gbe_mMap->unloadBootRom();
+	if (!valid)
+	{
+		printf("boot snapshot %s not loaded\n", path.c_str());
+		return false;
+	}
+
+	gbe_cpu->setState(state);
+	return true;
+}
+
+void GBE::storeBootSnapshot(const std::string& path, unsigned long long key)
+{
+	// Written to a file of its own and renamed, so that other instances
+	// only ever see a whole snapshot
+	std::string temporary = path + "." + std::to_string(getpid());
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (file == NULL)
+		return;
+
+	// The header is written again once the state sizes are known
+	BootSnapshotHeader header = makeBootSnapshotHeader(key);
+	CPUState state = gbe_cpu->getState();
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(&state, sizeof(state), 1, file) == 1;
+
+	long start = ftell(file);
+	written = written && gbe_mMap->saveState(file);
+	header.memoryStateSize = ftell(file) - start;
+	written = written && gbe_graphics->saveState(file);
+	header.ppuStateSize = ftell(file) - start - header.memoryStateSize;
+
+	written = written && fseek(file, 0, SEEK_SET) == 0
+		&& fwrite(&header, sizeof(header), 1, file) == 1;
+	written = (fclose(file) == 0) && written;
+
+	// Another instance may have got there first, either snapshot will do
+	if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+		remove(temporary.c_str());
+}
+
+void GBE::skipBootROM()
+{
+	// Nothing to run, the boot ROM is never mapped
+	gbe_mMap->setPostBootState();
+	gbe_cpu->setState(POST_BOOT_STATE);
+}
+
+void GBE::loadRecompiledModule()
+{
+	std::string path = std::string(gameROMPath) + RECOMPILED_MODULE_EXTENSION;
+
+	// Modules are optional, only try if one was built
+	FILE* module = fopen(path.c_str(), "rb");
+	if (module == NULL)
+		return;
+	fclose(module);
+
+	gbe_cpu->loadRecompiledModule(path.c_str(), gbe_mMap->getRomHash());
 }
\ No newline at end of file
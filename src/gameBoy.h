@@ -3,6 +3,7 @@
 #include "cpu.h"
 #include "mmap.h"
 #include "graphics.h"
+#include <string>
 
 // GBE stands for GameBoyEmulator
 
@@ -31,9 +32,17 @@ private:
 	// File pointer for Boot ROM
 	FILE* bootROM;
 
+	// Path of the boot ROM
+	// Snapshots of the machine after it are kept next to it
+	const char* bootROMPath;
+
 	// File pointer for game ROM
 	FILE* gameROM;
 
+	// Path of the game ROM
+	// Recompiled modules are looked up next to it
+	const char* gameROMPath;
+
 	// Update function of the GBE
 	// Will be called every frame
 	// GB has 59.73 frames per second
@@ -47,10 +56,34 @@ private:
 	// execute it and then remove it
 	void executeBootROM();
 
+	// Snapshot of the machine when the boot ROM writes 0xFF50
+	// The boot ROM only reads itself and the cartridge header, so a
+	// snapshot stands for every run with the same key, the hash of both
+	// Returns the path of the snapshot for key
+	// in the working directory, out of the source tree the boot ROM is in
+	std::string getBootSnapshotPath(unsigned long long key);
+
+	// Starts from the snapshot at path if it is there and valid
+	// The machine is left as it was if not
+	bool loadBootSnapshot(const std::string& path, unsigned long long key);
+
+	// Saves the machine as it is now to path
+	void storeBootSnapshot(const std::string& path, unsigned long long key);
+
+	// Start from the state the boot ROM leaves instead of running it
+	// The game runs from its first instruction right away
+	void skipBootROM();
+
+	// Load the module built by gbrecomp for the game ROM if there is one
+	void loadRecompiledModule();
+
 public:
 	// Constructor
 	// Initializes the CPU
-	GBE();
+	// skipBoot starts the game without running the boot ROM,
+	// which is also done when dmg_boot.gb is missing
+	// frameSkip is handed to PPU::setFrameSkip()
+	GBE(bool skipBoot = false, int frameSkip = 0);
 
 	// Returns the CPU
 	CPU* getCPU() { return gbe_cpu; };
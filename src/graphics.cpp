@@ -1,5 +1,12 @@
 #include "types.h"
 #include "graphics.h"
+#include <cstring>
+
+// SSE2 is part of x86-64, use it for the color conversion there
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PPU_SSE2
+#endif
 
 PPU::PPU()
 {
@@ -7,32 +14,121 @@ PPU::PPU()
 	window = nullptr;
 	renderer = nullptr;
 	texture = nullptr;
-	isEnabled = false;
-	showBGWin = false;
-	showWindow = false;
-	//renderWindow = false;
 	mMap = nullptr;
-	bgTileDataAddr = 0x0000;
-	bgTileMapAddr = 0x0000;
-	winTileMapAddr = 0x0000;
-	bgPalette = 0x00;
-	objPalette0 = 0x00;
-	objPalette1 = 0x00;
 	currentLine = 0x00;
 	hiddenWindowLineCounter = 0x00;
 	ppuMode = 0x02;
 	event = new SDL_Event();
 
+	// Built on the first scanline
+	spriteLinesHeight = 0;
+	oamChanged = true;
+	std::fill(vram, vram + 0x2000, 0);
+	std::fill(oam, oam + 0xA0, 0);
+	lineStates.reserve(144);
+
+	// Frames are drawn on the emulation thread alone until told otherwise
+	renderTicks = 0;
+	renderGeneration = 0;
+	stopRenderWorkers = false;
+	renderFirst = 0;
+	renderLast = 0;
+	bandCount = 0;
+	bandsLeft = 0;
+	nextBand = 0;
+
 	ppuMode = 0;
 	currentClock = modeClocks[ppuMode];
+	transferClocks = modeClocks[TRANSFER];
 	scanlineRendered = false;
 	frameRendered = false;
+	lcdParked = false;
+
+	// The scanline renderer unless told otherwise
+	// The pixel FIFO starts at the end of the last line of a frame
+	pixelFifo = false;
+	fifo.line = 153;
+	fifo.dot = 456;
+	fifo.spriteFetch = -1;
+	fifo.windowY = false;
+	fifo.windowLine = 0;
+
+	// Draw every frame
+	frameSkip = 0;
+	fastForward = false;
+	skipFrame = false;
+	framesSkipped = 0;
+
+	// Real time unless told otherwise
+	speedLimit = true;
+	frameDeadline = 0;
+	parkedClocks = 0;
+
+	// Pixels are doubled for the window
+	scaleFilter = SCALE_NEAREST;
+	scaleFactor = 2;
+
+	// Nothing shown yet
+	redrawFrame = true;
+	framesShown = 0;
+	framesUnchanged = 0;
+	linesUploaded = 0;
+	linesUnchanged = 0;
 
-	// Fill renderArray initially with white (lightest color in palette)
-	std::fill(renderArray, renderArray + (160 * 144), bg_colors[0]);
+	// All buttons released
+	keyPadState = 0xFF;
+	quitRequested = false;
+
+#ifdef PPU_PRESENT_THREAD
+	writeSlot = 0;
+	latestSlot = 1;
+	readSlot = 2;
+	presenting = false;
+#endif
+
+	// Fill frameBuffer initially with white (lightest color in palette)
+	std::fill(frameBuffer, frameBuffer + (160 * 144), FRAME_BG_COLOR_0);
+
+#ifdef PPU_PRESENT_THREAD
+	// The presentation thread shows its slot before the first frame comes
+	for (int slot = 0; slot < 3; slot++)
+		std::fill(presentFrames[slot], presentFrames[slot] + (160 * 144), FRAME_BG_COLOR_0);
+#endif
+
+	for (int i = 0; i < 4; i++)
+		bg_colors565[i] = ((bg_colors[i] >> 16) & 0xF800) | ((bg_colors[i] >> 13) & 0x07E0) | ((bg_colors[i] >> 11) & 0x001F);
+}
+
+PPU::~PPU()
+{
+	delete event;
 }
 
 bool PPU::init()
+{
+#ifdef PPU_PRESENT_THREAD
+	// The window belongs to the presentation thread
+	// Wait for it to be created to report failures
+	std::promise<bool> started;
+	std::future<bool> created = started.get_future();
+	presenting = true;
+	presenter = std::thread(&PPU::presentLoop, this, std::move(started));
+	if (!created.get())
+	{
+		presenter.join();
+		return false;
+	}
+#else
+	if (!createWindow())
+		return false;
+#endif
+
+	// Render the texture
+	presentFrame();
+	return true;
+}
+
+bool PPU::createWindow()
 {
 	// Initialize SDL
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
@@ -41,8 +137,9 @@ bool PPU::init()
 		return false;
 	}
 
-	// Set hint to use hardware acceleration
-	if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1"))
+	// Frames are scaled to the window before they are uploaded
+	// so the texture is copied as it is
+	if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0"))
 	{
 		printf("Hardware Acceleration not enabled! SDL_Error: %s\n", SDL_GetError());
 		return false;
@@ -56,7 +153,7 @@ bool PPU::init()
 	}
 
 	// Create window and renderer
-	if (!(window = SDL_CreateWindow("GameBoy Emulator", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH * 2, SCREEN_HEIGHT * 2, SDL_WINDOW_SHOWN)))
+	if (!(window = SDL_CreateWindow("GameBoy Emulator", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH * scaleFactor, SCREEN_HEIGHT * scaleFactor, SDL_WINDOW_SHOWN)))
 	{
 		printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
 		return false;
@@ -68,38 +165,82 @@ bool PPU::init()
 		return false;
 	}
 
-	// Evaluate LCDC register
-	Byte LCDC = mMap->getRegLCDC();
+	// Create a placeholder texture
+	// 512x512 to have 4 copies of tilemap
+	// Streaming so the frame is converted straight into it
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, 160 * scaleFactor, 144 * scaleFactor);
+
+	return true;
+}
 
-	isEnabled = (LCDC & 0x80);
-	bgTileMapAddr = (LCDC & 0x04) ? 0x9C00 : 0x9800;
-	bgTileDataAddr = (LCDC & 0x08) ? 0x8000 : 0x8800;
-	winTileMapAddr = (LCDC & 0x40) ? 0x9C00 : 0x9800;
+void PPU::destroyWindow()
+{
+	// Destroy texture
+	SDL_DestroyTexture(texture);
 
-	// Evaluate Background Palette register
-	bgPalette = mMap->getRegBGP();
+	// Destroy renderer
+	SDL_DestroyRenderer(renderer);
 
-	// Evaluate Sprite Palette 0 register
-	objPalette0 = mMap->getRegOBP0();
+	// Destroy window
+	SDL_DestroyWindow(window);
 
-	// Evaluate Sprite Palette 1 register
-	objPalette1 = mMap->getRegOBP1();
+	// Quit SDL subsystems
+	SDL_Quit();
+}
 
-	// Create a placeholder texture
-	// 512x512 to have 4 copies of tilemap
-	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, 160, 144);
+#ifdef PPU_PRESENT_THREAD
+void PPU::presentLoop(std::promise<bool> started)
+{
+	bool created = createWindow();
+	started.set_value(created);
+	if (!created)
+		return;
 
-	// Render the texture
-	SDL_UpdateTexture(texture, NULL, renderArray, 160 * 4);
-	SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, texture, NULL, NULL);
-	SDL_RenderPresent(renderer);
-	return true;
+	while (presenting)
+	{
+		handleEvents();
+
+		// Swap the shown slot for the latest frame if there is a new one
+		// Otherwise wait a bit instead of showing the same frame again
+		if (latestSlot.load(std::memory_order_acquire) & FRAME_SLOT_NEW)
+		{
+			readSlot = latestSlot.exchange(readSlot, std::memory_order_acq_rel) & FRAME_SLOT_INDEX;
+			showFrame(presentFrames[readSlot]);
+		}
+		else if (redrawFrame)
+		{
+			showFrame(presentFrames[readSlot]);
+		}
+		else
+		{
+			SDL_Delay(1);
+		}
+	}
+
+	destroyWindow();
 }
+#endif
 
 // Poll Events to check for inputs
 // And process them
 bool PPU::pollEvents()
+{
+#ifndef PPU_PRESENT_THREAD
+	handleEvents();
+#endif
+
+	*(mMap->joyPadState) = keyPadState.load(std::memory_order_relaxed);
+
+	if (quitRequested.load(std::memory_order_relaxed))
+	{
+		close();
+		return true;
+	}
+	return false;
+}
+
+// Runs on the thread owning the window
+void PPU::handleEvents()
 {
 	while (SDL_PollEvent(event))
 	{
@@ -108,31 +249,35 @@ bool PPU::pollEvents()
 			switch (event->key.keysym.sym)
 			{
 			case SDLK_LEFT:
-				*(mMap->joyPadState) &= 0xFD;
+				keyPadState &= 0xFD;
 				break;
 			case SDLK_RIGHT:
-				*(mMap->joyPadState) &= 0xFE;
+				keyPadState &= 0xFE;
 				break;
 			case SDLK_UP:
-				*(mMap->joyPadState) &= 0xFB;
+				keyPadState &= 0xFB;
 				break;
 			case SDLK_DOWN:
-				*(mMap->joyPadState) &= 0xF7;
+				keyPadState &= 0xF7;
 				break;
 			case SDLK_a:
-				*(mMap->joyPadState) &= 0xEF;
+				keyPadState &= 0xEF;
 				break;
 			case SDLK_s:
-				*(mMap->joyPadState) &= 0xDF;
+				keyPadState &= 0xDF;
 				break;
 			case SDLK_LSHIFT:
-				*(mMap->joyPadState) &= 0xBF;
+				keyPadState &= 0xBF;
 				break;
 			case SDLK_SPACE:
-				*(mMap->joyPadState) &= 0x7F;
+				keyPadState &= 0x7F;
+				break;
+			case SDLK_TAB:
+				fastForward = true;
 				break;
 			case SDLK_ESCAPE:
-				exit(0);
+				quitRequested = true;
+				break;
 			default:
 				break;
 			}
@@ -142,66 +287,267 @@ bool PPU::pollEvents()
 			switch (event->key.keysym.sym)
 			{
 			case SDLK_LEFT:
-				*(mMap->joyPadState) |= 0x02;
+				keyPadState |= 0x02;
 				break;
 			case SDLK_RIGHT:
-				*(mMap->joyPadState) |= 0x01;
+				keyPadState |= 0x01;
 				break;
 			case SDLK_UP:
-				*(mMap->joyPadState) |= 0x04;
+				keyPadState |= 0x04;
 				break;
 			case SDLK_DOWN:
-				*(mMap->joyPadState) |= 0x08;
+				keyPadState |= 0x08;
 				break;
 			case SDLK_a:
-				*(mMap->joyPadState) |= 0x10;
+				keyPadState |= 0x10;
 				break;
 			case SDLK_s:
-				*(mMap->joyPadState) |= 0x20;
+				keyPadState |= 0x20;
 				break;
 			case SDLK_LSHIFT:
-				*(mMap->joyPadState) |= 0x40;
+				keyPadState |= 0x40;
+				break;
+			case SDLK_TAB:
+				fastForward = false;
 				break;
 			case SDLK_SPACE:
-				*(mMap->joyPadState) |= 0x80;
+				keyPadState |= 0x80;
 				break;
 			default:
 				break;
 			}
 		}
+		else if (event->type == SDL_WINDOWEVENT && event->window.event == SDL_WINDOWEVENT_EXPOSED)
+		{
+			// What was on screen was lost
+			redrawFrame = true;
+		}
 	}
-	return false;
 }
 
-void PPU::renderScanline(Byte line)
+void PPU::setMemoryMap(MemoryMap* m)
 {
-	// Evaluate LCDC register
-	Byte LCDC = mMap->getRegLCDC();
+	mMap = m;
+
+	// Start from VRAM and OAM as they are now
+	followVideoMemory();
+}
+
+void PPU::setPixelFifo(bool enabled)
+{
+	pixelFifo = enabled;
+	if (mMap)
+		followVideoMemory();
+}
+
+void PPU::followVideoMemory()
+{
+	std::copy(mMap->getVideoRam(), mMap->getVideoRam() + 0x2000, vram);
+	std::copy(mMap->getOamTable(), mMap->getOamTable() + 0xA0, oam);
+	oamChanged = true;
+
+	// The pixel FIFO reads VRAM and OAM live, so only the scanline
+	// renderer has writes logged, which sends them off the direct pages
+	mMap->setVideoLog((pixelFifo || lcdParked) ? nullptr : &videoWrites);
+}
+
+void PPU::captureLine(Byte line)
+{
+	LineState state;
+	state.line = line;
+	state.LCDC = mMap->getRegLCDC();
+	state.SCX = mMap->getRegSCX();
+	state.SCY = mMap->getRegSCY();
+	state.WX = mMap->getRegWX();
+	state.WY = mMap->getRegWY();
+	state.BGP = mMap->getRegBGP();
+	state.OBP0 = mMap->getRegOBP0();
+	state.OBP1 = mMap->getRegOBP1();
+	state.videoWrites = videoWrites.size();
+	lineStates.push_back(state);
+}
+
+void PPU::replayVideoWrites(unsigned int first, unsigned int last)
+{
+	for (unsigned int i = first; i < last; i++)
+	{
+		const MemoryWrite& write = videoWrites[i];
+		if (write.address < 0xA000)
+		{
+			vram[write.address - 0x8000] = write.value;
+		}
+		else
+		{
+			oam[write.address - 0xFE00] = write.value;
+			oamChanged = true;
+		}
+	}
+}
+
+void PPU::renderFrame()
+{
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	// The window line counter is the only state carried from line to line
+	// It counts the lines the window was drawn on
+	for (LineState& state : lineStates)
+	{
+		state.windowLine = hiddenWindowLineCounter;
+		Byte win_x = state.WX - 7;
+		if ((state.LCDC & 0x80) && (state.LCDC & 0x01) && (state.LCDC & 0x20) && (state.WY <= state.line) && (state.WY < 144) && (win_x < 160) && (hiddenWindowLineCounter < 144))
+			hiddenWindowLineCounter++;
+	}
+
+	// Each line sees VRAM and OAM as they were when it was captured
+	// Lines in between writes, with the same sprite height,
+	// are drawn together
+	unsigned int replayed = 0;
+	size_t first = 0;
+	while (first < lineStates.size())
+	{
+		const LineState& state = lineStates[first];
+		size_t last = first + 1;
+		while (last < lineStates.size() && lineStates[last].videoWrites == state.videoWrites && ((lineStates[last].LCDC ^ state.LCDC) & 0x04) == 0)
+			last++;
+
+		replayVideoWrites(replayed, state.videoWrites);
+		replayed = state.videoWrites;
+
+		// OAM is only scanned when it changed
+		Byte sprite_height = (state.LCDC & 0x4) ? 16 : 8;
+		if (oamChanged || sprite_height != spriteLinesHeight)
+			buildSpriteLines(sprite_height);
+
+		renderLines(first, last);
+		first = last;
+	}
 
-	isEnabled = (LCDC & 0x80);
-	showBGWin = (LCDC & 0x1);
-	showWindow = (LCDC & 0x20);
-	showSprites = (LCDC & 0x2);
+	replayVideoWrites(replayed, videoWrites.size());
+	videoWrites.clear();
+	lineStates.clear();
 
-	if (!isEnabled)
+	renderTicks += SDL_GetPerformanceCounter() - start;
+}
+
+void PPU::renderLines(size_t first, size_t last)
+{
+	if (renderWorkers.empty() || last - first < minParallelLines)
+	{
+		for (size_t i = first; i < last; i++)
+			renderScanline(lineStates[i]);
 		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(renderMutex);
+		renderFirst = first;
+		renderLast = last;
+		bandCount = renderWorkers.size() + 1;
+		bandsLeft = bandCount;
+		nextBand = 0;
+		renderGeneration++;
+	}
+	renderWake.notify_all();
 
-	bgTileMapAddr = (LCDC & 0x08) ? 0x9C00 : 0x9800;
-	bgTileDataAddr = (LCDC & 0x10) ? 0x8000 : 0x8800;
-	winTileMapAddr = (LCDC & 0x40) ? 0x9C00 : 0x9800;
-
-	// Read palette registers
-	bgPalette = mMap->getRegBGP();
-	objPalette0 = mMap->getRegOBP0();
-	objPalette1 = mMap->getRegOBP1();
-
-	Byte win_y = mMap->getRegWY();
-	Byte win_x = mMap->getRegWX() - 7;
-	Byte win_pixel_y = hiddenWindowLineCounter;
-	Byte bg_pixel_y = line + mMap->getRegSCY();
-	Byte scroll_x = mMap->getRegSCX();
-	Byte bg_pixel_x, bg_pixel_col, win_pixel_x, win_pixel_col, sprite_y, sprite_pixel_col;
-	Byte bg_tilenum, win_tilenum, sprite_palette;
+	renderBands();
+
+	std::unique_lock<std::mutex> lock(renderMutex);
+	renderDone.wait(lock, [this] { return bandsLeft == 0; });
+}
+
+void PPU::renderBands()
+{
+	int band;
+	while ((band = nextBand++) < bandCount)
+	{
+		size_t lines = renderLast - renderFirst;
+		size_t first = renderFirst + (lines * band) / bandCount;
+		size_t last = renderFirst + (lines * (band + 1)) / bandCount;
+		for (size_t i = first; i < last; i++)
+			renderScanline(lineStates[i]);
+
+		std::lock_guard<std::mutex> lock(renderMutex);
+		if (--bandsLeft == 0)
+			renderDone.notify_one();
+	}
+}
+
+void PPU::renderWorker()
+{
+	unsigned int generation = 0;
+	std::unique_lock<std::mutex> lock(renderMutex);
+	while (true)
+	{
+		renderWake.wait(lock, [&] { return stopRenderWorkers || renderGeneration != generation; });
+		if (stopRenderWorkers)
+			return;
+
+		generation = renderGeneration;
+		lock.unlock();
+		renderBands();
+		lock.lock();
+	}
+}
+
+void PPU::setRenderThreads(int threads)
+{
+	stopRenderThreads();
+	for (int i = 1; i < threads; i++)
+		renderWorkers.emplace_back(&PPU::renderWorker, this);
+}
+
+void PPU::stopRenderThreads()
+{
+	{
+		std::lock_guard<std::mutex> lock(renderMutex);
+		stopRenderWorkers = true;
+	}
+	renderWake.notify_all();
+
+	for (std::thread& worker : renderWorkers)
+		worker.join();
+	renderWorkers.clear();
+	stopRenderWorkers = false;
+}
+
+void PPU::renderScanline(const LineState& state)
+{
+	Byte line = state.line;
+	Byte LCDC = state.LCDC;
+
+	// LCDC 7th bit is the LCD enable flag
+	if (!(LCDC & 0x80))
+		return;
+
+	// LCDC 0th bit is the BG and Window Display Enable flag
+	bool showBGWin = (LCDC & 0x1);
+
+	// LCDC 5th bit is the Window Display Enable flag
+	bool showWindow = (LCDC & 0x20);
+
+	// LCDC 1st bit is the OBJ (Sprite) Display Enable flag
+	bool showSprites = (LCDC & 0x2);
+
+	// LCDC 3rd bit is the BG Tile Map Display Select flag
+	Word bgTileMapAddr = (LCDC & 0x08) ? 0x9C00 : 0x9800;
+
+	// LCDC 4th bit is the BG and Window Tile Data Select flag
+	Word bgTileDataAddr = (LCDC & 0x10) ? 0x8000 : 0x8800;
+
+	// LCDC 6th bit is the Window Tile Map Display Select flag
+	Word winTileMapAddr = (LCDC & 0x40) ? 0x9C00 : 0x9800;
+
+	// Palette registers
+	Byte bgPalette = state.BGP;
+	Byte objPalette0 = state.OBP0;
+	Byte objPalette1 = state.OBP1;
+
+	Byte win_y = state.WY;
+	Byte win_x = state.WX - 7;
+	Byte win_pixel_y = state.windowLine;
+	Byte bg_pixel_y = line + state.SCY;
+	Byte scroll_x = state.SCX;
+	Byte sprite_pixel_col, sprite_palette;
 	Byte sprite_height = (LCDC & 0x4) ? 16 : 8;
 
 	// Filling pixel array
@@ -218,7 +564,7 @@ void PPU::renderScanline(Byte line)
 	// To do that, we divide the pixel's x and y coordinates by 8 (floor division)
 	// Then we multiply the resultant y by 32 (the number of tiles in a row) (256 pixels / 8 pixels per tile = 32 tiles)
 	// Then we add the resultant x which gives us the tile number we must check for data
-	// Here i is y and j is x
+	// Here j is x
 
 	// Now, using the tile number, we can calculate the address of the tile data by multiplying the tile number by 16 and adding it to the tile data address
 	// The tile data address is either 0x8000 or 0x8800 depending on LCDC.4 for Background
@@ -230,93 +576,91 @@ void PPU::renderScanline(Byte line)
 
 	// Source: https://gbdev.io/pandocs/Tile_Data.html
 
-	for (Byte j = 0; j < 160; j++)
-	{
-		// Background rendering
-		bg_pixel_x = scroll_x + j;
-		bg_tilenum = (*mMap)[bgTileMapAddr + ((bg_pixel_y / 8) * 32) + (bg_pixel_x / 8)];
+	// The line is walked in tile spans
+	// The tile number and its two data bytes are fetched once per tile,
+	// only the first tile can be cut by SCX and the last by the screen edge
 
-		if (bgTileDataAddr == 0x8800)
-		{
-			bg_pixel_col = ((*mMap)[bgTileDataAddr + 0x800 + ((SByte)bg_tilenum * 0x10) + (bg_pixel_y % 8 * 2)] >> (7 - (bg_pixel_x % 8)) & 0x1) + ((*mMap)[bgTileDataAddr + 0x800 + ((SByte)bg_tilenum * 0x10) + (bg_pixel_y % 8 * 2) + 1] >> (7 - (bg_pixel_x % 8)) & 0x1) * 2;
-		}
-		else
-		{
-			bg_pixel_col = ((*mMap)[bgTileDataAddr + (bg_tilenum * 0x10) + (bg_pixel_y % 8 * 2)] >> (7 - (bg_pixel_x % 8)) & 0x1) + (((*mMap)[bgTileDataAddr + (bg_tilenum * 0x10) + (bg_pixel_y % 8 * 2) + 1] >> (7 - (bg_pixel_x % 8)) & 0x1) * 2);
-		}
+	Byte* row = frameBuffer + (line * 160);
 
-		if (showBGWin)
-			renderArray[(line * 160) + j] = bg_colors[(bgPalette >> (bg_pixel_col * 2)) & 0x3];
-		else
-			renderArray[(line * 160) + j] = bg_colors[0];
+	// First column of the window, 160 when it is not on this line
+	int win_start = (showBGWin && showWindow && (win_y <= line) && (win_y < 144) && (win_x < 160) && (state.windowLine < 144)) ? win_x : 160;
 
-		// Window rendering
-		if (showBGWin && showWindow && ((win_y <= line) && (win_y < 144)) && (win_x < 160) && (hiddenWindowLineCounter < 144) && (j >= win_x))
+	// Background rendering
+	// Hidden by the window from win_start on, except when the window starts
+	// at column 0, where its color 0 lets the BG through
+	int bg_end = (win_start == 0) ? 160 : win_start;
+	if (!showBGWin)
+	{
+		std::fill(row, row + 160, FRAME_BG_COLOR_0);
+	}
+	else
+	{
+		Byte bg_pixel_x = scroll_x;
+		for (int j = 0; j < bg_end;)
 		{
-			win_pixel_x = j - win_x;
-			win_tilenum = (*mMap)[winTileMapAddr + ((win_pixel_y / 8) * 32) + (win_pixel_x / 8)];
+			Byte bg_tilenum = readVram(bgTileMapAddr + ((bg_pixel_y / 8) * 32) + (bg_pixel_x / 8));
+			Word bg_tile_addr = tileDataAddress(bgTileDataAddr, bg_tilenum, bg_pixel_y % 8);
+			Byte low = readVram(bg_tile_addr);
+			Byte high = readVram(bg_tile_addr + 1);
 
-			if (bgTileDataAddr == 0x8800)
-			{
-				win_pixel_col = ((*mMap)[bgTileDataAddr + 0x800 + ((SByte)win_tilenum * 0x10) + (win_pixel_y % 8 * 2)] >> (7 - (win_pixel_x % 8)) & 0x1) + ((*mMap)[bgTileDataAddr + 0x800 + ((SByte)win_tilenum * 0x10) + (win_pixel_y % 8 * 2) + 1] >> (7 - (win_pixel_x % 8)) & 0x1) * 2;
-			}
-			else
+			int first = bg_pixel_x % 8;
+			int count = std::min(8 - first, bg_end - j);
+			for (int i = 0; i < count; i++)
 			{
-				win_pixel_col = ((*mMap)[bgTileDataAddr + (win_tilenum * 0x10) + (win_pixel_y % 8 * 2)] >> (7 - (win_pixel_x % 8)) & 0x1) + (((*mMap)[bgTileDataAddr + (win_tilenum * 0x10) + (win_pixel_y % 8 * 2) + 1] >> (7 - (win_pixel_x % 8)) & 0x1) * 2);
+				int bit = 7 - (first + i);
+				Byte bg_pixel_col = ((low >> bit) & 0x1) + (((high >> bit) & 0x1) * 2);
+				row[j + i] = ((bgPalette >> (bg_pixel_col * 2)) & 0x3) | (bg_pixel_col ? 0 : FRAME_BG_COLOR_0);
 			}
 
-			if ((win_pixel_col != 0) || (win_x))
-				renderArray[(line * 160) + j] = bg_colors[(bgPalette >> (win_pixel_col * 2)) & 0x3];
+			j += count;
+			bg_pixel_x += count;
 		}
 	}
 
-	if (showBGWin && showWindow && ((win_y <= line) && (win_y < 144)) && (win_x < 160) && (hiddenWindowLineCounter < 144))
-		hiddenWindowLineCounter++;
-
-	// Sprite rendering
-	if (showSprites)
+	// Window rendering
+	// Always starts on a tile boundary, only the last tile can be cut
+	for (int j = win_start, win_pixel_x = 0; j < 160; j += 8, win_pixel_x += 8)
 	{
-		sprites.clear();
-		for (Word i = 0xFE00; i < 0xFEA0; i += 4)
-		{
-			if (sprites.size() >= 10)
-				break;
-			sprite_y = (*mMap)[i];
-			if ((line < (sprite_y - 16) || line > (sprite_y - 16 + sprite_height - 1)))
-				continue;
+		Byte win_tilenum = readVram(winTileMapAddr + ((win_pixel_y / 8) * 32) + (win_pixel_x / 8));
+		Word win_tile_addr = tileDataAddress(bgTileDataAddr, win_tilenum, win_pixel_y % 8);
+		Byte low = readVram(win_tile_addr);
+		Byte high = readVram(win_tile_addr + 1);
 
-			Sprite* sprite = new Sprite();
-			sprite->address = i;
-			sprite->y = sprite_y;
-			sprite->x = (*mMap)[i + 1];
-			sprite->tile = (*mMap)[i + 2];
-			sprite->flags = (*mMap)[i + 3];
-			sprites.push_back(*sprite);
+		int count = std::min(8, 160 - j);
+		for (int i = 0; i < count; i++)
+		{
+			Byte win_pixel_col = ((low >> (7 - i)) & 0x1) + (((high >> (7 - i)) & 0x1) * 2);
+			if ((win_pixel_col != 0) || (win_x))
+				row[j + i] = ((bgPalette >> (win_pixel_col * 2)) & 0x3) | (win_pixel_col ? 0 : FRAME_BG_COLOR_0);
 		}
+	}
 
-		if (sprites.size())
-			std::sort(sprites.begin(), sprites.end(), [](Sprite& a, Sprite& b) { return (((a.x == b.x) && (a.address > b.address)) || (a.x > b.x)); });
-
-		for (auto it = sprites.begin(); it != sprites.end(); ++it)
+	// Sprite rendering
+	if (showSprites)
+	{
+		const SpriteLine& spriteLine = spriteLines[line];
+		for (int s = 0; s < spriteLine.count; s++)
 		{
+			const Sprite* it = &oamSprites[spriteLine.sprites[s]];
 			sprite_palette = (it->flags & 0x10) ? objPalette1 : objPalette0;
+
+			// 8x16 sprites ignore bit 0 of the tile number
+			Byte sprite_tile = (sprite_height == 16) ? (it->tile & 0xFE) : it->tile;
 			for (int i = 0; i < 8; i++)
 			{
-				if (sprite_height == 16)
-					it->tile &= 0xFE;
 				switch (it->flags & 0x60)
 				{
 				case 0x00: // Normal
-					sprite_pixel_col = ((*mMap)[0x8000 + (it->tile * 0x10) + ((line - (it->y - 16)) * 2)] >> (7 - i) & 0x1) + (((*mMap)[0x8000 + (it->tile * 0x10) + ((line - (it->y - 16)) * 2) + 1] >> (7 - i) & 0x1) * 2);
+					sprite_pixel_col = (readVram(0x8000 + (sprite_tile * 0x10) + ((line - (it->y - 16)) * 2)) >> (7 - i) & 0x1) + ((readVram(0x8000 + (sprite_tile * 0x10) + ((line - (it->y - 16)) * 2) + 1) >> (7 - i) & 0x1) * 2);
 					break;
 				case 0x20: // Flip X
-					sprite_pixel_col = ((*mMap)[0x8000 + (it->tile * 0x10) + ((line - (it->y - 16)) * 2)] >> i & 0x1) + (((*mMap)[0x8000 + (it->tile * 0x10) + ((line - (it->y - 16)) * 2) + 1] >> i & 0x1) * 2);
+					sprite_pixel_col = (readVram(0x8000 + (sprite_tile * 0x10) + ((line - (it->y - 16)) * 2)) >> i & 0x1) + ((readVram(0x8000 + (sprite_tile * 0x10) + ((line - (it->y - 16)) * 2) + 1) >> i & 0x1) * 2);
 					break;
 				case 0x40: // Flip Y
-					sprite_pixel_col = ((*mMap)[0x8000 + (it->tile * 0x10) + ((sprite_height - (line - (it->y - 16)) - 1) * 2)] >> (7 - i) & 0x1) + (((*mMap)[0x8000 + (it->tile * 0x10) + ((sprite_height - (line - (it->y - 16)) - 1) * 2) + 1] >> (7 - i) & 0x1) * 2);
+					sprite_pixel_col = (readVram(0x8000 + (sprite_tile * 0x10) + ((sprite_height - (line - (it->y - 16)) - 1) * 2)) >> (7 - i) & 0x1) + ((readVram(0x8000 + (sprite_tile * 0x10) + ((sprite_height - (line - (it->y - 16)) - 1) * 2) + 1) >> (7 - i) & 0x1) * 2);
 					break;
 				case 0x60: // Flip X and Y
-					sprite_pixel_col = ((*mMap)[0x8000 + (it->tile * 0x10) + ((sprite_height - (line - (it->y - 16)) - 1) * 2)] >> i & 0x1) + (((*mMap)[0x8000 + (it->tile * 0x10) + ((sprite_height - (line - (it->y - 16)) - 1) * 2) + 1] >> i & 0x1) * 2);
+					sprite_pixel_col = (readVram(0x8000 + (sprite_tile * 0x10) + ((sprite_height - (line - (it->y - 16)) - 1) * 2)) >> i & 0x1) + ((readVram(0x8000 + (sprite_tile * 0x10) + ((sprite_height - (line - (it->y - 16)) - 1) * 2) + 1) >> i & 0x1) * 2);
 					break;
 				default:
 					break;
@@ -324,16 +668,879 @@ void PPU::renderScanline(Byte line)
 
 				if (sprite_pixel_col != 0)
 				{
-					if (((it->x + i - 8) < 160) && (!(it->flags & 0x80) || (renderArray[(line * 160) + (it->x + i - 8)] == bg_colors[0])))
-						renderArray[(line * 160) + (it->x + i - 8)] = bg_colors[(sprite_palette >> (sprite_pixel_col * 2)) & 0x3];
+					// OBJ behind BG only show over BG color 0
+					// The mask is kept so later sprites test BG, not other sprites
+					// Unsigned so that sprites partly left of the screen are clipped
+					unsigned int x = it->x + i - 8;
+					if ((x < 160) && (!(it->flags & 0x80) || (frameBuffer[(line * 160) + x] & FRAME_BG_COLOR_0)))
+						frameBuffer[(line * 160) + x] = (frameBuffer[(line * 160) + x] & FRAME_BG_COLOR_0) | ((sprite_palette >> (sprite_pixel_col * 2)) & 0x3);
 				}
 			}
 		}
 	}
 }
 
+void PPU::buildSpriteLines(Byte height)
+{
+	for (int line = 0; line < 144; line++)
+		spriteLines[line].count = 0;
+
+	// Select the first 10 sprites in OAM order on each line
+	for (int i = 0; i < 40; i++)
+	{
+		Sprite& sprite = oamSprites[i];
+		sprite.address = 0xFE00 + (i * 4);
+		sprite.y = oam[i * 4];
+		sprite.x = oam[(i * 4) + 1];
+		sprite.tile = oam[(i * 4) + 2];
+		sprite.flags = oam[(i * 4) + 3];
+
+		int top = std::max(sprite.y - 16, 0);
+		int bottom = std::min(sprite.y - 16 + height, 144);
+		for (int line = top; line < bottom; line++)
+		{
+			SpriteLine& spriteLine = spriteLines[line];
+			if (spriteLine.count < 10)
+				spriteLine.sprites[spriteLine.count++] = i;
+		}
+	}
+
+	// Sort each line into drawing order with an insertion sort
+	// A sprite is drawn before one that has priority over it
+	for (int line = 0; line < 144; line++)
+	{
+		SpriteLine& spriteLine = spriteLines[line];
+		for (int i = 1; i < spriteLine.count; i++)
+		{
+			Byte index = spriteLine.sprites[i];
+			int j = i - 1;
+			while (j >= 0 && (oamSprites[spriteLine.sprites[j]].x < oamSprites[index].x || (oamSprites[spriteLine.sprites[j]].x == oamSprites[index].x && spriteLine.sprites[j] < index)))
+			{
+				spriteLine.sprites[j + 1] = spriteLine.sprites[j];
+				j--;
+			}
+			spriteLine.sprites[j + 1] = index;
+		}
+	}
+
+	spriteLinesHeight = height;
+	oamChanged = false;
+}
+
+void PPU::presentFrame()
+{
+#ifdef PPU_PRESENT_THREAD
+	// Publish the frame and take back whichever slot was latest
+	// A frame the presentation thread had not picked up yet is dropped
+	std::copy(frameBuffer, frameBuffer + (160 * 144), presentFrames[writeSlot]);
+	writeSlot = latestSlot.exchange(writeSlot | FRAME_SLOT_NEW, std::memory_order_acq_rel) & FRAME_SLOT_INDEX;
+#else
+	showFrame(frameBuffer);
+#endif
+}
+
+void PPU::showFrame(const Byte* frame)
+{
+	bool changed[144];
+	for (int line = 0; line < 144; line++)
+		changed[line] = redrawFrame || memcmp(frame + (line * 160), shownFrame + (line * 160), 160) != 0;
+
+	// Scale2x output of a line depends on the lines above and below
+	bool dirty[144];
+	for (int line = 0; line < 144; line++)
+		dirty[line] = changed[line] || (scaleFilter == SCALE_2X && ((line > 0 && changed[line - 1]) || (line < 143 && changed[line + 1])));
+
+	// Upload each run of lines that changed
+	int uploaded = 0;
+	int line = 0;
+	while (line < 144)
+	{
+		if (!dirty[line])
+		{
+			line++;
+			continue;
+		}
+
+		int first = line;
+		while (line < 144 && dirty[line])
+			line++;
+
+		uploadLines(frame, first, line);
+		uploaded += line - first;
+	}
+
+	if (uploaded)
+		std::copy(frame, frame + (160 * 144), shownFrame);
+
+	linesUploaded += uploaded;
+	linesUnchanged += 144 - uploaded;
+
+	// What is on screen is still right
+	if (uploaded == 0)
+	{
+		framesUnchanged++;
+		return;
+	}
+
+	redrawFrame = false;
+	framesShown++;
+
+	SDL_RenderClear(renderer);
+	SDL_RenderCopy(renderer, texture, NULL, NULL);
+	SDL_RenderPresent(renderer);
+}
+
+void PPU::setScaling(ScaleFilter filter, int factor)
+{
+	scaleFilter = filter;
+	scaleFactor = (filter == SCALE_2X) ? 2 : std::clamp(factor, 1, 4);
+}
+
+void PPU::uploadLines(const Byte* frame, int first, int last)
+{
+	SDL_Rect rect = { 0, first * scaleFactor, 160 * scaleFactor, (last - first) * scaleFactor };
+	void* pixels;
+	int pitch;
+	if (SDL_LockTexture(texture, &rect, &pixels, &pitch) != 0)
+		return;
+
+	for (int line = first; line < last; line++)
+	{
+		Byte* rows = (Byte*)pixels + ((line - first) * scaleFactor * pitch);
+		if (scaleFilter == SCALE_2X)
+		{
+			Byte top[320], bottom[320];
+			scale2xLine(frame, line, top, bottom);
+			convertLine(top, 320, FRAME_RGBA8888, rows);
+			convertLine(bottom, 320, FRAME_RGBA8888, rows + pitch);
+		}
+		else if (scaleFactor == 1)
+		{
+			convertLine(frame + (line * 160), 160, FRAME_RGBA8888, rows);
+		}
+		else
+		{
+			// Scale the first row, the others are copies of it
+			color converted[160];
+			convertLine(frame + (line * 160), 160, FRAME_RGBA8888, (Byte*)converted);
+			scaleNearest(converted, (color*)rows);
+			for (int i = 1; i < scaleFactor; i++)
+				memcpy(rows + (i * pitch), rows, 160 * scaleFactor * sizeof(color));
+		}
+	}
+
+	SDL_UnlockTexture(texture);
+}
+
+void PPU::scaleNearest(const color* source, color* destination) const
+{
+	int x = 0;
+
+#ifdef PPU_SSE2
+	// 4 pixels at a time, become scaleFactor vectors
+	// Vector i holds output pixels 4i to 4i+3, output pixel k is source pixel k / scaleFactor
+	if (scaleFactor >= 2)
+	{
+		for (; x + 4 <= 160; x += 4)
+		{
+			__m128i pixels = _mm_loadu_si128((const __m128i*)(source + x));
+			__m128i* out = (__m128i*)(destination + (x * scaleFactor));
+			switch (scaleFactor)
+			{
+			case 2:
+				_mm_storeu_si128(out, _mm_shuffle_epi32(pixels, _MM_SHUFFLE(1, 1, 0, 0)));
+				_mm_storeu_si128(out + 1, _mm_shuffle_epi32(pixels, _MM_SHUFFLE(3, 3, 2, 2)));
+				break;
+			case 3:
+				_mm_storeu_si128(out, _mm_shuffle_epi32(pixels, _MM_SHUFFLE(1, 0, 0, 0)));
+				_mm_storeu_si128(out + 1, _mm_shuffle_epi32(pixels, _MM_SHUFFLE(2, 2, 1, 1)));
+				_mm_storeu_si128(out + 2, _mm_shuffle_epi32(pixels, _MM_SHUFFLE(3, 3, 3, 2)));
+				break;
+			case 4:
+				_mm_storeu_si128(out, _mm_shuffle_epi32(pixels, _MM_SHUFFLE(0, 0, 0, 0)));
+				_mm_storeu_si128(out + 1, _mm_shuffle_epi32(pixels, _MM_SHUFFLE(1, 1, 1, 1)));
+				_mm_storeu_si128(out + 2, _mm_shuffle_epi32(pixels, _MM_SHUFFLE(2, 2, 2, 2)));
+				_mm_storeu_si128(out + 3, _mm_shuffle_epi32(pixels, _MM_SHUFFLE(3, 3, 3, 3)));
+				break;
+			}
+		}
+	}
+#endif
+
+	for (; x < 160; x++)
+		for (int i = 0; i < scaleFactor; i++)
+			destination[(x * scaleFactor) + i] = source[x];
+}
+
+void PPU::scale2xLine(const Byte* frame, int line, Byte* top, Byte* bottom) const
+{
+	// Pixel P and its neighbors A above, B right, C left and D below
+	// Pixels past the edges repeat the edge
+	const Byte* center = frame + (line * 160);
+	const Byte* above = frame + (std::max(line - 1, 0) * 160);
+	const Byte* below = frame + (std::min(line + 1, 143) * 160);
+	Byte left[160], right[160];
+	left[0] = center[0];
+	std::copy(center, center + 159, left + 1);
+	std::copy(center + 1, center + 160, right);
+	right[159] = center[159];
+
+#ifdef PPU_SSE2
+	// 16 pixels at a time, the conditions become byte masks
+	// Only the shade counts, not FRAME_BG_COLOR_0
+	// 160 is a multiple of 16 so no pixels are left over
+	const __m128i shade = _mm_set1_epi8(FRAME_SHADE);
+	for (int x = 0; x < 160; x += 16)
+	{
+		__m128i P = _mm_and_si128(_mm_loadu_si128((const __m128i*)(center + x)), shade);
+		__m128i A = _mm_and_si128(_mm_loadu_si128((const __m128i*)(above + x)), shade);
+		__m128i B = _mm_and_si128(_mm_loadu_si128((const __m128i*)(right + x)), shade);
+		__m128i C = _mm_and_si128(_mm_loadu_si128((const __m128i*)(left + x)), shade);
+		__m128i D = _mm_and_si128(_mm_loadu_si128((const __m128i*)(below + x)), shade);
+
+		__m128i CA = _mm_cmpeq_epi8(C, A);
+		__m128i AB = _mm_cmpeq_epi8(A, B);
+		__m128i DC = _mm_cmpeq_epi8(D, C);
+		__m128i BD = _mm_cmpeq_epi8(B, D);
+
+		// _mm_andnot_si128(a, b) is b && !a
+		__m128i m0 = _mm_andnot_si128(DC, _mm_andnot_si128(AB, CA));
+		__m128i m1 = _mm_andnot_si128(CA, _mm_andnot_si128(BD, AB));
+		__m128i m2 = _mm_andnot_si128(BD, _mm_andnot_si128(CA, DC));
+		__m128i m3 = _mm_andnot_si128(AB, _mm_andnot_si128(DC, BD));
+
+		__m128i e0 = _mm_or_si128(_mm_and_si128(m0, A), _mm_andnot_si128(m0, P));
+		__m128i e1 = _mm_or_si128(_mm_and_si128(m1, B), _mm_andnot_si128(m1, P));
+		__m128i e2 = _mm_or_si128(_mm_and_si128(m2, C), _mm_andnot_si128(m2, P));
+		__m128i e3 = _mm_or_si128(_mm_and_si128(m3, D), _mm_andnot_si128(m3, P));
+
+		_mm_storeu_si128((__m128i*)(top + (x * 2)), _mm_unpacklo_epi8(e0, e1));
+		_mm_storeu_si128((__m128i*)(top + (x * 2) + 16), _mm_unpackhi_epi8(e0, e1));
+		_mm_storeu_si128((__m128i*)(bottom + (x * 2)), _mm_unpacklo_epi8(e2, e3));
+		_mm_storeu_si128((__m128i*)(bottom + (x * 2) + 16), _mm_unpackhi_epi8(e2, e3));
+	}
+#else
+	for (int x = 0; x < 160; x++)
+	{
+		Byte P = center[x] & FRAME_SHADE;
+		Byte A = above[x] & FRAME_SHADE;
+		Byte B = right[x] & FRAME_SHADE;
+		Byte C = left[x] & FRAME_SHADE;
+		Byte D = below[x] & FRAME_SHADE;
+
+		top[x * 2] = (C == A && C != D && A != B) ? A : P;
+		top[(x * 2) + 1] = (A == B && A != C && B != D) ? B : P;
+		bottom[x * 2] = (D == C && D != B && C != A) ? C : P;
+		bottom[(x * 2) + 1] = (B == D && B != A && D != C) ? D : P;
+	}
+#endif
+}
+
+void PPU::convertFrame(const Byte* frame, int first, int last, FrameFormat format, void* destination, int pitch) const
+{
+	for (int line = first; line < last; line++)
+		convertLine(frame + (line * 160), 160, format, (Byte*)destination + ((line - first) * pitch));
+}
+
+void PPU::convertLine(const Byte* source, int width, FrameFormat format, Byte* row) const
+{
+	int x = 0;
+
+#ifdef PPU_SSE2
+	// 16 pixels at a time
+	// Each shade is picked with the two bits of its index as masks
+	// color = bit1 ? (bit0 ? c3 : c2) : (bit0 ? c1 : c0)
+	const __m128i bit0 = _mm_set1_epi8(0x01);
+	const __m128i bit1 = _mm_set1_epi8(0x02);
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i indices = _mm_loadu_si128((const __m128i*)(source + x));
+		__m128i mask0 = _mm_cmpeq_epi8(_mm_and_si128(indices, bit0), bit0);
+		__m128i mask1 = _mm_cmpeq_epi8(_mm_and_si128(indices, bit1), bit1);
+
+		if (format == FRAME_INDICES)
+		{
+			_mm_storeu_si128((__m128i*)(row + x), _mm_and_si128(indices, _mm_set1_epi8(FRAME_SHADE)));
+		}
+		else if (format == FRAME_RGB565)
+		{
+			const __m128i c0 = _mm_set1_epi16(bg_colors565[0]), c1 = _mm_set1_epi16(bg_colors565[1]);
+			const __m128i c2 = _mm_set1_epi16(bg_colors565[2]), c3 = _mm_set1_epi16(bg_colors565[3]);
+			const __m128i low = _mm_xor_si128(c0, c1), high = _mm_xor_si128(c2, c3);
+
+			// Widen the byte masks to 16 bit lanes
+			__m128i masks0[2] = { _mm_unpacklo_epi8(mask0, mask0), _mm_unpackhi_epi8(mask0, mask0) };
+			__m128i masks1[2] = { _mm_unpacklo_epi8(mask1, mask1), _mm_unpackhi_epi8(mask1, mask1) };
+			for (int i = 0; i < 2; i++)
+			{
+				__m128i lo = _mm_xor_si128(c0, _mm_and_si128(masks0[i], low));
+				__m128i hi = _mm_xor_si128(c2, _mm_and_si128(masks0[i], high));
+				__m128i pixels = _mm_xor_si128(lo, _mm_and_si128(masks1[i], _mm_xor_si128(lo, hi)));
+				_mm_storeu_si128((__m128i*)(row + (x * 2) + (i * 16)), pixels);
+			}
+		}
+		else
+		{
+			const __m128i c0 = _mm_set1_epi32(bg_colors[0]), c1 = _mm_set1_epi32(bg_colors[1]);
+			const __m128i c2 = _mm_set1_epi32(bg_colors[2]), c3 = _mm_set1_epi32(bg_colors[3]);
+			const __m128i low = _mm_xor_si128(c0, c1), high = _mm_xor_si128(c2, c3);
+
+			// Widen the byte masks to 32 bit lanes
+			__m128i half0[2] = { _mm_unpacklo_epi8(mask0, mask0), _mm_unpackhi_epi8(mask0, mask0) };
+			__m128i half1[2] = { _mm_unpacklo_epi8(mask1, mask1), _mm_unpackhi_epi8(mask1, mask1) };
+			for (int i = 0; i < 4; i++)
+			{
+				__m128i m0 = (i & 1) ? _mm_unpackhi_epi16(half0[i >> 1], half0[i >> 1]) : _mm_unpacklo_epi16(half0[i >> 1], half0[i >> 1]);
+				__m128i m1 = (i & 1) ? _mm_unpackhi_epi16(half1[i >> 1], half1[i >> 1]) : _mm_unpacklo_epi16(half1[i >> 1], half1[i >> 1]);
+				__m128i lo = _mm_xor_si128(c0, _mm_and_si128(m0, low));
+				__m128i hi = _mm_xor_si128(c2, _mm_and_si128(m0, high));
+				__m128i pixels = _mm_xor_si128(lo, _mm_and_si128(m1, _mm_xor_si128(lo, hi)));
+				_mm_storeu_si128((__m128i*)(row + (x * 4) + (i * 16)), pixels);
+			}
+		}
+	}
+#endif
+
+	// Whatever is left, all of it without SSE2
+	for (; x < width; x++)
+	{
+		Byte shade = source[x] & FRAME_SHADE;
+		switch (format)
+		{
+		case FRAME_RGBA8888:
+			((color*)row)[x] = bg_colors[shade];
+			break;
+		case FRAME_RGB565:
+			((Word*)row)[x] = bg_colors565[shade];
+			break;
+		case FRAME_INDICES:
+			row[x] = shade;
+			break;
+		}
+	}
+}
+
+long long PPU::paceFrame()
+{
+	// A frame lasts 70224 cycles, 1 / 59.73 seconds
+	Uint64 frequency = SDL_GetPerformanceFrequency();
+	Uint64 frameTicks = frequency * 100 / 5973;
+	Uint64 now = SDL_GetPerformanceCounter();
+
+	// Fast forward runs as fast as the host allows
+	if (!speedLimit || fastForward)
+	{
+		frameDeadline = 0;
+		return 0;
+	}
+
+	if (frameDeadline == 0)
+	{
+		frameDeadline = now + frameTicks;
+		return 0;
+	}
+
+	// Too far behind to catch up, e.g. the window was being dragged
+	long long lag = (long long)(now - frameDeadline);
+	if (lag > (long long)(frameTicks * maxLagFrames))
+	{
+		frameDeadline = now + frameTicks;
+		return lag;
+	}
+
+	// SDL_Delay sleeps whole milliseconds
+	// Deadlines are absolute so what's left over is caught up next frame
+	if (lag < 0)
+		SDL_Delay((Uint32)((frameDeadline - now) * 1000 / frequency));
+	frameDeadline += frameTicks;
+	return lag > 0 ? lag : 0;
+}
+
+void PPU::scheduleFrame()
+{
+	long long lag = paceFrame();
+
+	// Skip while more than a frame behind the pacer's deadline
+	int skip = fastForward ? fastForwardSkip : frameSkip;
+	if (skip == FRAME_SKIP_AUTO)
+		skipFrame = (lag > (long long)(SDL_GetPerformanceFrequency() * 100 / 5973)) && (framesSkipped < maxAutoFrameSkip);
+	else
+		skipFrame = framesSkipped < skip;
+
+	framesSkipped = skipFrame ? framesSkipped + 1 : 0;
+}
+
+void PPU::parkLCD()
+{
+	// Lines drawn so far are never shown
+	// Catch vram and oam up before leaving the MemoryMap alone
+	lineStates.clear();
+	renderFrame();
+	mMap->setVideoLog(nullptr);
+
+	mMap->setRegLY(0);
+	mMap->setRegSTAT(mMap->getRegSTAT() & 0xFC);
+	ppuMode = HBLANK;
+	mMap->setVideoBlocking(false, false);
+
+	// A switched off LCD is blank
+	std::fill(frameBuffer, frameBuffer + (160 * 144), FRAME_BG_COLOR_0);
+	presentFrame();
+
+	parkedClocks = 0;
+	lcdParked = true;
+}
+
+void PPU::resumeLCD()
+{
+	// VRAM and OAM may have changed in any way while parked
+	lcdParked = false;
+	followVideoMemory();
+
+	// Start over on line 0 in OAM scan
+	Byte STAT = (mMap->getRegSTAT() & 0xF8) | 0x2;
+	if (mMap->getRegLYC() == 0)
+		STAT |= 0x4;
+	mMap->setRegSTAT(STAT);
+	ppuMode = OAM;
+	mMap->setVideoBlocking(false, true);
+	currentClock = modeClocks[ppuMode];
+	scanlineRendered = false;
+	frameRendered = false;
+	hiddenWindowLineCounter = 0;
+	fifo.line = 153;
+	fifo.dot = 456;
+	fifo.windowY = false;
+	fifo.windowLine = 0;
+}
+
+void PPU::setFifoMode(Byte mode)
+{
+	Byte STAT = (mMap->getRegSTAT() & 0xFC) | mode;
+	mMap->setRegSTAT(STAT);
+	ppuMode = mode;
+	mMap->setVideoBlocking(mode == TRANSFER, mode == OAM || mode == TRANSFER);
+
+	// STAT bits 3, 4 and 5 enable the mode 0, 1 and 2 interrupts
+	if (mode != TRANSFER && (STAT & (0x08 << mode)))
+		mMap->setRegIF(mMap->getRegIF() | 0x2);
+}
+
+void PPU::stepFifo()
+{
+	if (fifo.dot == 456)
+	{
+		fifo.dot = 0;
+		fifo.line = (fifo.line == 153) ? 0 : fifo.line + 1;
+
+		Byte STAT = mMap->getRegSTAT();
+		mMap->setRegLY(fifo.line);
+		if (fifo.line == mMap->getRegLYC())
+		{
+			mMap->setRegSTAT(STAT | 0x4);
+			if (STAT & 0x40)
+				mMap->setRegIF(mMap->getRegIF() | 0x2);
+		}
+		else
+		{
+			mMap->setRegSTAT(STAT & 0xFB);
+		}
+
+		if (fifo.line == 144)
+		{
+			mMap->setRegIF(mMap->getRegIF() | 0x1);
+			setFifoMode(VBLANK);
+			fifo.windowY = false;
+			fifo.windowLine = 0;
+
+			// Nothing was captured, this only catches vram and oam up
+			renderFrame();
+			if (!skipFrame)
+				presentFrame();
+			frameRendered = true;
+			scheduleFrame();
+		}
+	}
+
+	if (fifo.line < 144)
+	{
+		if (fifo.dot == 0)
+		{
+			frameRendered = false;
+			if (fifo.line == mMap->getRegWY())
+				fifo.windowY = true;
+			setFifoMode(OAM);
+			scanFifoSprites();
+		}
+		else if (fifo.dot == 80)
+		{
+			setFifoMode(TRANSFER);
+			startFifoLine();
+		}
+
+		if (ppuMode == TRANSFER)
+			transferFifoDot();
+	}
+
+	fifo.dot++;
+}
+
+void PPU::scanFifoSprites()
+{
+	// Done at once, OAM is not blocked during the scan
+	const Byte* oamTable = mMap->getOamTable();
+	Byte height = (mMap->getRegLCDC() & 0x4) ? 16 : 8;
+	fifo.spriteCount = 0;
+	for (Byte index = 0; index < 40 && fifo.spriteCount < 10; index++)
+	{
+		Byte y = oamTable[index * 4];
+		if (fifo.line + 16 >= y && fifo.line + 16 < y + height)
+			fifo.sprites[fifo.spriteCount++] = index;
+	}
+}
+
+void PPU::startFifoLine()
+{
+	fifo.x = 0;
+	fifo.discard = mMap->getRegSCX() & 0x7;
+	fifo.fetchStep = 0;
+	fifo.fetchColumn = 0;
+	fifo.fetchWindow = false;
+	fifo.firstFetch = true;
+	fifo.bgCount = 0;
+	for (auto& pixel : fifo.obj)
+		pixel.color = 0;
+	fifo.objHead = 0;
+	fifo.spritesFetched = 0;
+	fifo.spriteFetch = -1;
+	fifo.windowDrawn = false;
+}
+
+void PPU::fetchFifoBackground()
+{
+	const Byte* videoRam = mMap->getVideoRam();
+	Byte LCDC = mMap->getRegLCDC();
+
+	// Row of the tile, SCY is read on every access
+	Byte y = fifo.fetchWindow ? fifo.windowLine : (Byte)(fifo.line + mMap->getRegSCY());
+
+	fifo.fetchStep++;
+	switch (fifo.fetchStep)
+	{
+	case 2:
+	{
+		Word address;
+		if (fifo.fetchWindow)
+			address = ((LCDC & 0x40) ? 0x1C00 : 0x1800) + (y / 8) * 32 + (fifo.fetchColumn & 0x1F);
+		else
+			address = ((LCDC & 0x08) ? 0x1C00 : 0x1800) + (y / 8) * 32 + (((mMap->getRegSCX() / 8) + fifo.fetchColumn) & 0x1F);
+		fifo.fetchTile = videoRam[address];
+	}
+	break;
+	case 4:
+		fifo.fetchLow = videoRam[tileDataAddress((LCDC & 0x10) ? 0x8000 : 0x8800, fifo.fetchTile, y % 8) - 0x8000];
+		break;
+	case 6:
+		fifo.fetchHigh = videoRam[tileDataAddress((LCDC & 0x10) ? 0x8000 : 0x8800, fifo.fetchTile, y % 8) - 0x8000 + 1];
+		break;
+	}
+
+	// The row waits for the BG FIFO to run empty
+	if (fifo.fetchStep < 6 || fifo.bgCount != 0)
+		return;
+
+	fifo.fetchStep = 0;
+	if (fifo.firstFetch)
+	{
+		fifo.firstFetch = false;
+		return;
+	}
+
+	for (int pixel = 0; pixel < 8; pixel++)
+		fifo.bg[pixel] = (((fifo.fetchHigh >> (7 - pixel)) & 0x1) << 1) | ((fifo.fetchLow >> (7 - pixel)) & 0x1);
+	fifo.bgCount = 8;
+	fifo.fetchColumn++;
+}
+
+void PPU::fetchFifoSprite(int entry)
+{
+	const Byte* sprite = mMap->getOamTable() + fifo.sprites[entry] * 4;
+	Byte spriteY = sprite[0];
+	Byte spriteX = sprite[1];
+	Byte tile = sprite[2];
+	Byte flags = sprite[3];
+
+	Byte height = (mMap->getRegLCDC() & 0x4) ? 16 : 8;
+	if (height == 16)
+		tile &= 0xFE;
+	Byte row = (fifo.line + 16 - spriteY) & (height - 1);
+	if (flags & 0x40)
+		row = height - 1 - row;
+
+	const Byte* data = mMap->getVideoRam() + tile * 0x10 + row * 2;
+	for (int pixel = 0; pixel < 8; pixel++)
+	{
+		// Pixels left of the screen or already shifted out are dropped
+		int screenX = spriteX - 8 + pixel;
+		if (screenX < fifo.x)
+			continue;
+
+		int bit = (flags & 0x20) ? pixel : 7 - pixel;
+		Byte color = (((data[1] >> bit) & 0x1) << 1) | ((data[0] >> bit) & 0x1);
+
+		// Sprites fetched earlier have priority
+		auto& slot = fifo.obj[(fifo.objHead + screenX - fifo.x) & 0x7];
+		if (color != 0 && slot.color == 0)
+		{
+			slot.color = color;
+			slot.flags = flags;
+		}
+	}
+}
+
+int PPU::nextFifoSprite()
+{
+	// Lowest X first, then lowest OAM index, so sprites left of the
+	// screen are mixed in priority order too
+	const Byte* oamTable = mMap->getOamTable();
+	int next = -1;
+	for (int entry = 0; entry < fifo.spriteCount; entry++)
+	{
+		if (fifo.spritesFetched & (1 << entry))
+			continue;
+
+		Byte spriteX = oamTable[fifo.sprites[entry] * 4 + 1];
+		if (spriteX - 8 <= fifo.x && (next < 0 || spriteX < oamTable[fifo.sprites[next] * 4 + 1]))
+			next = entry;
+	}
+	return next;
+}
+
+void PPU::transferFifoDot()
+{
+	Byte LCDC = mMap->getRegLCDC();
+
+	// A sprite reached by the pixel output is fetched first,
+	// once the BG fetcher has a row ready
+	if (fifo.spriteFetch < 0 && fifo.discard == 0 && (LCDC & 0x2))
+	{
+		fifo.spriteFetch = nextFifoSprite();
+		fifo.spriteDots = -1;
+	}
+
+	if (fifo.spriteFetch >= 0)
+	{
+		if (fifo.spriteDots < 0)
+		{
+			fetchFifoBackground();
+			if (fifo.fetchStep >= 6 && fifo.bgCount != 0)
+				fifo.spriteDots = 6;
+			return;
+		}
+
+		if (--fifo.spriteDots > 0)
+			return;
+
+		fetchFifoSprite(fifo.spriteFetch);
+		fifo.spritesFetched |= 1 << fifo.spriteFetch;
+
+		// Sprites at the same X are fetched one after another
+		fifo.spriteFetch = nextFifoSprite();
+		if (fifo.spriteFetch >= 0)
+		{
+			fifo.spriteDots = 6;
+			return;
+		}
+	}
+
+	// The window restarts the fetcher, dropping what the BG FIFO holds
+	Byte WX = mMap->getRegWX();
+	if (!fifo.fetchWindow && fifo.windowY && fifo.discard == 0 && (LCDC & 0x20) && WX <= 166 && fifo.x + 7 >= WX)
+	{
+		fifo.fetchWindow = true;
+		fifo.windowDrawn = true;
+		fifo.fetchColumn = 0;
+		fifo.fetchStep = 0;
+		fifo.bgCount = 0;
+	}
+
+	// A pixel is shifted out before the fetcher runs,
+	// so a row pushed on this dot is shifted out from the next
+	if (fifo.bgCount != 0)
+	{
+		Byte color = fifo.bg[8 - fifo.bgCount--];
+		if (fifo.discard > 0)
+		{
+			fifo.discard--;
+		}
+		else
+		{
+			outputFifoPixel(color, LCDC);
+			if (fifo.x == SCREEN_WIDTH)
+				return;
+		}
+	}
+
+	fetchFifoBackground();
+}
+
+void PPU::outputFifoPixel(Byte color, Byte LCDC)
+{
+	// BG and window are white while LCDC bit 0 is clear
+	if (!(LCDC & 0x1))
+		color = 0;
+
+	Byte pixel = (mMap->getRegBGP() >> (color * 2)) & FRAME_SHADE;
+	if (color == 0)
+		pixel |= FRAME_BG_COLOR_0;
+
+	auto& sprite = fifo.obj[fifo.objHead];
+	if (sprite.color != 0 && (LCDC & 0x2) && (!(sprite.flags & 0x80) || color == 0))
+	{
+		Byte palette = (sprite.flags & 0x10) ? mMap->getRegOBP1() : mMap->getRegOBP0();
+		pixel = (pixel & FRAME_BG_COLOR_0) | ((palette >> (sprite.color * 2)) & FRAME_SHADE);
+	}
+	sprite.color = 0;
+	fifo.objHead = (fifo.objHead + 1) & 0x7;
+
+	frameBuffer[fifo.line * SCREEN_WIDTH + fifo.x] = pixel;
+	if (++fifo.x == SCREEN_WIDTH)
+	{
+		setFifoMode(HBLANK);
+		if (fifo.windowDrawn)
+			fifo.windowLine++;
+	}
+}
+
+int PPU::transferLength()
+{
+	Byte LCDC = mMap->getRegLCDC();
+	Byte LY = mMap->getRegLY();
+	Byte SCX = mMap->getRegSCX();
+	Byte WX = mMap->getRegWX();
+
+	// Pixels of the first tile dropped for SCX
+	int clocks = modeClocks[TRANSFER] + (SCX & 0x7);
+
+	// The fetcher restarts where the window starts
+	bool window = (LCDC & 0x21) == 0x21 && LY >= mMap->getRegWY() && WX <= 166;
+	if (window)
+		clocks += 6;
+
+	if (!(LCDC & 0x2))
+		return clocks;
+
+	// Each sprite takes 6 dots to fetch, and the first sprite on
+	// a BG or window tile also waits for that tile's fetch to finish,
+	// up to 5 dots the closer the sprite is to the tile's left edge
+	const Byte* oamTable = mMap->getOamTable();
+	Byte height = (LCDC & 0x4) ? 16 : 8;
+	int sprites = 0;
+
+	// Bit per tile already waited on, BG tiles then window tiles
+	unsigned long long waitedTiles[2] = { 0, 0 };
+	for (Byte index = 0; index < 40 && sprites < 10; index++)
+	{
+		Byte spriteY = oamTable[index * 4];
+		Byte spriteX = oamTable[index * 4 + 1];
+		if (LY + 16 < spriteY || LY + 16 >= spriteY + height)
+			continue;
+		sprites++;
+
+		// Sprites past the right edge are found but never fetched
+		if (spriteX >= 168)
+			continue;
+		clocks += 6;
+
+		// Left of the screen the sprite is fetched at the first pixel
+		int left = std::max(spriteX - 8, 0);
+		int layer = (window && left >= WX - 7) ? 1 : 0;
+		int position = layer ? left - (WX - 7) : left + (SCX & 0x7);
+
+		unsigned long long tile = 1ULL << (position / 8);
+		if (waitedTiles[layer] & tile)
+			continue;
+		waitedTiles[layer] |= tile;
+		clocks += std::max(0, 5 - position % 8);
+	}
+
+	return clocks;
+}
+
+bool PPU::saveState(FILE* file)
+{
+	// Lines waiting to be drawn are drawn now, the rest of the frame
+	// is drawn as usual
+	if (!lcdParked)
+		renderFrame();
+
+	return fwrite(&pixelFifo, sizeof(pixelFifo), 1, file) == 1
+		&& fwrite(&lcdParked, sizeof(lcdParked), 1, file) == 1
+		&& fwrite(&ppuMode, sizeof(ppuMode), 1, file) == 1
+		&& fwrite(&currentClock, sizeof(currentClock), 1, file) == 1
+		&& fwrite(&transferClocks, sizeof(transferClocks), 1, file) == 1
+		&& fwrite(&scanlineRendered, sizeof(scanlineRendered), 1, file) == 1
+		&& fwrite(&frameRendered, sizeof(frameRendered), 1, file) == 1
+		&& fwrite(&hiddenWindowLineCounter, sizeof(hiddenWindowLineCounter), 1, file) == 1
+		&& fwrite(&fifo, sizeof(fifo), 1, file) == 1
+		&& fwrite(frameBuffer, sizeof(frameBuffer), 1, file) == 1;
+}
+
+bool PPU::loadState(FILE* file)
+{
+	bool saved;
+	if (fread(&saved, sizeof(saved), 1, file) != 1 || saved != pixelFifo)
+		return false;
+
+	bool read = fread(&lcdParked, sizeof(lcdParked), 1, file) == 1
+		&& fread(&ppuMode, sizeof(ppuMode), 1, file) == 1
+		&& fread(&currentClock, sizeof(currentClock), 1, file) == 1
+		&& fread(&transferClocks, sizeof(transferClocks), 1, file) == 1
+		&& fread(&scanlineRendered, sizeof(scanlineRendered), 1, file) == 1
+		&& fread(&frameRendered, sizeof(frameRendered), 1, file) == 1
+		&& fread(&hiddenWindowLineCounter, sizeof(hiddenWindowLineCounter), 1, file) == 1
+		&& fread(&fifo, sizeof(fifo), 1, file) == 1
+		&& fread(frameBuffer, sizeof(frameBuffer), 1, file) == 1;
+
+	// Start following VRAM and OAM from where they are now
+	lineStates.clear();
+	videoWrites.clear();
+	followVideoMemory();
+	return read;
+}
+
 void PPU::executePPU(int cycles)
 {
+	// LCDC 7th bit is the LCD enable flag
+	bool enabled = mMap->getRegLCDC() & 0x80;
+	if (lcdParked)
+	{
+		if (!enabled)
+		{
+			// Nothing is shown, but the game still keeps to real time
+			parkedClocks += cycles;
+			if (parkedClocks >= 70224)
+			{
+				parkedClocks -= 70224;
+				paceFrame();
+			}
+			return;
+		}
+		resumeLCD();
+	}
+	else if (!enabled)
+	{
+		parkLCD();
+		return;
+	}
+
+	if (pixelFifo)
+	{
+		for (int dot = 0; dot < cycles; dot++)
+			stepFifo();
+		return;
+	}
+
 	currentClock -= cycles;
 	switch (ppuMode)
 	{
@@ -341,7 +1548,8 @@ void PPU::executePPU(int cycles)
 	{
 		if (!scanlineRendered)
 		{
-			renderScanline(mMap->getRegLY());
+			if (!skipFrame)
+				captureLine(mMap->getRegLY());
 			scanlineRendered = true;
 		}
 
@@ -378,6 +1586,7 @@ void PPU::executePPU(int cycles)
 				if (STAT & 0x20)
 					mMap->setRegIF(mMap->getRegIF() | 0x2);
 				ppuMode = 2;
+				mMap->setVideoBlocking(false, true);
 			}
 			currentClock += modeClocks[ppuMode];
 		}
@@ -387,11 +1596,11 @@ void PPU::executePPU(int cycles)
 	{
 		if (!frameRendered)
 		{
-			SDL_UpdateTexture(texture, NULL, renderArray, 160 * 4);
-			SDL_RenderClear(renderer);
-			SDL_RenderCopy(renderer, texture, NULL, NULL);
-			SDL_RenderPresent(renderer);
+			renderFrame();
+			if (!skipFrame)
+				presentFrame();
 			frameRendered = true;
+			scheduleFrame();
 		}
 		if (currentClock < 0)
 		{
@@ -417,6 +1626,7 @@ void PPU::executePPU(int cycles)
 				if (STAT & 0x20)
 					mMap->setRegIF(mMap->getRegIF() | 0x2);
 				ppuMode = 2;
+				mMap->setVideoBlocking(false, true);
 				scanlineRendered = false;
 				mMap->setRegLY(0);
 				if (LYC == 0)
@@ -439,11 +1649,12 @@ void PPU::executePPU(int cycles)
 		frameRendered = false;
 		if (currentClock < 0)
 		{
-			// TODO: Implement OAM memory restriction
 			Byte STAT = mMap->getRegSTAT();
 			mMap->setRegSTAT((STAT & 0xFC) | 0x3);
 			ppuMode = 3;
-			currentClock += modeClocks[ppuMode];
+			mMap->setVideoBlocking(true, true);
+			transferClocks = transferLength();
+			currentClock += transferClocks;
 		}
 	}
 	break;
@@ -453,13 +1664,15 @@ void PPU::executePPU(int cycles)
 
 		if (currentClock < 0)
 		{
-			// TODO: Implement All memory restriction
 			Byte STAT = mMap->getRegSTAT();
 			mMap->setRegSTAT(STAT & 0xFC);
 			if (STAT & 0x8)
 				mMap->setRegIF(mMap->getRegIF() | 0x2);
 			ppuMode = 0;
-			currentClock += modeClocks[ppuMode];
+			mMap->setVideoBlocking(false, false);
+
+			// HBlank takes what mode 3 left of the line
+			currentClock += modeClocks[HBLANK] + modeClocks[TRANSFER] - transferClocks;
 		}
 	}
 	break;
@@ -471,15 +1684,19 @@ void PPU::executePPU(int cycles)
 
 void PPU::close()
 {
-	// Destroy texture
-	SDL_DestroyTexture(texture);
+	stopRenderThreads();
 
-	// Destroy renderer
-	SDL_DestroyRenderer(renderer);
+	PresentStats stats = getPresentStats();
+	printf("%llu frames shown, %llu unchanged frames skipped, %llu of %llu lines uploaded\n", stats.framesShown, stats.framesUnchanged, stats.linesUploaded, stats.linesUploaded + stats.linesUnchanged);
 
-	// Destroy window
-	SDL_DestroyWindow(window);
-
-	// Quit SDL subsystems
-	SDL_Quit();
-}
\ No newline at end of file
+#ifdef PPU_PRESENT_THREAD
+	// The window is destroyed by the thread that created it
+	if (presenter.joinable())
+	{
+		presenting = false;
+		presenter.join();
+	}
+#else
+	destroyWindow();
+#endif
+}
@@ -3,7 +3,13 @@
 #include "mmap.h"
 #include <stdio.h>
 #include <algorithm>
+#include <climits>
 #include <vector>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
 
 #ifdef __linux__
 #include <SDL2/SDL.h>
@@ -11,6 +17,38 @@
 #include <SDL.h>
 #endif
 
+// Frames are shown by a presentation thread that owns the window,
+// so the emulation never waits on the GPU driver or VSync
+// macOS only allows windows and events on the main thread,
+// there frames are shown from the emulation thread instead
+#ifndef __APPLE__
+#define PPU_PRESENT_THREAD
+#endif
+
+// Pixel formats PPU::copyFrame() converts the frame to
+enum FrameFormat
+{
+	// 32 bit 0xRRGGBBAA, as SDL_PIXELFORMAT_RGBA8888
+	FRAME_RGBA8888,
+
+	// 16 bit RRRRRGGGGGGBBBBB, as SDL_PIXELFORMAT_RGB565
+	FRAME_RGB565,
+
+	// 8 bit shade index 0 - 3
+	FRAME_INDICES
+};
+
+// Filters PPU::setScaling() can scale frames up with
+enum ScaleFilter
+{
+	// Every pixel becomes a block of N x N
+	SCALE_NEAREST,
+
+	// Scale2x, also known as EPX, always 2x
+	// Pulled from https://www.scale2x.it/algorithm
+	SCALE_2X
+};
+
 struct Sprite
 {
 	Word address;
@@ -28,41 +66,19 @@ private:
 	SDL_Texture* texture;
 	SDL_Event* event;
 
-	// renderArray to be converted to texture
-	// stores 4 copies of texture for wrapping of screen
-	color renderArray[160 * 144];
-
-	MemoryMap* mMap;
-
-	// LCDC 7th bit is the LCD enable flag
-	bool isEnabled;
-
-	// LCDC 0th bit is the BG and Window Display Enable flag
-	bool showBGWin;
-
-	// LCDC 5th bit is the Window Display Enable flag
-	bool showWindow;
-
-	// LCDC 1st bit is the OBJ (Sprite) Display Enable flag
-	bool showSprites;
-
-	// LCDC 3rd bit is the BG and Window Tile Data Select flag
-	Word bgTileDataAddr;
-
-	// LCDC 4th bit is the BG Tile Map Display Select flag
-	Word bgTileMapAddr;
+	// The frame as shade indices, converted to colors by copyFrame()
+	// Bits 0-1 are the shade after the palette
+	// Bit 2 is set where BG and window have color 0, which OBJ
+	// with the BG over OBJ flag are drawn over
+	Byte frameBuffer[160 * 144];
 
-	// LCDC 6th bit is the Window Tile Map Display Select flag
-	Word winTileMapAddr;
-
-	// BGP register is the BG Palette Data
-	Byte bgPalette;
-
-	// OBP0 register is the OBJ Palette 0 Data
-	Byte objPalette0;
+	enum FRAME_BITS
+	{
+		FRAME_SHADE = 0x03,
+		FRAME_BG_COLOR_0 = 0x04
+	};
 
-	// OBP1 register is the OBJ Palette 1 Data
-	Byte objPalette1;
+	MemoryMap* mMap;
 
 	// Internal window line counter
 	Byte hiddenWindowLineCounter;
@@ -77,6 +93,9 @@ private:
 	// Color Mapping for background
 	color bg_colors[4] = { 0x9BBC0FFF, 0x8BAC0FFF, 0x306230FF, 0x0F380FFF };
 
+	// bg_colors as RGB565
+	Word bg_colors565[4];
+
 	// Color Mapping for objects
 	// NOTE: 0 is transparent
 	// indices 1, 2, 3 are the actual colors and will be populated later
@@ -89,12 +108,21 @@ private:
 	Byte ppuMode;
 
 	// PPU Mode Clocks
-	// Mode 0: 204 cycles
+	// Mode 0: 204 cycles, less what mode 3 takes past 172
 	// Mode 1: 456 cycles
 	// Mode 2: 80 cycles
-	// Mode 3: 172 cycles
+	// Mode 3: 172 cycles at least, see transferLength()
 	int modeClocks[4] = { 204, 456, 80, 172 };
 
+	// Length of mode 3 on the current line
+	int transferClocks;
+
+	// Works out how long mode 3 takes on the current line
+	// from SCX, the window and the sprites on the line, as the
+	// fetchers would take drawing it
+	// Pulled from https://gbdev.io/pandocs/Rendering.html#mode-3-length
+	int transferLength();
+
 	// Current PPU Mode Clock
 	int currentClock;
 
@@ -111,15 +139,479 @@ private:
 		TRANSFER
 	};
 
-	std::vector<Sprite> sprites;
+	// Registers a line is drawn with
+	// Captured when the line reaches HBlank so that the whole
+	// frame can be drawn in one go when VBlank starts
+	struct LineState
+	{
+		Byte line;
+		Byte LCDC;
+		Byte SCX;
+		Byte SCY;
+		Byte WX;
+		Byte WY;
+		Byte BGP;
+		Byte OBP0;
+		Byte OBP1;
+
+		// Internal window line counter for the line
+		// Worked out before drawing so lines can be drawn in any order
+		Byte windowLine;
+
+		// Entries of videoWrites made before the line was captured
+		unsigned int videoWrites;
+	};
+
+	// Lines captured this frame, in the order they reached HBlank
+	std::vector<LineState> lineStates;
+
+	// VRAM and OAM writes made since the frame was last drawn
+	// Filled by the MemoryMap, see MemoryMap::setVideoLog()
+	std::vector<MemoryWrite> videoWrites;
+
+	// VRAM and OAM as the line being drawn sees them
+	// Brought forward by replaying videoWrites
+	Byte vram[0x2000];
+	Byte oam[0xA0];
+
+	// Set when a replayed write changes oam
+	bool oamChanged;
+
+	Byte readVram(Word address) const { return vram[address & 0x1FFF]; }
+
+	// Address of row y of a BG or window tile
+	// 0x8800 tile data uses signed tile numbers based at 0x9000
+	Word tileDataAddress(Word dataAddr, Byte tile, Byte y) const
+	{
+		if (dataAddr == 0x8800)
+			return 0x9000 + ((SByte)tile * 0x10) + (y * 2);
+		return 0x8000 + (tile * 0x10) + (y * 2);
+	}
+
+	// Records the registers line is drawn with
+	void captureLine(Byte line);
+
+	// Replays videoWrites from first up to last into vram and oam
+	void replayVideoWrites(unsigned int first, unsigned int last);
+
+	// Draws every captured line and catches vram and oam up
+	// Called once a frame when VBlank starts
+	void renderFrame();
+
+	// Draws a line into frameBuffer
+	// Only writes the row of the line, so lines can be drawn at the same time
+	void renderScanline(const LineState& state);
+
+	// Host time spent in renderFrame()
+	// in SDL_GetPerformanceCounter() ticks
+	Uint64 renderTicks;
+
+	// Worker threads lines are split across, see setRenderThreads()
+	// Lines that see the same VRAM and OAM are cut into one band
+	// per thread, the emulation thread draws one band too
+	std::vector<std::thread> renderWorkers;
+	std::mutex renderMutex;
+	std::condition_variable renderWake;
+	std::condition_variable renderDone;
+
+	// Incremented under renderMutex for every batch of bands
+	unsigned int renderGeneration;
+	bool stopRenderWorkers;
+
+	// The batch, lineStates from renderFirst up to renderLast
+	// cut into bandCount bands, bandsLeft of them not drawn yet
+	size_t renderFirst;
+	size_t renderLast;
+	int bandCount;
+	int bandsLeft;
+	std::atomic<int> nextBand;
+
+	// Fewer lines are drawn on the emulation thread alone
+	// as waking the workers would cost more
+	const size_t minParallelLines = 16;
+
+	// Draws lineStates from first up to last
+	void renderLines(size_t first, size_t last);
+
+	// Draws bands of the batch until none are left
+	void renderBands();
+
+	// Body of the worker threads
+	void renderWorker();
+
+	void stopRenderThreads();
+
+	// Sprites in OAM as of the last buildSpriteLines()
+	Sprite oamSprites[40];
+
+	// Sprites drawn on each line
+	// At most 10, the first 10 in OAM order that cover the line
+	// Stored in drawing order, the sprite with the highest
+	// priority (lowest X, then lowest OAM index) comes last
+	struct SpriteLine
+	{
+		Byte count;
+		Byte sprites[10];
+	};
+
+	SpriteLine spriteLines[144];
+
+	// Sprite height spriteLines were built for
+	Byte spriteLinesHeight;
+
+	// Rebuilds spriteLines from oam
+	void buildSpriteLines(Byte height);
+
+	// Hands the finished frame over to be shown
+	void presentFrame();
+
+	// Creates the window, renderer and texture
+	// on the thread that shows frames
+	bool createWindow();
+	void destroyWindow();
+
+	// Converts a frame into the texture and shows it
+	// Only lines that changed since the last frame shown are converted
+	// and a frame that did not change at all is not shown again
+	void showFrame(const Byte* frame);
+
+	// How frames are scaled up before they are uploaded
+	// The texture and window are scaleFactor times the screen
+	ScaleFilter scaleFilter;
+	int scaleFactor;
+
+	// Converts lines first up to last of frame into the texture, scaled
+	void uploadLines(const Byte* frame, int first, int last);
+
+	// Nearest neighbor scaling of a line of 160 pixels by scaleFactor
+	void scaleNearest(const color* source, color* destination) const;
+
+	// Scale2x of line of frame into its two output lines of 320 shade indices
+	void scale2xLine(const Byte* frame, int line, Byte* top, Byte* bottom) const;
+
+	// The last frame shown
+	// Owned by the thread showing frames
+	Byte shownFrame[160 * 144];
+
+	// The next frame is converted and shown whole
+	// Set at first and when the window needs to be drawn again
+	bool redrawFrame;
+
+	// Work done and avoided by showFrame(), see getPresentStats()
+	std::atomic<unsigned long long> framesShown;
+	std::atomic<unsigned long long> framesUnchanged;
+	std::atomic<unsigned long long> linesUploaded;
+	std::atomic<unsigned long long> linesUnchanged;
+
+	// Reads SDL events into keyPadState, fastForward and quitRequested
+	void handleEvents();
+
+	// Joypad state as set by handleEvents()
+	// Copied to the MemoryMap by pollEvents()
+	std::atomic<Byte> keyPadState;
+
+	// Escape was pressed
+	std::atomic<bool> quitRequested;
+
+#ifdef PPU_PRESENT_THREAD
+	// Lock-free triple buffer of finished frames
+	// The emulation thread writes one slot and the presentation thread
+	// reads another, the third holds the latest finished frame
+	// Each slot is owned by one thread at a time and the slots
+	// only change hands through latestSlot
+	Byte presentFrames[3][160 * 144];
+
+	// Slot the next finished frame is copied to
+	// Owned by the emulation thread
+	int writeSlot;
+
+	// Slot being shown
+	// Owned by the presentation thread
+	int readSlot;
+
+	// Slot holding the latest finished frame
+	// FRAME_SLOT_NEW is set until the presentation thread picks it up
+	std::atomic<int> latestSlot;
+
+	enum FRAME_SLOT
+	{
+		FRAME_SLOT_INDEX = 0x03,
+		FRAME_SLOT_NEW = 0x04
+	};
+
+	// The presentation thread runs while this is set
+	std::atomic<bool> presenting;
+	std::thread presenter;
+
+	// Body of the presentation thread
+	// Shows the latest frame and handles events until close()
+	void presentLoop(std::promise<bool> started);
+#endif
+
+	// Converts lines first up to last of source, a frame of shade indices,
+	// to format into destination, which starts at line first
+	void convertFrame(const Byte* source, int first, int last, FrameFormat format, void* destination, int pitch) const;
+
+	// Converts width shade indices from source to format into row
+	void convertLine(const Byte* source, int width, FrameFormat format, Byte* row) const;
+
+	// The LCD is off, LCDC 7th bit is clear
+	// The PPU is parked with LY at 0 in HBlank and schedules nothing
+	// VRAM and OAM writes are not logged meanwhile
+	bool lcdParked;
+
+	// Shows a blank frame and parks the PPU
+	void parkLCD();
+
+	// Restarts the PPU at the start of a frame
+	void resumeLCD();
+
+	// Copies VRAM and OAM from the MemoryMap and has it log
+	// further writes to them while the scanline renderer runs
+	void followVideoMemory();
+
+	// Pixel FIFO renderer, see setPixelFifo()
+	// Lines are drawn dot by dot in mode 3 from live VRAM, OAM and
+	// registers, and mode 3 lasts as long as the fetchers take
+	// Pulled from https://gbdev.io/pandocs/pixel_fifo.html
+	bool pixelFifo;
+
+	struct PixelFifo
+	{
+		// Line and dots into the line, 0 - 455
+		// The dot is the next one to run
+		Byte line;
+		int dot;
+
+		// Pixels pushed to the LCD on the line, 0 - 160
+		int x;
+
+		// Pixels still to be dropped for SCX at the start of the line
+		int discard;
+
+		// BG fetcher
+		// Dots into the fetch, the tile number is read on dot 2, the
+		// low and high data on dots 4 and 6, then the row is pushed
+		// as soon as the BG FIFO is empty
+		int fetchStep;
+		Byte fetchColumn;
+		Byte fetchTile;
+		Byte fetchLow;
+		Byte fetchHigh;
+		bool fetchWindow;
+
+		// The first fetch of a line is thrown away
+		bool firstFetch;
+
+		// BG FIFO, color numbers, bgCount of them still to be shifted out
+		Byte bg[8];
+		int bgCount;
+
+		// OBJ FIFO, lined up with the next 8 pixels of the BG FIFO
+		// color 0 is transparent
+		struct
+		{
+			Byte color;
+			Byte flags;
+		} obj[8];
+		int objHead;
+
+		// Sprites the OAM scan found on the line, in OAM order
+		Byte sprites[10];
+		int spriteCount;
+
+		// Bit per entry of sprites that has been fetched
+		Word spritesFetched;
+
+		// Entry of sprites being fetched, -1 for none
+		// spriteDots counts down the fetch, it is -1 while the
+		// BG fetcher finishes its own fetch first
+		int spriteFetch;
+		int spriteDots;
+
+		// LY matched WY this frame
+		bool windowY;
+
+		// The window was drawn on the line
+		bool windowDrawn;
+
+		// Internal window line counter
+		Byte windowLine;
+	} fifo;
+
+	// Runs one dot of the pixel FIFO PPU
+	void stepFifo();
+
+	// OAM scan and mode 3 of the pixel FIFO PPU
+	void scanFifoSprites();
+	void startFifoLine();
+	void transferFifoDot();
+
+	// Advances the BG fetcher by a dot
+	void fetchFifoBackground();
+
+	// Mixes color, shifted out of the BG FIFO, with the OBJ FIFO
+	// and puts the pixel on the LCD
+	void outputFifoPixel(Byte color, Byte LCDC);
+
+	// Entry of fifo.sprites to fetch at the current pixel, -1 for none
+	int nextFifoSprite();
+
+	// Mixes the sprite at entry of fifo.sprites into the OBJ FIFO
+	void fetchFifoSprite(int entry);
+
+	// Sets the STAT mode and raises its interrupts
+	void setFifoMode(Byte mode);
+
+	// Frame skipping
+	// Skipped frames keep LY, STAT and interrupt timing exact
+	// but are neither rasterized nor shown
+	// frameSkip frames are skipped after each drawn one, or with
+	// FRAME_SKIP_AUTO as long as the host misses the frame deadline
+	int frameSkip;
+
+	// Set while the fast forward key is held
+	std::atomic<bool> fastForward;
+
+	// The frame in progress is not drawn
+	bool skipFrame;
+
+	// Frames skipped in a row
+	int framesSkipped;
+
+	// Frames skipped while fast forwarding
+	const int fastForwardSkip = 9;
+
+	// Most frames FRAME_SKIP_AUTO skips in a row
+	// so the screen still updates on a slow host
+	const int maxAutoFrameSkip = 8;
+
+	// Real-time pacing
+	// The emulation thread waits at VBlank until the frame is due
+	// so games run at 59.73 frames a second, except while fast forwarding
+	bool speedLimit;
+
+	// Host time the next frame is due at, 0 to start over
+	// in SDL_GetPerformanceCounter() ticks
+	Uint64 frameDeadline;
+
+	// Frames the host may fall behind before the pacer stops catching up
+	const int maxLagFrames = 8;
+
+	// Cycles run with the LCD off since the last paced frame
+	int parkedClocks;
+
+	// Waits until the frame that just ended is due
+	// Returns how late it ended, in SDL_GetPerformanceCounter() ticks
+	long long paceFrame();
+
+	// Decides if the next frame is drawn
+	// Called once a frame when VBlank starts
+	void scheduleFrame();
 
 public:
 	PPU();
+
+	// close() must have been called
+	~PPU();
+
+	// Opens the window, starting the presentation thread if there is one
 	bool init();
+
+	// Applies input gathered by the thread owning the window
+	// Returns true once quitting was asked for, with the window closed
 	bool pollEvents();
-	void renderScanline(Byte line);
 	void close();
-	void setMemoryMap(MemoryMap* m) { mMap = m; }
+
+	// Also starts following VRAM and OAM writes of m
+	void setMemoryMap(MemoryMap* m);
 	void executePPU(int cycles);
 	Byte getPPUMode() { return ppuMode; }
+
+	// frameSkip value to skip frames while the host is behind
+	static const int FRAME_SKIP_AUTO = -1;
+
+	// Sets the number of frames skipped after each drawn frame
+	// 0 draws every frame, the default, FRAME_SKIP_AUTO adapts to the host
+	void setFrameSkip(int frames) { frameSkip = frames; }
+
+	// Runs no faster than a Game Boy when on, the default
+	// Off runs as fast as the host allows, e.g. to benchmark
+	void setSpeedLimit(bool limit) { speedLimit = limit; }
+
+	// Sets how frames are scaled up for the window, before init()
+	// factor is 1 to 4 for SCALE_NEAREST and ignored for SCALE_2X
+	// Scaling runs where frames are shown, off the emulation thread
+	// where there is a presentation thread
+	void setScaling(ScaleFilter filter, int factor);
+
+	// Selects the pixel FIFO PPU, before the first executePPU()
+	// It models the fetchers and FIFOs dot by dot, so mid-line register
+	// writes and mode 3 length are exact, at several times the cost of
+	// the scanline renderer, see gbbench
+	void setPixelFifo(bool enabled);
+	bool getPixelFifo() const { return pixelFifo; }
+
+	// Writes where the PPU is in the frame to file and reads it back
+	// The MemoryMap state must be loaded first, VRAM and OAM come from it
+	// Returns false if file could not be written, was too short or
+	// was saved by the other renderer, see setPixelFifo()
+	bool saveState(FILE* file);
+	bool loadState(FILE* file);
+
+	// Sets the number of threads frames are drawn with, 1 or more
+	// The frame is the same whatever the number
+	void setRenderThreads(int threads);
+
+	// Host time spent drawing frames so far
+	// in SDL_GetPerformanceCounter() ticks
+	Uint64 getRenderTicks() const { return renderTicks; }
+
+	// Returns the frame as shade indices, see frameBuffer
+	const Byte* getFrameBuffer() const { return frameBuffer; }
+
+	// Converts the frame to format into destination
+	// pitch is the distance in bytes between lines of destination
+	void copyFrame(FrameFormat format, void* destination, int pitch) const { convertFrame(frameBuffer, 0, 144, format, destination, pitch); }
+
+	struct PresentStats
+	{
+		// Frames uploaded and presented
+		unsigned long long framesShown;
+
+		// Frames equal to the last one shown, neither uploaded nor presented
+		unsigned long long framesUnchanged;
+
+		// Lines converted and uploaded, and lines that did not need to be
+		unsigned long long linesUploaded;
+		unsigned long long linesUnchanged;
+	};
+
+	// Returns what showing frames took and saved so far
+	PresentStats getPresentStats() const { return { framesShown, framesUnchanged, linesUploaded, linesUnchanged }; }
+
+	// Cycles executePPU can be given without a mode change
+	// 0 while a scanline or frame waits to be drawn
+	// Inline as the CPU uses it in gbdiff, which has no PPU
+	int getCyclesToNextEvent()
+	{
+		// Nothing happens until the LCD is turned on by an instruction
+		if (lcdParked)
+			return INT_MAX;
+
+		// Mode 3 draws dot by dot from memory as it is
+		if (pixelFifo)
+		{
+			if (ppuMode == TRANSFER || fifo.dot == 456)
+				return 0;
+			return ((ppuMode == OAM) ? 80 : 456) - fifo.dot;
+		}
+
+		// Drawing happens on the first call in the mode
+		// and must see memory as it was at that point
+		if ((ppuMode == HBLANK && !scanlineRendered) || (ppuMode == VBLANK && !frameRendered))
+			return 0;
+
+		return currentClock;
+	}
 };
@@ -0,0 +1,239 @@
+#include "harness.h"
+#include "opcodes.h"
+#include <algorithm>
+#include <stdio.h>
+
+// Most steps a block engine may take to line up with the other engine
+// A fused loop can run for CPU::maxFusedCycles
+#define MAX_CATCH_UP_STEPS 4096
+
+DiffEngine::DiffEngine()
+{
+	mMap = new MemoryMap();
+	mMap->setWriteTrace(&writes);
+}
+
+DiffEngine::~DiffEngine()
+{
+	delete mMap;
+}
+
+bool DiffEngine::loadRom(const char* romPath, const char* bootPath)
+{
+	FILE* rom = fopen(romPath, "rb");
+	if (rom == NULL)
+	{
+		printf("ROM file %s not opened\n", romPath);
+		return false;
+	}
+	mMap->setRomFile(rom);
+
+	if (bootPath)
+	{
+		FILE* boot = fopen(bootPath, "rb");
+		if (boot == NULL)
+		{
+			printf("Boot ROM file %s not opened\n", bootPath);
+			return false;
+		}
+		mMap->setBootRomFile(boot);
+	}
+
+	mMap->mapRom();
+	return true;
+}
+
+ReferenceEngine::ReferenceEngine()
+{
+	cpu.setMemory(mMap);
+}
+
+CPUEngine::CPUEngine(const char* module, bool fusion)
+{
+	cpu.setMemory(mMap);
+	cpu.setFusion(fusion);
+	modulePath = module ? module : "";
+	fused = fusion;
+	name = module ? "recompiled" : (fusion ? "fused" : "interpreter");
+}
+
+void CPUEngine::bootFinished()
+{
+	DiffEngine::bootFinished();
+	if (!modulePath.empty())
+		cpu.loadRecompiledModule(modulePath.c_str(), mMap->getRomHash());
+}
+
+DiffHarness::DiffHarness(DiffEngine* a, DiffEngine* b)
+{
+	engineA = a;
+	engineB = b;
+	cyclesA = 0;
+	cyclesB = 0;
+	comparisons = 0;
+}
+
+bool DiffHarness::loadInput(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+	{
+		printf("Input file %s not opened\n", path);
+		return false;
+	}
+
+	unsigned long long cycle;
+	unsigned int state;
+	while (fscanf(file, "%llu %x", &cycle, &state) == 2)
+		inputs.push_back({ cycle, (Byte)state });
+	fclose(file);
+
+	std::stable_sort(inputs.begin(), inputs.end(), [](const InputEvent& a, const InputEvent& b) { return a.cycle < b.cycle; });
+	return true;
+}
+
+void DiffHarness::step(DiffEngine* engine, std::vector<Word>& steps, unsigned long long& cycles)
+{
+	steps.push_back(engine->getState().PC);
+	int taken = engine->step();
+	cycles += taken;
+
+	// Ends OAM DMA, which holds the bus until then
+	engine->getMemory()->advanceClock(taken);
+}
+
+bool DiffHarness::run(unsigned long long maxCycles, bool booting)
+{
+	size_t nextInput = 0;
+
+	if (!booting)
+	{
+		engineA->bootFinished();
+		engineB->bootFinished();
+	}
+
+	while (cyclesA < maxCycles)
+	{
+		// Both engines see the same input at the same cycle
+		while (nextInput < inputs.size() && inputs[nextInput].cycle <= cyclesA)
+		{
+			*(engineA->getMemory()->joyPadState) = inputs[nextInput].state;
+			*(engineB->getMemory()->joyPadState) = inputs[nextInput].state;
+			nextInput++;
+		}
+
+		CPUState before = engineA->getState();
+		stepsA.clear();
+		stepsB.clear();
+		engineA->getWrites().clear();
+		engineB->getWrites().clear();
+
+		step(engineA, stepsA, cyclesA);
+		step(engineB, stepsB, cyclesB);
+
+		// Block engines are compared once both stop at the same cycle
+		if (engineA->runsBlocks() || engineB->runsBlocks())
+		{
+			for (int i = 0; cyclesA != cyclesB && i < MAX_CATCH_UP_STEPS; i++)
+			{
+				if (cyclesA < cyclesB)
+					step(engineA, stepsA, cyclesA);
+				else
+					step(engineB, stepsB, cyclesB);
+			}
+		}
+
+		if (!compare(before))
+			return false;
+		comparisons++;
+
+		if (booting && engineA->getMemory()->readMemory(0xFF50) && engineB->getMemory()->readMemory(0xFF50))
+		{
+			engineA->bootFinished();
+			engineB->bootFinished();
+			booting = false;
+		}
+	}
+
+	return true;
+}
+
+// Writes are compared per address
+// Engines may order writes to different addresses differently within an instruction
+static std::vector<MemoryWrite> sortedWrites(const std::vector<MemoryWrite>& writes)
+{
+	std::vector<MemoryWrite> sorted = writes;
+	std::stable_sort(sorted.begin(), sorted.end(), [](const MemoryWrite& a, const MemoryWrite& b) { return a.address < b.address; });
+	return sorted;
+}
+
+bool DiffHarness::compare(const CPUState& before)
+{
+	CPUState a = engineA->getState();
+	CPUState b = engineB->getState();
+
+	const char* reason = nullptr;
+	if (cyclesA != cyclesB)
+		reason = "cycle counts differ";
+	else if (a.AF != b.AF)
+		reason = (a.AF >> 8) != (b.AF >> 8) ? "register A differs" : "flags differ";
+	else if (a.BC != b.BC || a.DE != b.DE || a.HL != b.HL)
+		reason = "registers differ";
+	else if (a.SP != b.SP || a.PC != b.PC)
+		reason = "SP or PC differ";
+	else if (a.IME != b.IME || a.halted != b.halted)
+		reason = "IME or HALT state differs";
+	else
+	{
+		std::vector<MemoryWrite> writesA = sortedWrites(engineA->getWrites());
+		std::vector<MemoryWrite> writesB = sortedWrites(engineB->getWrites());
+		bool equal = writesA.size() == writesB.size();
+		for (size_t i = 0; equal && i < writesA.size(); i++)
+			equal = writesA[i].address == writesB[i].address && writesA[i].value == writesB[i].value;
+		if (!equal)
+			reason = "memory writes differ";
+	}
+
+	if (!reason)
+		return true;
+
+	printf("Divergence after %llu comparisons: %s\n\n", comparisons, reason);
+	printf("State before:\n");
+	printState(engineA, before);
+	printf("\nExecuted:\n");
+	printSteps(engineA, stepsA);
+	printSteps(engineB, stepsB);
+	printf("\nState after:\n");
+	printState(engineA, a);
+	printState(engineB, b);
+	printf("\nCycles:\n  %-12s %llu\n  %-12s %llu\n", engineA->getName(), cyclesA, engineB->getName(), cyclesB);
+	printf("\nMemory writes:\n");
+	printWrites(engineA);
+	printWrites(engineB);
+	return false;
+}
+
+void DiffHarness::printState(DiffEngine* engine, const CPUState& state)
+{
+	printf("  %-12s AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X [%c%c%c%c] IME=%d HALT=%d\n", engine->getName(), state.AF, state.BC, state.DE, state.HL, state.SP, state.PC, (state.AF & 0x80) ? 'Z' : '-', (state.AF & 0x40) ? 'N' : '-', (state.AF & 0x20) ? 'H' : '-', (state.AF & 0x10) ? 'C' : '-', state.IME, state.halted);
+}
+
+void DiffHarness::printSteps(DiffEngine* engine, const std::vector<Word>& steps)
+{
+	MemoryMap* memory = engine->getMemory();
+	for (Word pc : steps)
+	{
+		Byte bytes[3] = { memory->readMemory(pc), memory->readMemory(pc + 1), memory->readMemory(pc + 2) };
+		char text[32];
+		formatInstruction(bytes, pc, text, sizeof(text));
+		printf("  %-12s %04X: %s%s\n", engine->getName(), pc, text, engine->runsBlocks() ? " ..." : "");
+	}
+}
+
+void DiffHarness::printWrites(DiffEngine* engine)
+{
+	printf("  %-12s", engine->getName());
+	for (const MemoryWrite& write : engine->getWrites())
+		printf(" %04X=%02X", write.address, write.value);
+	printf("\n");
+}
@@ -0,0 +1,141 @@
+#pragma once
+#include "types.h"
+#include "cpu.h"
+#include "mmap.h"
+#include "reference.h"
+#include <string>
+#include <vector>
+
+// Differential co-execution harness
+// Runs two CPU engines in lockstep on the same ROM and input stream
+// and reports the first instruction after which their registers, flags,
+// cycle counts or memory writes differ
+//
+// Only the CPU is co-executed, the PPU is not run
+// so interrupts come from writes to IF, the timer and joypad input only
+
+// A CPU implementation under comparison
+// Each engine owns a MemoryMap loaded with the same ROM
+class DiffEngine
+{
+protected:
+	MemoryMap* mMap;
+
+	// Writes done since the last comparison
+	std::vector<MemoryWrite> writes;
+
+public:
+	DiffEngine();
+	virtual ~DiffEngine();
+
+	virtual const char* getName() = 0;
+
+	// Execute one instruction, or one block, and service interrupts
+	// Returns the cycles taken
+	virtual int step() = 0;
+
+	virtual CPUState getState() = 0;
+	virtual void setState(const CPUState& state) = 0;
+
+	// Returns true if step() may execute more than one instruction
+	virtual bool runsBlocks() { return false; }
+
+	// Unmap the boot ROM
+	virtual void bootFinished() { mMap->unloadBootRom(); }
+
+	// Map the ROM, bootPath may be nullptr to start after the boot ROM
+	bool loadRom(const char* romPath, const char* bootPath);
+
+	MemoryMap* getMemory() { return mMap; }
+	std::vector<MemoryWrite>& getWrites() { return writes; }
+};
+
+// The reference model, see reference.h
+class ReferenceEngine : public DiffEngine
+{
+private:
+	ReferenceCPU cpu;
+
+public:
+	ReferenceEngine();
+
+	const char* getName() override { return "reference"; }
+	int step() override { return cpu.step(); }
+	CPUState getState() override { return cpu.getState(); }
+	void setState(const CPUState& state) override { cpu.setState(state); }
+};
+
+// The production CPU, optionally running a recompiled module
+// or fusing loops into superinstructions
+class CPUEngine : public DiffEngine
+{
+private:
+	CPU cpu;
+
+	// Path of the module built by gbrecomp, empty to interpret
+	std::string modulePath;
+
+	bool fused;
+
+	std::string name;
+
+public:
+	CPUEngine(const char* module, bool fusion = false);
+
+	const char* getName() override { return name.c_str(); }
+	int step() override { return cpu.executeNextInstruction() + cpu.performInterrupt(); }
+	CPUState getState() override { return cpu.getState(); }
+	void setState(const CPUState& state) override { cpu.setState(state); }
+	bool runsBlocks() override { return !modulePath.empty() || fused; }
+	void bootFinished() override;
+};
+
+class DiffHarness
+{
+private:
+	DiffEngine* engineA;
+	DiffEngine* engineB;
+
+	// Joypad state to apply once a cycle count is reached
+	struct InputEvent
+	{
+		unsigned long long cycle;
+		Byte state;
+	};
+
+	std::vector<InputEvent> inputs;
+
+	// PCs of the instructions or blocks run since the last comparison
+	std::vector<Word> stepsA;
+	std::vector<Word> stepsB;
+
+	// Cycle counts of both engines
+	unsigned long long cyclesA;
+	unsigned long long cyclesB;
+
+	// Comparisons done so far
+	unsigned long long comparisons;
+
+	// Step an engine and record where it started
+	void step(DiffEngine* engine, std::vector<Word>& steps, unsigned long long& cycles);
+
+	// Returns true if the engines agree
+	bool compare(const CPUState& before);
+
+	void printState(DiffEngine* engine, const CPUState& state);
+	void printSteps(DiffEngine* engine, const std::vector<Word>& steps);
+	void printWrites(DiffEngine* engine);
+
+public:
+	DiffHarness(DiffEngine* a, DiffEngine* b);
+
+	// Read a joypad input stream
+	// One "<cycle> <joypad state in hex>" pair per line
+	bool loadInput(const char* path);
+
+	// Run until a divergence or maxCycles
+	// Returns true if no divergence was found
+	bool run(unsigned long long maxCycles, bool booting);
+
+	unsigned long long getComparisons() { return comparisons; }
+};
@@ -0,0 +1,86 @@
+#include "harness.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// gbdiff
+// Usage: gbdiff [--boot <file>] [--input <file>] [--cycles <n>] [--a <engine>] [--b <engine>] <rom>
+// Engines: reference, interpreter, fused, recompiled=<module>
+// Defaults to comparing the reference model with the interpreter
+
+static DiffEngine* createEngine(const char* spec)
+{
+	if (strcmp(spec, "reference") == 0)
+		return new ReferenceEngine();
+	if (strcmp(spec, "interpreter") == 0)
+		return new CPUEngine(nullptr);
+	if (strcmp(spec, "fused") == 0)
+		return new CPUEngine(nullptr, true);
+	if (strncmp(spec, "recompiled=", 11) == 0)
+		return new CPUEngine(spec + 11);
+
+	printf("Unknown engine %s\n", spec);
+	return nullptr;
+}
+
+int main(int argc, char** argv)
+{
+	const char* bootPath = nullptr;
+	const char* inputPath = nullptr;
+	const char* specA = "reference";
+	const char* specB = "interpreter";
+	const char* romPath = nullptr;
+	unsigned long long maxCycles = 4194304ULL * 60;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--boot") == 0 && i + 1 < argc)
+			bootPath = argv[++i];
+		else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+			inputPath = argv[++i];
+		else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+			maxCycles = strtoull(argv[++i], nullptr, 0);
+		else if (strcmp(argv[i], "--a") == 0 && i + 1 < argc)
+			specA = argv[++i];
+		else if (strcmp(argv[i], "--b") == 0 && i + 1 < argc)
+			specB = argv[++i];
+		else
+			romPath = argv[i];
+	}
+
+	if (!romPath)
+	{
+		printf("Usage: %s [--boot <file>] [--input <file>] [--cycles <n>] [--a <engine>] [--b <engine>] <rom>\n", argv[0]);
+		printf("Engines: reference, interpreter, fused, recompiled=<module>\n");
+		return 1;
+	}
+
+	DiffEngine* a = createEngine(specA);
+	DiffEngine* b = createEngine(specB);
+	if (!a || !b || !a->loadRom(romPath, bootPath) || !b->loadRom(romPath, bootPath))
+		return 1;
+
+	// Without a boot ROM start from the state the DMG boot ROM leaves
+	if (!bootPath)
+	{
+		a->getMemory()->setPostBootState();
+		b->getMemory()->setPostBootState();
+		a->setState(POST_BOOT_STATE);
+		b->setState(POST_BOOT_STATE);
+	}
+
+	DiffHarness harness(a, b);
+	if (inputPath && !harness.loadInput(inputPath))
+		return 1;
+
+	auto start = std::chrono::steady_clock::now();
+	bool agreed = harness.run(maxCycles, bootPath != nullptr);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("\n%llu comparisons in %.2fs (%.2f million per second)\n", harness.getComparisons(), seconds, harness.getComparisons() / seconds / 1e6);
+	if (agreed)
+		printf("No divergence in %llu cycles\n", maxCycles);
+
+	return agreed ? 0 : 2;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "types.h"
+#include <stddef.h>
+
+// 64 bit FNV-1a hash
+// Used to identify ROMs and other blobs of emulator memory
+// Pulled from http://www.isthe.com/chongo/tech/comp/fnv/index.html
+inline unsigned long long hashBytes(const Byte* data, size_t size, unsigned long long hash = 0xCBF29CE484222325ULL)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
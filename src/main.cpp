@@ -1,8 +1,25 @@
 #include "gameBoy.h"
+#include <stdlib.h>
+#include <string.h>
 
 int main(int argv, char** argc)
 {
-	GBE* gbe = new GBE();
+	// --skip-boot starts the game without the boot ROM
+	// --frame-skip <n|auto> skips n frames after each drawn one,
+	// or with auto as long as the host can't keep up
+	bool skipBoot = false;
+	int frameSkip = 0;
+	for (int i = 1; i < argv; i++)
+	{
+		if (strcmp(argc[i], "--skip-boot") == 0)
+			skipBoot = true;
+		else if (strcmp(argc[i], "--frame-skip") == 0 && i + 1 < argv)
+		{
+			i++;
+			frameSkip = (strcmp(argc[i], "auto") == 0) ? PPU::FRAME_SKIP_AUTO : atoi(argc[i]);
+		}
+	}
+	GBE* gbe = new GBE(skipBoot, frameSkip);
 
 	return 0;
 }
\ No newline at end of file
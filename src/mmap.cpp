@@ -1,5 +1,17 @@
 #include "mmap.h"
+#include "hash.h"
+#include "recompiled.h"
+#include <algorithm>
 #include <cstring>
+#include <ctime>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Constructor
 MemoryMap::MemoryMap()
@@ -10,16 +22,22 @@ MemoryMap::MemoryMap()
 	memset(romBank0, 0x00, 0x4000);
 
 	// 16kb ROM bank 1
-	romBank1 = new Byte[0x4000];
-	memset(romBank1, 0x00, 0x4000);
+	// The rest of the ROM is read by mapRom()
+	romSize = 0x8000;
+	romData = new Byte[romSize];
+	memset(romData, 0x00, romSize);
+	romBank1 = romData + 0x4000;
 
 	// 8kb Video RAM
 	videoRam = new Byte[0x2000];
 	memset(videoRam, 0x00, 0x2000);
 
 	// 8kb External RAM
-	externalRam = new Byte[0x2000];
-	memset(externalRam, 0x00, 0x2000);
+	// Grown by mapRom() for cartridges with more
+	cartRamSize = 0x2000;
+	cartRam = new Byte[cartRamSize];
+	memset(cartRam, 0x00, cartRamSize);
+	externalRam = cartRam;
 
 	// 8kb Work RAM
 	workRam = new Byte[0x2000];
@@ -46,6 +64,7 @@ MemoryMap::MemoryMap()
 
 	// 1 byte Interrupt Enable Register
 	interruptEnableRegister = new Byte;
+	*interruptEnableRegister = 0x00;
 
 	// Joypad Input at 0xFF00
 	reg_JOYP = ioPorts + 0x00;
@@ -101,29 +120,151 @@ MemoryMap::MemoryMap()
 	joyPadState = new Byte;
 	*joyPadState = 0xFF;
 
+	pendingInterrupts = 0x00;
+
+	// The timer starts stopped with every counter at 0
+	clock = 0;
+	dividerReset = 0;
+	timerValue = 0;
+	timerSync = 0;
+	timerOverflow = ~0ULL;
+
+	// Nothing held until the PPU runs
+	vramBlocked = false;
+	oamBlocked = false;
+
+	// No OAM DMA
+	dmaActive = false;
+	dmaSource = 0x0000;
+	dmaEnd = ~0ULL;
+	dmaStarting = false;
+
 	bootRomFile = nullptr;
 	romFile = nullptr;
+	romHash = 0;
+	writeTrace = nullptr;
+	videoLog = nullptr;
 
 	mbcMode = 0x0;
+
+	// No MBC until mapRom() reads the header
+	mbc3 = false;
+	romBank = 1;
+	ramBank = 0;
+	ramEnabled = false;
+	latchWrite = 0xFF;
+
+	// The clock starts at 0 when first used
+	hasClock = false;
+	clockBase = 0;
+	clockHalted = 0;
+	clockStopped = false;
+	clockCarry = false;
+	memset(clockLatched, 0x00, sizeof(clockLatched));
+
+	// Cartridge RAM is not saved until loadSaveRam()
+	saveRam = nullptr;
+	saveRamSize = 0;
+	flushedSaveRam = nullptr;
+#ifdef _WIN32
+	saveFile = INVALID_HANDLE_VALUE;
+	saveMapping = nullptr;
+#else
+	saveFile = -1;
+#endif
+
+	remapPages();
+}
+
+// Destructor
+MemoryMap::~MemoryMap()
+{
+	delete[] romBank0;
+	delete[] romData;
+	delete[] videoRam;
+
+	// The last writes to cartridge RAM reach the save file
+	if (saveRam)
+	{
+		flushSaveRam(true);
+#ifdef _WIN32
+		UnmapViewOfFile(saveRam);
+		CloseHandle(saveMapping);
+		CloseHandle(saveFile);
+#else
+		munmap(saveRam, saveRamSize);
+		close(saveFile);
+#endif
+		delete[] flushedSaveRam;
+	}
+	else
+		delete[] cartRam;
+	delete[] workRam;
+	delete[] oamTable;
+	delete[] ioPorts;
+	delete[] highRam;
+	delete interruptEnableRegister;
+	delete joyPadState;
+}
+
+void MemoryMap::remapPages(int first, int last)
+{
+	for (int page = first; page <= last; page++)
+	{
+		int remaining;
+		readPages[page] = (dmaActive && page < 0xFF) ? nullptr : getPlainMemory(page << 8, remaining);
+		writePages[page] = (page >= 0x80 && !(videoLog && page < 0xA0)) ? readPages[page] : nullptr;
+	}
+
+	for (int* page : pageCaches)
+		*page = -1;
 }
 
 // Write to memory
 // TODO: Make emulation memory secure
 bool MemoryMap::writeMemory(Word address, Byte value)
 {
+	if (writeTrace)
+		writeTrace->push_back({ address, value });
+
+	// Only HRAM and the I/O ports are reachable during OAM DMA
+	if (dmaActive && address < 0xFF00)
+		return false;
+
 	if (address < 0x8000)
 	{
+		if (mbc3)
+		{
+			writeMBC3(address, value);
+			return true;
+		}
+
 		printf("Writing to ROM is not allowed! Write attempted at %04X", address);
 		return false;
 	}
 	else if (address < 0xA000)
 	{
 		// Write to Video RAM
+		if (vramBlocked)
+			return false;
 		videoRam[address - 0x8000] = value;
+		if (videoLog)
+			videoLog->push_back({ address, value });
 	}
 	else if (address < 0xC000)
 	{
 		// Write to External RAM
+		if (mbc3)
+		{
+			if (!ramEnabled)
+				return false;
+			if (ramBank >= 0x08)
+			{
+				if (hasClock && ramBank <= 0x0C)
+					writeClock(ramBank, value);
+				return true;
+			}
+		}
 		externalRam[address - 0xA000] = value;
 	}
 	else if (address < 0xE000)
@@ -139,7 +280,11 @@ bool MemoryMap::writeMemory(Word address, Byte value)
 	else if (address < 0xFEA0)
 	{
 		// Write to OAM Table
+		if (oamBlocked)
+			return false;
 		oamTable[address - 0xFE00] = value;
+		if (videoLog)
+			videoLog->push_back({ address, value });
 	}
 	else if (address < 0xFF00)
 	{
@@ -150,21 +295,46 @@ bool MemoryMap::writeMemory(Word address, Byte value)
 	else if (address < 0xFF80)
 	{
 		// Check for reg_DIV write quirk
-		// Writes to DIV reset the DIV to 0
+		// Writes to DIV reset the whole counter to 0
 		// else write to I/O ports
 		if (address == 0xFF04)
-			*reg_DIV = 0x00;
+		{
+			syncTimer();
+
+			// Resetting the counter is a falling edge
+			// of the bit TIMA counts if that bit was set
+			if ((*reg_TAC & 0x04) && (getDivider() & (1ULL << (timerShifts[*reg_TAC & 0x03] - 1))))
+				incrementTimer();
+
+			dividerReset = clock;
+			timerSync = 0;
+			scheduleTimer();
+		}
+		else if (address == 0xFF05)
+		{
+			syncTimer();
+			timerValue = value;
+			scheduleTimer();
+		}
+		else if (address == 0xFF07)
+		{
+			syncTimer();
+
+			// The bit TIMA counts is ANDed with the enable bit
+			// so a change that takes it from 1 to 0 is a falling edge too
+			bool before = (*reg_TAC & 0x04) && (getDivider() & (1ULL << (timerShifts[*reg_TAC & 0x03] - 1)));
+			bool after = (value & 0x04) && (getDivider() & (1ULL << (timerShifts[value & 0x03] - 1)));
+			*reg_TAC = value;
+			if (before && !after)
+				incrementTimer();
+
+			scheduleTimer();
+		}
 		// Check for DMA transfer
-		// Writing a loop instead of std::copy
-		// as memoury is not a single unit
-		// in our architecture
 		else if (address == 0xFF46)
 		{
-			Word val = value;
-			val = val << 8;
-			for (Word i = 0; i < 0xA0; i++)
-				oamTable[i] = readMemory(val + i);
 			ioPorts[address - 0xFF00] = value;
+			startDMA(value);
 		}
 		else if (address == 0xFF44)
 			*reg_LY = 0x00;
@@ -172,6 +342,11 @@ bool MemoryMap::writeMemory(Word address, Byte value)
 		{
 			readInput(value);
 		}
+		else if (address == 0xFF0F)
+		{
+			*reg_IF = value;
+			updatePendingInterrupts();
+		}
 		//if (value != 0xFF)
 		//printf("0x%02x\n", ioPorts[0]);}
 		else
@@ -186,6 +361,7 @@ bool MemoryMap::writeMemory(Word address, Byte value)
 	{
 		// Write to Interrupt Enable Register
 		*interruptEnableRegister = value;
+		updatePendingInterrupts();
 	}
 	else
 	{
@@ -203,6 +379,10 @@ void MemoryMap::debugWriteMemory(Word address, Byte value)
 
 Byte MemoryMap::readMemory(Word address)
 {
+	// Only HRAM and the I/O ports are reachable during OAM DMA
+	if (dmaActive && address < 0xFF00)
+		return 0xFF;
+
 	if (address < 0x4000)
 	{
 		// Read from ROM bank 0
@@ -216,11 +396,20 @@ Byte MemoryMap::readMemory(Word address)
 	else if (address < 0xA000)
 	{
 		// Read from Video RAM
+		if (vramBlocked)
+			return 0xFF;
 		return videoRam[address - 0x8000];
 	}
 	else if (address < 0xC000)
 	{
 		// Read from External RAM
+		if (mbc3)
+		{
+			if (!ramEnabled)
+				return 0xFF;
+			if (ramBank >= 0x08)
+				return (hasClock && ramBank <= 0x0C) ? clockLatched[ramBank - 0x08] : 0xFF;
+		}
 		return externalRam[address - 0xA000];
 	}
 	else if (address < 0xE000)
@@ -236,6 +425,8 @@ Byte MemoryMap::readMemory(Word address)
 	else if (address < 0xFEA0)
 	{
 		// Read from OAM Table
+		if (oamBlocked)
+			return 0xFF;
 		return oamTable[address - 0xFE00];
 	}
 	else if (address < 0xFF00)
@@ -246,6 +437,12 @@ Byte MemoryMap::readMemory(Word address)
 	}
 	else if (address < 0xFF80)
 	{
+		// DIV and TIMA are not kept in the I/O ports
+		if (address == 0xFF04)
+			return (getDivider() >> 8) & 0xFF;
+		if (address == 0xFF05)
+			return getRegTIMA();
+
 		// Read from I/O Ports
 		return ioPorts[address - 0xFF00];
 	}
@@ -271,6 +468,238 @@ Byte MemoryMap::operator[](Word address)
 	return MemoryMap::readMemory(address);
 }
 
+Byte* MemoryMap::getPlainMemory(Word address, int& remaining)
+{
+	if (address < 0x4000)
+	{
+		remaining = 0x4000 - address;
+		return romBank0 + address;
+	}
+	else if (address < 0x8000)
+	{
+		remaining = 0x8000 - address;
+		return romBank1 + (address - 0x4000);
+	}
+	else if (address < 0xA000)
+	{
+		// Held by the PPU in mode 3
+		if (vramBlocked)
+		{
+			remaining = 0;
+			return nullptr;
+		}
+		remaining = 0xA000 - address;
+		return videoRam + (address - 0x8000);
+	}
+	else if (address < 0xC000)
+	{
+		// Disabled RAM and the clock registers have rules
+		if (mbc3 && (!ramEnabled || ramBank >= 0x08))
+		{
+			remaining = 0;
+			return nullptr;
+		}
+		remaining = 0xC000 - address;
+		return externalRam + (address - 0xA000);
+	}
+	else if (address < 0xE000)
+	{
+		remaining = 0xE000 - address;
+		return workRam + (address - 0xC000);
+	}
+	else if (address < 0xFE00)
+	{
+		remaining = 0xFE00 - address;
+		return echoRam + (address - 0xE000);
+	}
+	else if (address >= 0xFF80 && address < 0xFFFF)
+	{
+		remaining = 0xFFFF - address;
+		return highRam + (address - 0xFF80);
+	}
+
+	// OAM, unused memory and I/O all have side effects or rules
+	remaining = 0;
+	return nullptr;
+}
+
+bool MemoryMap::copyBlock(Word destination, Word source, int count)
+{
+	// Writes to ROM are rejected by writeMemory, leave those to it
+	// and OAM DMA leaves the CPU nothing plain to copy
+	if (dmaActive || destination < 0x8000 || destination + count > 0x10000 || source + count > 0x10000)
+		return false;
+
+	// Check both ranges before copying anything
+	for (int checked = 0, remaining; checked < count; checked += remaining)
+		if (!getPlainMemory(source + checked, remaining))
+			return false;
+	for (int checked = 0, remaining; checked < count; checked += remaining)
+		if (!getPlainMemory(destination + checked, remaining))
+			return false;
+
+	Word start = destination;
+	int total = count;
+
+	// Copy in runs that stay within one store on both sides
+	while (count > 0)
+	{
+		int sourceRemaining, destinationRemaining;
+		Byte* from = getPlainMemory(source, sourceRemaining);
+		Byte* to = getPlainMemory(destination, destinationRemaining);
+		int run = std::min(count, std::min(sourceRemaining, destinationRemaining));
+
+		// A destination just ahead of the source repeats the
+		// copied bytes like a byte by byte loop does, memmove would not
+		if (to > from && to < from + run)
+		{
+			for (int i = 0; i < run; i++)
+				to[i] = from[i];
+		}
+		else
+			memmove(to, from, run);
+
+		source += run;
+		destination += run;
+		count -= run;
+	}
+
+	// Trace what was written, which differs from the
+	// source before the copy when the ranges overlap
+	if (writeTrace)
+		for (int i = 0; i < total; i++)
+			writeTrace->push_back({ (Word)(start + i), readMemory(start + i) });
+
+	logVideoWrites(start, total, 1);
+	return true;
+}
+
+bool MemoryMap::fillBlock(Word destination, Byte value, int count, int step)
+{
+	Word first = (step > 0) ? destination : destination - (count - 1);
+	if (dmaActive || first < 0x8000 || first + count > 0x10000)
+		return false;
+
+	for (int checked = 0, remaining; checked < count; checked += remaining)
+		if (!getPlainMemory(first + checked, remaining))
+			return false;
+
+	if (writeTrace)
+		for (int i = 0; i < count; i++)
+			writeTrace->push_back({ (Word)(destination + i * step), value });
+
+	int total = count;
+	while (count > 0)
+	{
+		int remaining;
+		Byte* to = getPlainMemory(first, remaining);
+		int run = std::min(count, remaining);
+		memset(to, value, run);
+		first += run;
+		count -= run;
+	}
+
+	logVideoWrites(destination, total, step);
+	return true;
+}
+
+void MemoryMap::logVideoWrites(Word start, int count, int step)
+{
+	if (!videoLog)
+		return;
+
+	for (int i = 0; i < count; i++)
+	{
+		Word address = start + i * step;
+		if (address >= 0x8000 && address < 0xA000)
+			videoLog->push_back({ address, videoRam[address - 0x8000] });
+	}
+}
+
+void MemoryMap::startDMA(Byte source)
+{
+	dmaSource = source << 8;
+
+	// The clock is still at the start of the writing instruction
+	// dmaEnd is set once it is known, see advanceClock()
+	dmaStarting = true;
+	if (dmaActive)
+		return;
+
+	dmaActive = true;
+	remapPages();
+}
+
+void MemoryMap::finishDMA()
+{
+	dmaActive = false;
+	dmaEnd = ~0ULL;
+
+	// Sources in ROM or RAM are copied at once, the rest byte by byte
+	// Pages from 0xE0 up are the echo of work RAM or beyond it
+	int remaining;
+	Byte* source = getPlainMemory(dmaSource, remaining);
+	if (source && remaining >= 0xA0)
+		memcpy(oamTable, source, 0xA0);
+	else
+		for (Word i = 0; i < 0xA0; i++)
+			oamTable[i] = readMemory(dmaSource + i);
+
+	if (videoLog)
+		for (Word i = 0; i < 0xA0; i++)
+			videoLog->push_back({ (Word)(0xFE00 + i), oamTable[i] });
+
+	remapPages();
+}
+
+void MemoryMap::syncTimer()
+{
+	unsigned long long divider = getDivider();
+
+	// The falling edges between timerSync and now
+	// No overflow can be among them, advanceClock handles those
+	if (*reg_TAC & 0x04)
+	{
+		int shift = timerShifts[*reg_TAC & 0x03];
+		timerValue += (divider >> shift) - (timerSync >> shift);
+	}
+
+	timerSync = divider;
+}
+
+void MemoryMap::scheduleTimer()
+{
+	if (!(*reg_TAC & 0x04))
+	{
+		timerOverflow = ~0ULL;
+		return;
+	}
+
+	// The edge that takes TIMA from 0xFF to 0x00
+	int shift = timerShifts[*reg_TAC & 0x03];
+	unsigned long long edge = (timerSync >> shift) + (0x100 - timerValue);
+	timerOverflow = (edge << shift) + dividerReset;
+}
+
+void MemoryMap::incrementTimer()
+{
+	if (++timerValue == 0x00)
+	{
+		timerValue = *reg_TMA;
+		setRegIF(0x04);
+	}
+}
+
+void MemoryMap::overflowTimer()
+{
+	// TIMA is reloaded right away
+	// The 4 cycles it reads 0x00 on hardware are not modelled
+	timerSync = timerOverflow - dividerReset;
+	timerValue = *reg_TMA;
+	setRegIF(0x04);
+	scheduleTimer();
+}
+
 void MemoryMap::readInput(Byte value)
 {
 	ioPorts[0] = (ioPorts[0] & 0xCF) | (value & 0x30);
@@ -294,7 +723,7 @@ void MemoryMap::readInput(Byte value)
 	}
 
 	if ((ioPorts[0] & (~current) & 0x0F) != 0)
-		(*reg_IF) |= 0x10;
+		setRegIF(0x10);
 
 	ioPorts[0] = current;
 }
@@ -303,21 +732,488 @@ void MemoryMap::mapRom()
 {
 	// Load the Boot ROM
 	// Into the first 0x100 bytes
-	fread(romBank0, 1, 256, bootRomFile);
+	// Without one, bank 0 is filled from the game ROM below
+	if (bootRomFile)
+		fread(romBank0, 1, 256, bootRomFile);
+
+	// Load the whole game ROM in whole banks
+	// Banks past the second are switched in by the MBC
+	fseek(romFile, 0x00, SEEK_END);
+	long fileSize = ftell(romFile);
+	if (fileSize > romSize)
+	{
+		delete[] romData;
+		romSize = (fileSize + 0x3FFF) & ~0x3FFF;
+		romData = new Byte[romSize];
+		memset(romData, 0x00, romSize);
+	}
+	fseek(romFile, 0x00, SEEK_SET);
+	size_t read = fread(romData, 1, romSize, romFile);
+
+	// Hash the ROM as stored in the file
+	// before the boot ROM and logo patches touch bank 0
+	romHash = hashBytes(romData, std::min<size_t>(read, RECOMPILED_ROM_SIZE));
 
 	// Load Game ROM in Bank 0
 	// After offsetting for Boot ROM first
-	fseek(romFile, 0x100, SEEK_SET);
-
-	fread(romBank0 + 0x100, 1, 16128, romFile);
-	fread(romBank1, 1, 16384, romFile);
+	if (!bootRomFile)
+		memcpy(romBank0, romData, 0x100);
+	memcpy(romBank0 + 0x100, romData + 0x100, 0x3F00);
 
 	// Check 0x147 for MBC mode
 	mbcMode = romBank0[0x147];
+	mbc3 = mbcMode >= 0x0F && mbcMode <= 0x13;
+	hasClock = mbcMode == 0x0F || mbcMode == 0x10;
+	if (hasClock)
+		clockBase = time(nullptr);
+
+	// Room for every RAM bank
+	int ramSize = getCartRamSize();
+	if (ramSize > cartRamSize)
+	{
+		delete[] cartRam;
+		cartRamSize = ramSize;
+		cartRam = new Byte[cartRamSize];
+		memset(cartRam, 0x00, cartRamSize);
+	}
+
+	switchBanks();
+	remapPages();
 }
 
 void MemoryMap::unloadBootRom()
 {
 	fseek(romFile, 0x00, SEEK_SET);
 	fread(romBank0, 1, 256, romFile);
-}
\ No newline at end of file
+
+	remapPages();
+}
+
+bool MemoryMap::saveState(FILE* file)
+{
+	return fwrite(videoRam, 0x2000, 1, file) == 1
+		&& fwrite(workRam, 0x2000, 1, file) == 1
+		&& fwrite(oamTable, 0xA0, 1, file) == 1
+		&& fwrite(ioPorts, 0x80, 1, file) == 1
+		&& fwrite(highRam, 0x7F, 1, file) == 1
+		&& fwrite(interruptEnableRegister, 1, 1, file) == 1
+		&& fwrite(&clock, sizeof(clock), 1, file) == 1
+		&& fwrite(&dividerReset, sizeof(dividerReset), 1, file) == 1
+		&& fwrite(&timerValue, sizeof(timerValue), 1, file) == 1
+		&& fwrite(&timerSync, sizeof(timerSync), 1, file) == 1
+		&& fwrite(&timerOverflow, sizeof(timerOverflow), 1, file) == 1
+		&& fwrite(&dmaActive, sizeof(dmaActive), 1, file) == 1
+		&& fwrite(&dmaSource, sizeof(dmaSource), 1, file) == 1
+		&& fwrite(&dmaEnd, sizeof(dmaEnd), 1, file) == 1
+		&& fwrite(&vramBlocked, sizeof(vramBlocked), 1, file) == 1
+		&& fwrite(&oamBlocked, sizeof(oamBlocked), 1, file) == 1;
+}
+
+bool MemoryMap::loadState(FILE* file)
+{
+	bool read = fread(videoRam, 0x2000, 1, file) == 1
+		&& fread(workRam, 0x2000, 1, file) == 1
+		&& fread(oamTable, 0xA0, 1, file) == 1
+		&& fread(ioPorts, 0x80, 1, file) == 1
+		&& fread(highRam, 0x7F, 1, file) == 1
+		&& fread(interruptEnableRegister, 1, 1, file) == 1
+		&& fread(&clock, sizeof(clock), 1, file) == 1
+		&& fread(&dividerReset, sizeof(dividerReset), 1, file) == 1
+		&& fread(&timerValue, sizeof(timerValue), 1, file) == 1
+		&& fread(&timerSync, sizeof(timerSync), 1, file) == 1
+		&& fread(&timerOverflow, sizeof(timerOverflow), 1, file) == 1
+		&& fread(&dmaActive, sizeof(dmaActive), 1, file) == 1
+		&& fread(&dmaSource, sizeof(dmaSource), 1, file) == 1
+		&& fread(&dmaEnd, sizeof(dmaEnd), 1, file) == 1
+		&& fread(&vramBlocked, sizeof(vramBlocked), 1, file) == 1
+		&& fread(&oamBlocked, sizeof(oamBlocked), 1, file) == 1;
+
+	// What the pages point at depends on DMA and the PPU
+	updatePendingInterrupts();
+	remapPages();
+	return read;
+}
+
+void MemoryMap::setPostBootState()
+{
+	// Hardware registers
+	// Pulled from https://gbdev.io/pandocs/Power_Up_Sequence.html#hardware-registers
+	// The sound registers are kept for reads only
+	static const Byte sound[0x17] = {
+		0x80, 0xBF, 0xF3, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+		0x7F, 0xFF, 0x9F, 0xFF, 0xBF, 0xFF, 0xFF, 0x00, 0x00, 0xBF,
+		0x77, 0xF3, 0xF1
+	};
+	memcpy(ioPorts + 0x10, sound, sizeof(sound));
+	ioPorts[0x00] = 0xCF;
+	ioPorts[0x01] = 0x00;
+	ioPorts[0x02] = 0x7E;
+	ioPorts[0x46] = 0xFF;
+	ioPorts[0x50] = 0x01;
+	writeMemory(0xFF07, 0xF8);
+	writeMemory(0xFF0F, 0xE1);
+	writeMemory(0xFF40, 0x91);
+	writeMemory(0xFF42, 0x00);
+	writeMemory(0xFF43, 0x00);
+	writeMemory(0xFF47, 0xFC);
+	writeMemory(0xFFFF, 0x00);
+
+	// The divider counter reads 0xABCC when the boot ROM hands over
+	syncTimer();
+	dividerReset = clock - 0xABCC;
+	timerSync = getDivider();
+	scheduleTimer();
+
+	// The logo the boot ROM scrolled in, read from the cartridge header
+	// Every bit of the header is doubled into a 2x2 pixel, so each
+	// byte makes 4 rows of a tile, the second bit plane stays 0
+	Word tile = 0x8010;
+	for (Word address = 0x104; address < 0x134; address++)
+	{
+		Byte logo = romBank0[address];
+		for (int nibble = 1; nibble >= 0; nibble--)
+		{
+			Byte row = 0;
+			for (int bit = 3; bit >= 0; bit--)
+				row = (row << 2) | (((logo >> (nibble * 4 + bit)) & 0x01) * 0x03);
+			writeMemory(tile, row);
+			writeMemory(tile + 2, row);
+			tile += 4;
+		}
+	}
+
+	// The registered trademark, from the boot ROM itself
+	static const Byte trademark[8] = { 0x3C, 0x42, 0xB9, 0xA5, 0xB9, 0xA5, 0x42, 0x3C };
+	for (int row = 0; row < 8; row++)
+		writeMemory(tile + row * 2, trademark[row]);
+
+	// Tiles 1 - 12 and 13 - 24 in two rows, the trademark after the first
+	for (int i = 0; i < 12; i++)
+	{
+		writeMemory(0x9904 + i, 0x01 + i);
+		writeMemory(0x9924 + i, 0x0D + i);
+	}
+	writeMemory(0x9910, 0x19);
+}
+
+int MemoryMap::getSaveRamSize()
+{
+	// Cartridge types with a battery
+	// Pulled from https://gbdev.io/pandocs/The_Cartridge_Header.html
+	switch (romBank0[0x147])
+	{
+	case 0x03:
+	case 0x09:
+	case 0x0D:
+	case 0x0F:
+	case 0x10:
+	case 0x13:
+	case 0x1B:
+	case 0x1E:
+	case 0x22:
+	case 0xFF:
+		break;
+	case 0x06:
+		// MBC2 has 512 half bytes built in
+		return 0x200;
+	default:
+		return 0;
+	}
+
+	// Timer only cartridges have a battery but no RAM
+	return getCartRamSize();
+}
+
+int MemoryMap::getCartRamSize()
+{
+	int sizes[6] = { 0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+	Byte code = romBank0[0x149];
+	return (code < 6) ? sizes[code] : 0;
+}
+
+bool MemoryMap::loadSaveRam(const char* path)
+{
+	if (getSaveRamSize() == 0 && !hasClock)
+		return true;
+
+	// Smaller RAM is mirrored on hardware, the whole 8 KB window is
+	// saved here so that every address has somewhere to go
+	int size = cartRamSize + (hasClock ? CLOCK_SAVE_SIZE : 0);
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		printf("Save file %s not opened\n", path);
+		return false;
+	}
+
+	// The mapping grows the file if it is shorter
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, size, NULL);
+	Byte* memory = mapping ? (Byte*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size) : nullptr;
+	if (!memory)
+	{
+		printf("Save file %s not mapped\n", path);
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	saveMapping = mapping;
+#else
+	int file = open(path, O_RDWR | O_CREAT, 0644);
+	if (file < 0)
+	{
+		printf("Save file %s not opened\n", path);
+		return false;
+	}
+
+	// A new file is grown with zeros, a longer one is left as it is
+	struct stat info;
+	if (fstat(file, &info) != 0 || (info.st_size < size && ftruncate(file, size) != 0))
+	{
+		printf("Save file %s not resized\n", path);
+		close(file);
+		return false;
+	}
+
+	Byte* memory = (Byte*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	if (memory == MAP_FAILED)
+	{
+		printf("Save file %s not mapped\n", path);
+		close(file);
+		return false;
+	}
+#endif
+
+	saveFile = file;
+	saveRam = memory;
+	saveRamSize = size;
+	flushedSaveRam = new Byte[size];
+	memcpy(flushedSaveRam, saveRam, size);
+
+	delete[] cartRam;
+	cartRam = saveRam;
+	if (hasClock)
+		loadClock();
+
+	switchBanks();
+	remapPages();
+	return true;
+}
+
+void MemoryMap::flushSaveRam(bool wait)
+{
+	if (!saveRam)
+		return;
+
+	// Only pages that changed are handed to the system
+	// Comparing a few KB costs less than tracking every write
+	// msync takes addresses on a page boundary of the system
+#ifdef _WIN32
+	SYSTEM_INFO system;
+	GetSystemInfo(&system);
+	int pageSize = (int)system.dwPageSize;
+#else
+	int pageSize = (int)sysconf(_SC_PAGESIZE);
+#endif
+	if (pageSize <= 0)
+		pageSize = 0x1000;
+
+	for (int offset = 0; offset < saveRamSize; offset += pageSize)
+	{
+		int length = std::min(pageSize, saveRamSize - offset);
+		if (memcmp(saveRam + offset, flushedSaveRam + offset, length) == 0)
+			continue;
+
+		// Left as changed to be tried again with the next flush
+#ifdef _WIN32
+		if (!FlushViewOfFile(saveRam + offset, length))
+#else
+		if (msync(saveRam + offset, length, MS_ASYNC) != 0)
+#endif
+		{
+			printf("Save RAM at %X not flushed\n", offset);
+			continue;
+		}
+		memcpy(flushedSaveRam + offset, saveRam + offset, length);
+	}
+
+	if (!wait)
+		return;
+
+	// Pages handed over before may not have reached the disk yet
+	// The system skips the ones that are clean
+#ifdef _WIN32
+	if (!FlushViewOfFile(saveRam, saveRamSize) || !FlushFileBuffers(saveFile))
+#else
+	if (msync(saveRam, saveRamSize, MS_SYNC) != 0)
+#endif
+		printf("Save RAM not written to disk\n");
+}
+
+void MemoryMap::writeMBC3(Word address, Byte value)
+{
+	if (address < 0x2000)
+	{
+		ramEnabled = (value & 0x0F) == 0x0A;
+		remapPages(0xA0, 0xBF);
+	}
+	else if (address < 0x4000)
+	{
+		// Bank 0 selects bank 1 like it does on every MBC
+		romBank = value & 0x7F;
+		if (romBank == 0)
+			romBank = 1;
+		switchBanks();
+		remapPages(0x40, 0x7F);
+	}
+	else if (address < 0x6000)
+	{
+		ramBank = value & 0x0F;
+		switchBanks();
+		remapPages(0xA0, 0xBF);
+	}
+	else
+	{
+		if (hasClock && latchWrite == 0x00 && value == 0x01)
+		{
+			readClock(clockLatched);
+			storeClock();
+		}
+		latchWrite = value;
+	}
+}
+
+void MemoryMap::switchBanks()
+{
+	// Banks past the end of the ROM or RAM wrap around
+	romBank1 = romData + (romBank % (romSize / 0x4000)) * 0x4000;
+	if (ramBank < 0x08)
+		externalRam = cartRam + (ramBank % (cartRamSize / 0x2000)) * 0x2000;
+}
+
+long long MemoryMap::getClockSeconds()
+{
+	if (clockStopped)
+		return clockHalted;
+	return (long long)time(nullptr) - clockBase;
+}
+
+void MemoryMap::setClockSeconds(long long seconds)
+{
+	if (clockStopped)
+		clockHalted = seconds;
+	else
+		clockBase = (long long)time(nullptr) - seconds;
+}
+
+void MemoryMap::readClock(Byte* registers)
+{
+	long long seconds = getClockSeconds();
+
+	// A host clock set back stops at 0
+	// The day counter is 9 bits, the carry stays set once it overflows
+	const long long wrap = 512LL * 86400;
+	if (seconds < 0 || seconds >= wrap)
+	{
+		if (seconds >= wrap)
+			clockCarry = true;
+		seconds = (seconds < 0) ? 0 : seconds % wrap;
+		setClockSeconds(seconds);
+	}
+
+	long long days = seconds / 86400;
+	registers[0] = seconds % 60;
+	registers[1] = (seconds / 60) % 60;
+	registers[2] = (seconds / 3600) % 24;
+	registers[3] = days & 0xFF;
+	registers[4] = ((days >> 8) & 0x01) | (clockStopped ? 0x40 : 0x00) | (clockCarry ? 0x80 : 0x00);
+}
+
+void MemoryMap::writeClock(Byte reg, Byte value)
+{
+	// The register changes, the others keep counting from where they are
+	Byte registers[5];
+	readClock(registers);
+	switch (reg)
+	{
+	case 0x08:
+		registers[0] = value & 0x3F;
+		break;
+	case 0x09:
+		registers[1] = value & 0x3F;
+		break;
+	case 0x0A:
+		registers[2] = value & 0x1F;
+		break;
+	case 0x0B:
+		registers[3] = value;
+		break;
+	default:
+		registers[4] = value & 0xC1;
+		clockStopped = value & 0x40;
+		clockCarry = value & 0x80;
+		break;
+	}
+
+	long long days = ((registers[4] & 0x01) << 8) | registers[3];
+	setClockSeconds(registers[0] + registers[1] * 60 + registers[2] * 3600 + days * 86400);
+	storeClock();
+}
+
+void MemoryMap::storeClock()
+{
+	if (!saveRam)
+		return;
+
+	Byte registers[5];
+	readClock(registers);
+
+	Byte* footer = saveRam + cartRamSize;
+	memset(footer, 0x00, CLOCK_SAVE_SIZE);
+	for (int i = 0; i < 5; i++)
+	{
+		footer[i * 4] = registers[i];
+		footer[20 + i * 4] = clockLatched[i];
+	}
+
+	unsigned long long now = time(nullptr);
+	for (int i = 0; i < 8; i++)
+		footer[40 + i] = (now >> (i * 8)) & 0xFF;
+}
+
+void MemoryMap::loadClock()
+{
+	const Byte* footer = saveRam + cartRamSize;
+	unsigned long long saved = 0;
+	for (int i = 0; i < 8; i++)
+		saved |= (unsigned long long)footer[40 + i] << (i * 8);
+
+	// A new save file starts the clock at 0
+	// Any save is enough to carry the clock over, it keeps running
+	// from the host time stored with it
+	if (saved == 0)
+	{
+		clockBase = time(nullptr);
+		storeClock();
+		return;
+	}
+
+	Byte registers[5];
+	for (int i = 0; i < 5; i++)
+	{
+		registers[i] = footer[i * 4];
+		clockLatched[i] = footer[20 + i * 4];
+	}
+
+	// The clock kept running since it was saved unless it was halted
+	clockStopped = registers[4] & 0x40;
+	clockCarry = registers[4] & 0x80;
+	long long days = ((registers[4] & 0x01) << 8) | registers[3];
+	long long seconds = registers[0] + registers[1] * 60 + registers[2] * 3600 + days * 86400;
+	if (clockStopped)
+		clockHalted = seconds;
+	else
+		clockBase = (long long)saved - seconds;
+}
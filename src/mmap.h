@@ -1,6 +1,16 @@
 #pragma once
 #include "types.h"
 #include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+// A single write to the memory map
+// Recorded when a write trace is set
+struct MemoryWrite
+{
+	Word address;
+	Byte value;
+};
 
 // The Memory Map for GBE
 // Pulled from https://gbdev.io/pandocs/Memory_Map.html
@@ -13,6 +23,37 @@ private:
 	FILE* bootRomFile;
 	FILE* romFile;
 
+	// hashBytes() of the first 32 KB of the ROM file
+	// Identifies the ROM to recompiled modules
+	unsigned long long romHash;
+
+	// Host pointers to each 256 byte page that reads without side effects
+	// nullptr where reads must go through readMemory
+	Byte* readPages[0x100];
+
+	// Same for writes, ROM has no entries as writes to it are rejected
+	Byte* writePages[0x100];
+
+	// Cached page numbers to invalidate on remapping, see addPageCache()
+	std::vector<int*> pageCaches;
+
+	// Rebuilds readPages from page first up to page last
+	// and invalidates every cached page
+	// Must be called whenever what backs an address changes
+	void remapPages(int first = 0x00, int last = 0xFF);
+
+	// Every write is appended here when not nullptr
+	// Used to compare CPU engines
+	std::vector<MemoryWrite>* writeTrace;
+
+	// Every write to VRAM and OAM, including DMA, is appended here
+	// when not nullptr, so the PPU can draw the frame after the fact
+	// VRAM has no write pages then so that every write is seen
+	std::vector<MemoryWrite>* videoLog;
+
+	// Appends the writes a bulk access made in VRAM to videoLog
+	void logVideoWrites(Word start, int count, int step);
+
 	// First ROM Bank
 	// 16 KB 0x0000 - 0x3FFF
 	// Contains the first 16 KB of the ROM
@@ -20,9 +61,13 @@ private:
 
 	// Second ROM Bank
 	// 16 KB 0x4000 - 0x7FFF
-	// Contains the second 16 KB of the ROM which can be switched
+	// Points at the bank of romData the MBC has switched in
 	Byte* romBank1;
 
+	// The whole ROM, at least 32 KB
+	Byte* romData;
+	int romSize;
+
 	// Video RAM
 	// 8 KB 0x8000 - 0x9FFF
 	Byte* videoRam;
@@ -30,8 +75,89 @@ private:
 	// External RAM
 	// 8 KB 0xA000 - 0xBFFF
 	// Typically a ROM + SRAM or an MBC
+	// Points at the bank of cartRam the MBC has switched in
 	Byte* externalRam;
 
+	// Every bank of cartridge RAM, at least 8 KB
+	// On the heap, or in saveRam for cartridges with a battery
+	Byte* cartRam;
+	int cartRamSize;
+
+	// Battery backed cartridge RAM, see loadSaveRam()
+	// The save file is mapped into memory, so writes cost nothing more
+	// than to a heap array and reach the file even if the process dies
+	// cartRam is at its start, the MBC3 clock after it
+	Byte* saveRam;
+	int saveRamSize;
+
+	// saveRam as of the last flushSaveRam()
+	// Compared to find the pages that need writing back
+	Byte* flushedSaveRam;
+
+#ifdef _WIN32
+	void* saveFile;
+	void* saveMapping;
+#else
+	int saveFile;
+#endif
+
+	// MBC3
+	// Pulled from https://gbdev.io/pandocs/MBC3.html
+	bool mbc3;
+
+	// ROM bank at 0x4000 - 0x7FFF, 1 - 127
+	Byte romBank;
+
+	// RAM bank 0 - 3, or clock register 0x08 - 0x0C, at 0xA000 - 0xBFFF
+	Byte ramBank;
+
+	// RAM and clock are reachable, 0x0A written to 0x0000 - 0x1FFF
+	bool ramEnabled;
+
+	// Last value written to 0x6000 - 0x7FFF
+	// Writing 0x00 then 0x01 latches the clock
+	Byte latchWrite;
+
+	// Handles a write to the MBC registers at 0x0000 - 0x7FFF
+	void writeMBC3(Word address, Byte value);
+
+	// Points romBank1 and externalRam at the banks selected
+	void switchBanks();
+
+	// MBC3 real time clock
+	// Kept as the host time the clock read 0 at, so it costs nothing
+	// until it is latched, the registers are worked out then
+	// clockBase is in host seconds, clockHalted in clock seconds
+	bool hasClock;
+	long long clockBase;
+	long long clockHalted;
+	bool clockStopped;
+
+	// Set when the day counter overflows, cleared by writing DH
+	bool clockCarry;
+
+	// Seconds, minutes, hours, DL and DH as of the last latch
+	Byte clockLatched[5];
+
+	// Seconds the clock has counted
+	long long getClockSeconds();
+	void setClockSeconds(long long seconds);
+
+	// Registers the clock reads now, see clockLatched
+	void readClock(Byte* registers);
+
+	// Handles a write to clock register, 0x08 - 0x0C
+	void writeClock(Byte reg, Byte value);
+
+	// The clock is saved after the cartridge RAM in the common layout
+	// of 5 registers, 5 latched registers as 32 bit words and the
+	// 64 bit host time they were saved at, all little endian
+	static const int CLOCK_SAVE_SIZE = 48;
+
+	// Writes the clock to the save file and reads it back
+	void storeClock();
+	void loadClock();
+
 	// Work RAM Bank
 	// 8 KB 0xC000 - 0xDFFF
 	// CPU can write to these bank
@@ -69,12 +195,14 @@ private:
 
 	// The divider register
 	// stays in the I/O Ports at 0xFF04
+	// Computed from the clock when read, see getDivider()
 	Byte* reg_DIV;
 
 	// The timer counter
 	// stays in the I/O Ports at 0xFF05
 	// Increments at the frequency specified at 0xFF07
 	// Raises an interrupt when overflown and resets to value at 0xFF06
+	// Computed from the clock when read, see timerValue
 	Byte* reg_TIMA;
 
 	// The timer modulo
@@ -93,6 +221,83 @@ private:
 	// Signals which interrupt must take place
 	Byte* reg_IF;
 
+	// Cycles run since power on
+	// Advanced by the CPU after every instruction
+	unsigned long long clock;
+
+	// Timer
+	// Pulled from https://gbdev.io/pandocs/Timer_Obscure_Behaviour.html
+	// DIV is the upper byte of a counter incremented every cycle
+	// The counter is not stored, only the clock it was last reset at
+	unsigned long long dividerReset;
+
+	// TIMA increments on the falling edge of the counter bit selected by TAC
+	// It is stored as its value when the counter was at timerSync
+	// and brought up to date when read or when the timer is written
+	Byte timerValue;
+	unsigned long long timerSync;
+
+	// Clock of the next TIMA overflow, never while the timer is stopped
+	unsigned long long timerOverflow;
+
+	// log2 of the counter increments per TIMA increment for each TAC mode
+	// 1024, 16, 64 and 256 cycles
+	int timerShifts[4] = { 10, 4, 6, 8 };
+
+	// The counter DIV is the upper byte of
+	unsigned long long getDivider() { return clock - dividerReset; }
+
+	// Brings timerValue up to the current clock
+	void syncTimer();
+
+	// Computes timerOverflow from timerValue and TAC
+	void scheduleTimer();
+
+	// Increments TIMA once, reloading TMA on overflow
+	// Used for the extra increments of DIV and TAC writes
+	void incrementTimer();
+
+	// Reloads TMA and requests the timer interrupt
+	void overflowTimer();
+
+	// OAM DMA
+	// Pulled from https://gbdev.io/pandocs/OAM_DMA_Transfer.html
+	// The transfer takes 640 cycles, during which the CPU can only
+	// reach HRAM and the I/O ports, every page below has no page table
+	// entry and readMemory/writeMemory reject it
+	// OAM is copied in one go when the transfer ends, as nothing
+	// but the PPU can see it change meanwhile
+	bool dmaActive;
+	Word dmaSource;
+
+	// Clock the transfer ends at, never while none is active
+	unsigned long long dmaEnd;
+
+	// Set by the write to 0xFF46 until advanceClock() reaches the end
+	// of its instruction, which is the clock the write happened on
+	// as stores write on their last M-cycle
+	bool dmaStarting;
+
+	// VRAM and OAM held by the PPU, see setVideoBlocking()
+	// The CPU reads 0xFF there and its writes are dropped
+	// VRAM has no page table entries while held, so only
+	// readMemory and writeMemory check these
+	bool vramBlocked;
+	bool oamBlocked;
+
+	// Starts a transfer from page source, restarting one in progress
+	void startDMA(Byte source);
+
+	// Copies the source page to OAM and gives the bus back
+	void finishDMA();
+
+	// IE & IF & 0x1F
+	// Updated on every change to IE or IF so that the CPU
+	// can check for interrupts with a single load
+	Byte pendingInterrupts;
+
+	void updatePendingInterrupts() { pendingInterrupts = *interruptEnableRegister & *reg_IF & 0x1F; }
+
 	// The LCD Control Register
 	// Stays in the I/O Ports at 0xFF40
 	Byte* reg_LCDC;
@@ -188,8 +393,116 @@ public:
 	// Operator overload for the readMemory function
 	Byte operator[](Word address);
 
-	// increments the divider register
-	void updateDividerRegister() { (*reg_DIV)++; }
+	// 16 bit accesses, little endian
+	// Both bytes are accessed directly when they are in the same plain page
+	// or in high RAM, and through readMemory/writeMemory otherwise
+	// The low byte is written first
+	Word readWord(Word address)
+	{
+		Byte* page = readPages[address >> 8];
+		if (page && (address & 0xFF) != 0xFF)
+			return page[address & 0xFF] | (page[(address & 0xFF) + 1] << 8);
+		if (address >= 0xFF80 && address < 0xFFFE)
+			return highRam[address - 0xFF80] | (highRam[address - 0xFF7F] << 8);
+		return readMemory(address) | (readMemory(address + 1) << 8);
+	}
+
+	void writeWord(Word address, Word value)
+	{
+		Byte* page = writePages[address >> 8];
+		if (page && (address & 0xFF) != 0xFF && !writeTrace)
+		{
+			page[address & 0xFF] = value & 0xFF;
+			page[(address & 0xFF) + 1] = value >> 8;
+			return;
+		}
+		if (address >= 0xFF80 && address < 0xFFFE && !writeTrace)
+		{
+			highRam[address - 0xFF80] = value & 0xFF;
+			highRam[address - 0xFF7F] = value >> 8;
+			return;
+		}
+		writeMemory(address, value & 0xFF);
+		writeMemory(address + 1, value >> 8);
+	}
+
+	// Stack accesses, sp is updated like the CPU does it
+	// push16 writes the high byte first
+	void push16(Word& sp, Word value)
+	{
+		Word address = sp - 2;
+		Byte* page = writePages[address >> 8];
+		if (page && (address & 0xFF) != 0xFF && !writeTrace)
+		{
+			page[(address & 0xFF) + 1] = value >> 8;
+			page[address & 0xFF] = value & 0xFF;
+		}
+		else if (address >= 0xFF80 && address < 0xFFFE && !writeTrace)
+		{
+			highRam[address - 0xFF7F] = value >> 8;
+			highRam[address - 0xFF80] = value & 0xFF;
+		}
+		else
+		{
+			writeMemory(sp - 1, value >> 8);
+			writeMemory(sp - 2, value & 0xFF);
+		}
+		sp -= 2;
+	}
+
+	Word pop16(Word& sp)
+	{
+		Word value = readWord(sp);
+		sp += 2;
+		return value;
+	}
+
+	// Returns the page 0xXX00 - 0xXXFF if it can be read directly
+	// nullptr if it must be read through readMemory
+	Byte* getReadPage(Byte page) { return readPages[page]; }
+
+	// Registers a page number that is set to -1 when pages are remapped
+	// so that whoever cached a page from getReadPage refetches it
+	void addPageCache(int* page) { pageCaches.push_back(page); }
+
+	// Returns the backing store of an address that is plain memory,
+	// read and written without side effects, or nullptr otherwise
+	// remaining is set to the bytes left in that store from address
+	Byte* getPlainMemory(Word address, int& remaining);
+
+	// Bulk accesses for fused CPU loops
+	// Both behave like count single byte accesses done in order
+	// and return false without touching memory if a range is not plain
+	bool copyBlock(Word destination, Word source, int count);
+	bool fillBlock(Word destination, Byte value, int count, int step);
+
+	// Advances the clock by the cycles of an instruction
+	// Handles every TIMA overflow and an OAM DMA ending up to the new clock
+	void advanceClock(int cycles)
+	{
+		clock += cycles;
+
+		// The transfer begins one M-cycle after the write
+		if (dmaStarting)
+		{
+			dmaStarting = false;
+			dmaEnd = clock + 4 + 640;
+		}
+
+		while (clock >= timerOverflow)
+			overflowTimer();
+		if (clock >= dmaEnd)
+			finishDMA();
+	}
+
+	// gets the clock
+	unsigned long long getClock() { return clock; }
+
+	// gets the cycles until the next TIMA overflow or OAM DMA end
+	unsigned long long getCyclesToTimerEvent() { return std::min(timerOverflow, dmaEnd) - clock; }
+
+	// Returns true while an OAM DMA holds the bus
+	bool isDMAActive() { return dmaActive; }
 
 	// Map the boot and game to memory4
 	void mapRom();
@@ -197,6 +510,36 @@ public:
 	// Unload boot ROM after boot execution
 	void unloadBootRom();
 
+	// Writes everything but the cartridge to file and reads it back
+	// ROM, cartridge RAM and the MBC are left as they are on load
+	// Returns false if file could not be written or was too short
+	bool saveState(FILE* file);
+	bool loadState(FILE* file);
+
+	// Sets the I/O registers and VRAM the DMG boot ROM leaves
+	// so that a game can start without running it, after mapRom()
+	// LY and STAT are left to the PPU, which starts a new frame
+	void setPostBootState();
+
+	// Returns the size of cartridge RAM kept by a battery, 0 for none
+	// From the cartridge type and RAM size in the header
+	int getSaveRamSize();
+
+	// Returns the size of cartridge RAM from the header, 0 for none
+	int getCartRamSize();
+
+	// Returns the ROM bank mapped at 0x4000 - 0x7FFF
+	Byte getRomBank() { return romBank; }
+
+	// Backs cartridge RAM with the save file at path, after mapRom()
+	// The file is created, or grown, to the size of the cartridge RAM
+	// Returns true if the cartridge has no battery, there is nothing to back
+	bool loadSaveRam(const char* path);
+
+	// Writes the pages of cartridge RAM changed since the last flush
+	// back to the save file, waiting for the disk if wait is set
+	void flushSaveRam(bool wait);
+
 	// gets the reg_TAC
 	Byte getRegTAC() { return *reg_TAC; }
 
@@ -204,7 +547,11 @@ public:
 	Byte getRegTMA() { return *reg_TMA; }
 
 	// gets the reg_TIMA
-	Byte getRegTIMA() { return *reg_TIMA; }
+	Byte getRegTIMA()
+	{
+		syncTimer();
+		return timerValue;
+	}
 
 	// gets the reg_IF
 	Byte getRegIF() { return 0xE0 + (*reg_IF & 0x1F); }
@@ -245,11 +592,15 @@ public:
 	// gets the reg_WX
 	Byte getRegWX() { return *reg_WX; }
 
-	// sets the reg_TIMA
-	void setRegTIMA(Byte value) { *reg_TIMA = value; }
-
 	// sets the reg_IF to request an interrupt
-	void setRegIF(Byte value) { *reg_IF |= value; }
+	void setRegIF(Byte value)
+	{
+		*reg_IF |= value;
+		updatePendingInterrupts();
+	}
+
+	// gets the interrupts both requested and enabled
+	Byte getPendingInterrupts() { return pendingInterrupts; }
 
 	// sets the reg_LY
 	void setRegLY(Byte value) { *reg_LY = value; }
@@ -265,4 +616,29 @@ public:
 
 	// sets the ROM file
 	void setRomFile(FILE* file) { romFile = file; }
+
+	// sets the write trace, nullptr to disable it
+	void setWriteTrace(std::vector<MemoryWrite>* trace) { writeTrace = trace; }
+
+	// sets the VRAM and OAM write log, nullptr to disable it
+	void setVideoLog(std::vector<MemoryWrite>* log)
+	{
+		videoLog = log;
+		remapPages();
+	}
+
+	// Sets what the PPU holds, called when its mode changes
+	// Pulled from https://gbdev.io/pandocs/Accessing_VRAM_and_OAM.html
+	// OAM is held in modes 2 and 3, VRAM in mode 3
+	void setVideoBlocking(bool vram, bool oam)
+	{
+		oamBlocked = oam;
+		if (vram == vramBlocked)
+			return;
+		vramBlocked = vram;
+		remapPages(0x80, 0x9F);
+	}
+
+	// gets the hash of the ROM file
+	unsigned long long getRomHash() { return romHash; }
 };
\ No newline at end of file
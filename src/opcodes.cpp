@@ -0,0 +1,554 @@
+#include "opcodes.h"
+#include <stdio.h>
+#include <string.h>
+
+const OpcodeInfo opcodeTable[0x100] = {
+	{ "NOP", "NOP", 1, FLOW_NONE },
+	{ "LD BC, u16", "LD_BC_u16", 3, FLOW_NONE },
+	{ "LD (BC), A", "LD_BC_A", 1, FLOW_NONE },
+	{ "INC BC", "INC_BC", 1, FLOW_NONE },
+	{ "INC B", "INC_B", 1, FLOW_NONE },
+	{ "DEC B", "DEC_B", 1, FLOW_NONE },
+	{ "LD B, u8", "LD_B_u8", 2, FLOW_NONE },
+	{ "RLCA", "RLCA", 1, FLOW_NONE },
+	{ "LD (u16), SP", "LD_u16_SP", 3, FLOW_NONE },
+	{ "ADD HL, BC", "ADD_HL_BC", 1, FLOW_NONE },
+	{ "LD A, (BC)", "LD_A_BC", 1, FLOW_NONE },
+	{ "DEC BC", "DEC_BC", 1, FLOW_NONE },
+	{ "INC C", "INC_C", 1, FLOW_NONE },
+	{ "DEC C", "DEC_C", 1, FLOW_NONE },
+	{ "LD C, u8", "LD_C_u8", 2, FLOW_NONE },
+	{ "RRCA", "RRCA", 1, FLOW_NONE },
+	{ "STOP", "STOP", 2, FLOW_STOP },
+	{ "LD DE, u16", "LD_DE_u16", 3, FLOW_NONE },
+	{ "LD (DE), A", "LD_DE_A", 1, FLOW_NONE },
+	{ "INC DE", "INC_DE", 1, FLOW_NONE },
+	{ "INC D", "INC_D", 1, FLOW_NONE },
+	{ "DEC D", "DEC_D", 1, FLOW_NONE },
+	{ "LD D, u8", "LD_D_u8", 2, FLOW_NONE },
+	{ "RLA", "RLA", 1, FLOW_NONE },
+	{ "JR i8", "JR_i8", 2, FLOW_JUMP_RELATIVE },
+	{ "ADD HL, DE", "ADD_HL_DE", 1, FLOW_NONE },
+	{ "LD A, (DE)", "LD_A_DE", 1, FLOW_NONE },
+	{ "DEC DE", "DEC_DE", 1, FLOW_NONE },
+	{ "INC E", "INC_E", 1, FLOW_NONE },
+	{ "DEC E", "DEC_E", 1, FLOW_NONE },
+	{ "LD E, u8", "LD_E_u8", 2, FLOW_NONE },
+	{ "RRA", "RRA", 1, FLOW_NONE },
+	{ "JR NZ, i8", "JR_NZ_i8", 2, FLOW_JUMP_RELATIVE_CONDITIONAL },
+	{ "LD HL, u16", "LD_HL_u16", 3, FLOW_NONE },
+	{ "LD (HL+), A", "LD_HLp_A", 1, FLOW_NONE },
+	{ "INC HL", "INC_HL", 1, FLOW_NONE },
+	{ "INC H", "INC_H", 1, FLOW_NONE },
+	{ "DEC H", "DEC_H", 1, FLOW_NONE },
+	{ "LD H, u8", "LD_H_u8", 2, FLOW_NONE },
+	{ "DAA", "DAA", 1, FLOW_NONE },
+	{ "JR Z, i8", "JR_Z_r8", 2, FLOW_JUMP_RELATIVE_CONDITIONAL },
+	{ "ADD HL, HL", "ADD_HL_HL", 1, FLOW_NONE },
+	{ "LD A, (HL+)", "LD_A_HLp", 1, FLOW_NONE },
+	{ "DEC HL", "DEC_HL", 1, FLOW_NONE },
+	{ "INC L", "INC_L", 1, FLOW_NONE },
+	{ "DEC L", "DEC_L", 1, FLOW_NONE },
+	{ "LD L, u8", "LD_L_u8", 2, FLOW_NONE },
+	{ "CPL", "CPL", 1, FLOW_NONE },
+	{ "JR NC, i8", "JR_NC_i8", 2, FLOW_JUMP_RELATIVE_CONDITIONAL },
+	{ "LD SP, u16", "LD_SP_u16", 3, FLOW_NONE },
+	{ "LD (HL-), A", "LD_HLm_A", 1, FLOW_NONE },
+	{ "INC SP", "INC_SP", 1, FLOW_NONE },
+	{ "INC (HL)", "INC_HLp", 1, FLOW_NONE },
+	{ "DEC (HL)", "DEC_HLp", 1, FLOW_NONE },
+	{ "LD (HL), u8", "LD_HLp_u8", 2, FLOW_NONE },
+	{ "SCF", "SCF", 1, FLOW_NONE },
+	{ "JR C, i8", "JR_C_r8", 2, FLOW_JUMP_RELATIVE_CONDITIONAL },
+	{ "ADD HL, SP", "ADD_HL_SP", 1, FLOW_NONE },
+	{ "LD A, (HL-)", "LD_A_HLm", 1, FLOW_NONE },
+	{ "DEC SP", "DEC_SP", 1, FLOW_NONE },
+	{ "INC A", "INC_A", 1, FLOW_NONE },
+	{ "DEC A", "DEC_A", 1, FLOW_NONE },
+	{ "LD A, u8", "LD_A_u8", 2, FLOW_NONE },
+	{ "CCF", "CCF", 1, FLOW_NONE },
+	{ "LD B, B", "LD_B_B", 1, FLOW_NONE },
+	{ "LD B, C", "LD_B_C", 1, FLOW_NONE },
+	{ "LD B, D", "LD_B_D", 1, FLOW_NONE },
+	{ "LD B, E", "LD_B_E", 1, FLOW_NONE },
+	{ "LD B, H", "LD_B_H", 1, FLOW_NONE },
+	{ "LD B, L", "LD_B_L", 1, FLOW_NONE },
+	{ "LD B, (HL)", "LD_B_HLp", 1, FLOW_NONE },
+	{ "LD B, A", "LD_B_A", 1, FLOW_NONE },
+	{ "LD C, B", "LD_C_B", 1, FLOW_NONE },
+	{ "LD C, C", "LD_C_C", 1, FLOW_NONE },
+	{ "LD C, D", "LD_C_D", 1, FLOW_NONE },
+	{ "LD C, E", "LD_C_E", 1, FLOW_NONE },
+	{ "LD C, H", "LD_C_H", 1, FLOW_NONE },
+	{ "LD C, L", "LD_C_L", 1, FLOW_NONE },
+	{ "LD C, (HL)", "LD_C_HLp", 1, FLOW_NONE },
+	{ "LD C, A", "LD_C_A", 1, FLOW_NONE },
+	{ "LD D, B", "LD_D_B", 1, FLOW_NONE },
+	{ "LD D, C", "LD_D_C", 1, FLOW_NONE },
+	{ "LD D, D", "LD_D_D", 1, FLOW_NONE },
+	{ "LD D, E", "LD_D_E", 1, FLOW_NONE },
+	{ "LD D, H", "LD_D_H", 1, FLOW_NONE },
+	{ "LD D, L", "LD_D_L", 1, FLOW_NONE },
+	{ "LD D, (HL)", "LD_D_HLp", 1, FLOW_NONE },
+	{ "LD D, A", "LD_D_A", 1, FLOW_NONE },
+	{ "LD E, B", "LD_E_B", 1, FLOW_NONE },
+	{ "LD E, C", "LD_E_C", 1, FLOW_NONE },
+	{ "LD E, D", "LD_E_D", 1, FLOW_NONE },
+	{ "LD E, E", "LD_E_E", 1, FLOW_NONE },
+	{ "LD E, H", "LD_E_H", 1, FLOW_NONE },
+	{ "LD E, L", "LD_E_L", 1, FLOW_NONE },
+	{ "LD E, (HL)", "LD_E_HLp", 1, FLOW_NONE },
+	{ "LD E, A", "LD_E_A", 1, FLOW_NONE },
+	{ "LD H, B", "LD_H_B", 1, FLOW_NONE },
+	{ "LD H, C", "LD_H_C", 1, FLOW_NONE },
+	{ "LD H, D", "LD_H_D", 1, FLOW_NONE },
+	{ "LD H, E", "LD_H_E", 1, FLOW_NONE },
+	{ "LD H, H", "LD_H_H", 1, FLOW_NONE },
+	{ "LD H, L", "LD_H_L", 1, FLOW_NONE },
+	{ "LD H, (HL)", "LD_H_HLp", 1, FLOW_NONE },
+	{ "LD H, A", "LD_H_A", 1, FLOW_NONE },
+	{ "LD L, B", "LD_L_B", 1, FLOW_NONE },
+	{ "LD L, C", "LD_L_C", 1, FLOW_NONE },
+	{ "LD L, D", "LD_L_D", 1, FLOW_NONE },
+	{ "LD L, E", "LD_L_E", 1, FLOW_NONE },
+	{ "LD L, H", "LD_L_H", 1, FLOW_NONE },
+	{ "LD L, L", "LD_L_L", 1, FLOW_NONE },
+	{ "LD L, (HL)", "LD_L_HLp", 1, FLOW_NONE },
+	{ "LD L, A", "LD_L_A", 1, FLOW_NONE },
+	{ "LD (HL), B", "LD_HLp_B", 1, FLOW_NONE },
+	{ "LD (HL), C", "LD_HLp_C", 1, FLOW_NONE },
+	{ "LD (HL), D", "LD_HLp_D", 1, FLOW_NONE },
+	{ "LD (HL), E", "LD_HLp_E", 1, FLOW_NONE },
+	{ "LD (HL), H", "LD_HLp_H", 1, FLOW_NONE },
+	{ "LD (HL), L", "LD_HLp_L", 1, FLOW_NONE },
+	{ "HALT", "HALT", 1, FLOW_STOP },
+	{ "LD (HL), A", "LD_HLA", 1, FLOW_NONE },
+	{ "LD A, B", "LD_A_B", 1, FLOW_NONE },
+	{ "LD A, C", "LD_A_C", 1, FLOW_NONE },
+	{ "LD A, D", "LD_A_D", 1, FLOW_NONE },
+	{ "LD A, E", "LD_A_E", 1, FLOW_NONE },
+	{ "LD A, H", "LD_A_H", 1, FLOW_NONE },
+	{ "LD A, L", "LD_A_L", 1, FLOW_NONE },
+	{ "LD A, (HL)", "LD_A_HL", 1, FLOW_NONE },
+	{ "LD A, A", "LD_A_A", 1, FLOW_NONE },
+	{ "ADD A, B", "ADD_A_B", 1, FLOW_NONE },
+	{ "ADD A, C", "ADD_A_C", 1, FLOW_NONE },
+	{ "ADD A, D", "ADD_A_D", 1, FLOW_NONE },
+	{ "ADD A, E", "ADD_A_E", 1, FLOW_NONE },
+	{ "ADD A, H", "ADD_A_H", 1, FLOW_NONE },
+	{ "ADD A, L", "ADD_A_L", 1, FLOW_NONE },
+	{ "ADD A, (HL)", "ADD_A_HLp", 1, FLOW_NONE },
+	{ "ADD A, A", "ADD_A_A", 1, FLOW_NONE },
+	{ "ADC A, B", "ADC_A_B", 1, FLOW_NONE },
+	{ "ADC A, C", "ADC_A_C", 1, FLOW_NONE },
+	{ "ADC A, D", "ADC_A_D", 1, FLOW_NONE },
+	{ "ADC A, E", "ADC_A_E", 1, FLOW_NONE },
+	{ "ADC A, H", "ADC_A_H", 1, FLOW_NONE },
+	{ "ADC A, L", "ADC_A_L", 1, FLOW_NONE },
+	{ "ADC A, (HL)", "ADC_A_HLp", 1, FLOW_NONE },
+	{ "ADC A, A", "ADC_A_A", 1, FLOW_NONE },
+	{ "SUB A, B", "SUB_A_B", 1, FLOW_NONE },
+	{ "SUB A, C", "SUB_A_C", 1, FLOW_NONE },
+	{ "SUB A, D", "SUB_A_D", 1, FLOW_NONE },
+	{ "SUB A, E", "SUB_A_E", 1, FLOW_NONE },
+	{ "SUB A, H", "SUB_A_H", 1, FLOW_NONE },
+	{ "SUB A, L", "SUB_A_L", 1, FLOW_NONE },
+	{ "SUB A, (HL)", "SUB_A_HLp", 1, FLOW_NONE },
+	{ "SUB A, A", "SUB_A_A", 1, FLOW_NONE },
+	{ "SBC A, B", "SBC_A_B", 1, FLOW_NONE },
+	{ "SBC A, C", "SBC_A_C", 1, FLOW_NONE },
+	{ "SBC A, D", "SBC_A_D", 1, FLOW_NONE },
+	{ "SBC A, E", "SBC_A_E", 1, FLOW_NONE },
+	{ "SBC A, H", "SBC_A_H", 1, FLOW_NONE },
+	{ "SBC A, L", "SBC_A_L", 1, FLOW_NONE },
+	{ "SBC A, (HL)", "SBC_A_HLp", 1, FLOW_NONE },
+	{ "SBC A, A", "SBC_A_A", 1, FLOW_NONE },
+	{ "AND A, B", "AND_A_B", 1, FLOW_NONE },
+	{ "AND A, C", "AND_A_C", 1, FLOW_NONE },
+	{ "AND A, D", "AND_A_D", 1, FLOW_NONE },
+	{ "AND A, E", "AND_A_E", 1, FLOW_NONE },
+	{ "AND A, H", "AND_A_H", 1, FLOW_NONE },
+	{ "AND A, L", "AND_A_L", 1, FLOW_NONE },
+	{ "AND A, (HL)", "AND_A_HLp", 1, FLOW_NONE },
+	{ "AND A, A", "AND_A_A", 1, FLOW_NONE },
+	{ "XOR A, B", "XOR_A_B", 1, FLOW_NONE },
+	{ "XOR A, C", "XOR_A_C", 1, FLOW_NONE },
+	{ "XOR A, D", "XOR_A_D", 1, FLOW_NONE },
+	{ "XOR A, E", "XOR_A_E", 1, FLOW_NONE },
+	{ "XOR A, H", "XOR_A_H", 1, FLOW_NONE },
+	{ "XOR A, L", "XOR_A_L", 1, FLOW_NONE },
+	{ "XOR A, (HL)", "XOR_A_HLp", 1, FLOW_NONE },
+	{ "XOR A, A", "XOR_A_A", 1, FLOW_NONE },
+	{ "OR A, B", "OR_A_B", 1, FLOW_NONE },
+	{ "OR A, C", "OR_A_C", 1, FLOW_NONE },
+	{ "OR A, D", "OR_A_D", 1, FLOW_NONE },
+	{ "OR A, E", "OR_A_E", 1, FLOW_NONE },
+	{ "OR A, H", "OR_A_H", 1, FLOW_NONE },
+	{ "OR A, L", "OR_A_L", 1, FLOW_NONE },
+	{ "OR A, (HL)", "OR_A_HLp", 1, FLOW_NONE },
+	{ "OR A, A", "OR_A_A", 1, FLOW_NONE },
+	{ "CP A, B", "CP_A_B", 1, FLOW_NONE },
+	{ "CP A, C", "CP_A_C", 1, FLOW_NONE },
+	{ "CP A, D", "CP_A_D", 1, FLOW_NONE },
+	{ "CP A, E", "CP_A_E", 1, FLOW_NONE },
+	{ "CP A, H", "CP_A_H", 1, FLOW_NONE },
+	{ "CP A, L", "CP_A_L", 1, FLOW_NONE },
+	{ "CP A, (HL)", "CP_A_HLp", 1, FLOW_NONE },
+	{ "CP A, A", "CP_A_A", 1, FLOW_NONE },
+	{ "RET NZ", "RET_NZ", 1, FLOW_RETURN_CONDITIONAL },
+	{ "POP BC", "POP_BC", 1, FLOW_NONE },
+	{ "JP NZ, u16", "JP_NZ_u16", 3, FLOW_JUMP_CONDITIONAL },
+	{ "JP u16", "JP_u16", 3, FLOW_JUMP },
+	{ "CALL NZ, u16", "CALL_NZ_u16", 3, FLOW_CALL_CONDITIONAL },
+	{ "PUSH BC", "PUSH_BC", 1, FLOW_NONE },
+	{ "ADD A, u8", "ADD_A_u8", 2, FLOW_NONE },
+	{ "RST 00H", "RST_00H", 1, FLOW_RESTART },
+	{ "RET Z", "RET_Z", 1, FLOW_RETURN_CONDITIONAL },
+	{ "RET", "RET", 1, FLOW_RETURN },
+	{ "JP Z, u16", "JP_Z_u16", 3, FLOW_JUMP_CONDITIONAL },
+	{ "PREFIX CB", "PREFIX_CB", 2, FLOW_NONE },
+	{ "CALL Z, u16", "CALL_Z_u16", 3, FLOW_CALL_CONDITIONAL },
+	{ "CALL u16", "CALL_u16", 3, FLOW_CALL },
+	{ "ADC A, u8", "ADC_A_u8", 2, FLOW_NONE },
+	{ "RST 08H", "RST_08H", 1, FLOW_RESTART },
+	{ "RET NC", "RET_NC", 1, FLOW_RETURN_CONDITIONAL },
+	{ "POP DE", "POP_DE", 1, FLOW_NONE },
+	{ "JP NC, u16", "JP_NC_u16", 3, FLOW_JUMP_CONDITIONAL },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "CALL NC, u16", "NC_u16", 3, FLOW_CALL_CONDITIONAL },
+	{ "PUSH DE", "PUSH_DE", 1, FLOW_NONE },
+	{ "SUB A, u8", "SUB_u8", 2, FLOW_NONE },
+	{ "RST 10H", "RST_10H", 1, FLOW_RESTART },
+	{ "RET C", "RET_C", 1, FLOW_RETURN_CONDITIONAL },
+	{ "RETI", "RETI", 1, FLOW_RETURN },
+	{ "JP C, u16", "JP_C_u16", 3, FLOW_JUMP_CONDITIONAL },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "CALL C, u16", "CALL_C_u16", 3, FLOW_CALL_CONDITIONAL },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "SBC A, u8", "SBC_A_u8", 2, FLOW_NONE },
+	{ "RST 18H", "RST_18H", 1, FLOW_RESTART },
+	{ "LD (FF00+u8), A", "LDH_a8_A", 2, FLOW_NONE },
+	{ "POP HL", "POP_HL", 1, FLOW_NONE },
+	{ "LD (FF00+C), A", "LDH_C_A", 1, FLOW_NONE },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "PUSH HL", "PUSH_HL", 1, FLOW_NONE },
+	{ "AND A, u8", "AND_A_u8", 2, FLOW_NONE },
+	{ "RST 20H", "RST_20H", 1, FLOW_RESTART },
+	{ "ADD SP, i8", "ADD_SP_i8", 2, FLOW_NONE },
+	{ "JP HL", "JP_HL", 1, FLOW_JUMP_INDIRECT },
+	{ "LD (u16), A", "LD_u16_A", 3, FLOW_NONE },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "XOR A, u8", "XOR_A_u8", 2, FLOW_NONE },
+	{ "RST 28H", "RST_28H", 1, FLOW_RESTART },
+	{ "LD A, (FF00+u8)", "LDH_A_a8", 2, FLOW_NONE },
+	{ "POP AF", "POP_AF", 1, FLOW_NONE },
+	{ "LD A, (FF00+C)", "LDH_A_C", 1, FLOW_NONE },
+	{ "DI", "DI", 1, FLOW_NONE },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "PUSH AF", "PUSH_AF", 1, FLOW_NONE },
+	{ "OR A, u8", "OR_A_u8", 2, FLOW_NONE },
+	{ "RST 30H", "RST_30H", 1, FLOW_RESTART },
+	{ "LD HL, SP+i8", "LD_HL_SP_i8", 2, FLOW_NONE },
+	{ "LD SP, HL", "LD_SP_HL", 1, FLOW_NONE },
+	{ "LD A, (u16)", "LD_A_u16", 3, FLOW_NONE },
+	{ "EI", "EI", 1, FLOW_STOP },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "ILLEGAL", "UNKNOWN", 1, FLOW_ILLEGAL },
+	{ "CP A, u8", "CP_u8", 2, FLOW_NONE },
+	{ "RST 38H", "RST_38H", 1, FLOW_RESTART }
+};
+
+const OpcodeInfo prefixedOpcodeTable[0x100] = {
+	{ "RLC B", "RLC_B", 2, FLOW_NONE },
+	{ "RLC C", "RLC_C", 2, FLOW_NONE },
+	{ "RLC D", "RLC_D", 2, FLOW_NONE },
+	{ "RLC E", "RLC_E", 2, FLOW_NONE },
+	{ "RLC H", "RLC_H", 2, FLOW_NONE },
+	{ "RLC L", "RLC_L", 2, FLOW_NONE },
+	{ "RLC (HL)", "RLC_HLp", 2, FLOW_NONE },
+	{ "RLC A", "RLC_A", 2, FLOW_NONE },
+	{ "RRC B", "RRC_B", 2, FLOW_NONE },
+	{ "RRC C", "RRC_C", 2, FLOW_NONE },
+	{ "RRC D", "RRC_D", 2, FLOW_NONE },
+	{ "RRC E", "RRC_E", 2, FLOW_NONE },
+	{ "RRC H", "RRC_H", 2, FLOW_NONE },
+	{ "RRC L", "RRC_L", 2, FLOW_NONE },
+	{ "RRC (HL)", "RRC_HLp", 2, FLOW_NONE },
+	{ "RRC A", "RRC_A", 2, FLOW_NONE },
+	{ "RL B", "RL_B", 2, FLOW_NONE },
+	{ "RL C", "RL_C", 2, FLOW_NONE },
+	{ "RL D", "RL_D", 2, FLOW_NONE },
+	{ "RL E", "RL_E", 2, FLOW_NONE },
+	{ "RL H", "RL_H", 2, FLOW_NONE },
+	{ "RL L", "RL_L", 2, FLOW_NONE },
+	{ "RL (HL)", "RL_HLp", 2, FLOW_NONE },
+	{ "RL A", "RL_A", 2, FLOW_NONE },
+	{ "RR B", "RR_B", 2, FLOW_NONE },
+	{ "RR C", "RR_C", 2, FLOW_NONE },
+	{ "RR D", "RR_D", 2, FLOW_NONE },
+	{ "RR E", "RR_E", 2, FLOW_NONE },
+	{ "RR H", "RR_H", 2, FLOW_NONE },
+	{ "RR L", "RR_L", 2, FLOW_NONE },
+	{ "RR (HL)", "RR_HLp", 2, FLOW_NONE },
+	{ "RR A", "RR_A", 2, FLOW_NONE },
+	{ "SLA B", "SLA_B", 2, FLOW_NONE },
+	{ "SLA C", "SLA_C", 2, FLOW_NONE },
+	{ "SLA D", "SLA_D", 2, FLOW_NONE },
+	{ "SLA E", "SLA_E", 2, FLOW_NONE },
+	{ "SLA H", "SLA_H", 2, FLOW_NONE },
+	{ "SLA L", "SLA_L", 2, FLOW_NONE },
+	{ "SLA (HL)", "SLA_HLp", 2, FLOW_NONE },
+	{ "SLA A", "SLA_A", 2, FLOW_NONE },
+	{ "SRA B", "SRA_B", 2, FLOW_NONE },
+	{ "SRA C", "SRA_C", 2, FLOW_NONE },
+	{ "SRA D", "SRA_D", 2, FLOW_NONE },
+	{ "SRA E", "SRA_E", 2, FLOW_NONE },
+	{ "SRA H", "SRA_H", 2, FLOW_NONE },
+	{ "SRA L", "SRA_L", 2, FLOW_NONE },
+	{ "SRA (HL)", "SRA_HLp", 2, FLOW_NONE },
+	{ "SRA A", "SRA_A", 2, FLOW_NONE },
+	{ "SWAP B", "SWAP_B", 2, FLOW_NONE },
+	{ "SWAP C", "SWAP_C", 2, FLOW_NONE },
+	{ "SWAP D", "SWAP_D", 2, FLOW_NONE },
+	{ "SWAP E", "SWAP_E", 2, FLOW_NONE },
+	{ "SWAP H", "SWAP_H", 2, FLOW_NONE },
+	{ "SWAP L", "SWAP_L", 2, FLOW_NONE },
+	{ "SWAP (HL)", "SWAP_HLp", 2, FLOW_NONE },
+	{ "SWAP A", "SWAP_A", 2, FLOW_NONE },
+	{ "SRL B", "SRL_B", 2, FLOW_NONE },
+	{ "SRL C", "SRL_C", 2, FLOW_NONE },
+	{ "SRL D", "SRL_D", 2, FLOW_NONE },
+	{ "SRL E", "SRL_E", 2, FLOW_NONE },
+	{ "SRL H", "SRL_H", 2, FLOW_NONE },
+	{ "SRL L", "SRL_L", 2, FLOW_NONE },
+	{ "SRL (HL)", "SRL_HLp", 2, FLOW_NONE },
+	{ "SRL A", "SRL_A", 2, FLOW_NONE },
+	{ "BIT 0, B", "BIT_0_B", 2, FLOW_NONE },
+	{ "BIT 0, C", "BIT_0_C", 2, FLOW_NONE },
+	{ "BIT 0, D", "BIT_0_D", 2, FLOW_NONE },
+	{ "BIT 0, E", "BIT_0_E", 2, FLOW_NONE },
+	{ "BIT 0, H", "BIT_0_H", 2, FLOW_NONE },
+	{ "BIT 0, L", "BIT_0_L", 2, FLOW_NONE },
+	{ "BIT 0, (HL)", "BIT_0_HLp", 2, FLOW_NONE },
+	{ "BIT 0, A", "BIT_0_A", 2, FLOW_NONE },
+	{ "BIT 1, B", "BIT_1_B", 2, FLOW_NONE },
+	{ "BIT 1, C", "BIT_1_C", 2, FLOW_NONE },
+	{ "BIT 1, D", "BIT_1_D", 2, FLOW_NONE },
+	{ "BIT 1, E", "BIT_1_E", 2, FLOW_NONE },
+	{ "BIT 1, H", "BIT_1_H", 2, FLOW_NONE },
+	{ "BIT 1, L", "BIT_1_L", 2, FLOW_NONE },
+	{ "BIT 1, (HL)", "BIT_1_HLp", 2, FLOW_NONE },
+	{ "BIT 1, A", "BIT_1_A", 2, FLOW_NONE },
+	{ "BIT 2, B", "BIT_2_B", 2, FLOW_NONE },
+	{ "BIT 2, C", "BIT_2_C", 2, FLOW_NONE },
+	{ "BIT 2, D", "BIT_2_D", 2, FLOW_NONE },
+	{ "BIT 2, E", "BIT_2_E", 2, FLOW_NONE },
+	{ "BIT 2, H", "BIT_2_H", 2, FLOW_NONE },
+	{ "BIT 2, L", "BIT_2_L", 2, FLOW_NONE },
+	{ "BIT 2, (HL)", "BIT_2_HLp", 2, FLOW_NONE },
+	{ "BIT 2, A", "BIT_2_A", 2, FLOW_NONE },
+	{ "BIT 3, B", "BIT_3_B", 2, FLOW_NONE },
+	{ "BIT 3, C", "BIT_3_C", 2, FLOW_NONE },
+	{ "BIT 3, D", "BIT_3_D", 2, FLOW_NONE },
+	{ "BIT 3, E", "BIT_3_E", 2, FLOW_NONE },
+	{ "BIT 3, H", "BIT_3_H", 2, FLOW_NONE },
+	{ "BIT 3, L", "BIT_3_L", 2, FLOW_NONE },
+	{ "BIT 3, (HL)", "BIT_3_HLp", 2, FLOW_NONE },
+	{ "BIT 3, A", "BIT_3_A", 2, FLOW_NONE },
+	{ "BIT 4, B", "BIT_4_B", 2, FLOW_NONE },
+	{ "BIT 4, C", "BIT_4_C", 2, FLOW_NONE },
+	{ "BIT 4, D", "BIT_4_D", 2, FLOW_NONE },
+	{ "BIT 4, E", "BIT_4_E", 2, FLOW_NONE },
+	{ "BIT 4, H", "BIT_4_H", 2, FLOW_NONE },
+	{ "BIT 4, L", "BIT_4_L", 2, FLOW_NONE },
+	{ "BIT 4, (HL)", "BIT_4_HLp", 2, FLOW_NONE },
+	{ "BIT 4, A", "BIT_4_A", 2, FLOW_NONE },
+	{ "BIT 5, B", "BIT_5_B", 2, FLOW_NONE },
+	{ "BIT 5, C", "BIT_5_C", 2, FLOW_NONE },
+	{ "BIT 5, D", "BIT_5_D", 2, FLOW_NONE },
+	{ "BIT 5, E", "BIT_5_E", 2, FLOW_NONE },
+	{ "BIT 5, H", "BIT_5_H", 2, FLOW_NONE },
+	{ "BIT 5, L", "BIT_5_L", 2, FLOW_NONE },
+	{ "BIT 5, (HL)", "BIT_5_HLp", 2, FLOW_NONE },
+	{ "BIT 5, A", "BIT_5_A", 2, FLOW_NONE },
+	{ "BIT 6, B", "BIT_6_B", 2, FLOW_NONE },
+	{ "BIT 6, C", "BIT_6_C", 2, FLOW_NONE },
+	{ "BIT 6, D", "BIT_6_D", 2, FLOW_NONE },
+	{ "BIT 6, E", "BIT_6_E", 2, FLOW_NONE },
+	{ "BIT 6, H", "BIT_6_H", 2, FLOW_NONE },
+	{ "BIT 6, L", "BIT_6_L", 2, FLOW_NONE },
+	{ "BIT 6, (HL)", "BIT_6_HLp", 2, FLOW_NONE },
+	{ "BIT 6, A", "BIT_6_A", 2, FLOW_NONE },
+	{ "BIT 7, B", "BIT_7_B", 2, FLOW_NONE },
+	{ "BIT 7, C", "BIT_7_C", 2, FLOW_NONE },
+	{ "BIT 7, D", "BIT_7_D", 2, FLOW_NONE },
+	{ "BIT 7, E", "BIT_7_E", 2, FLOW_NONE },
+	{ "BIT 7, H", "BIT_7_H", 2, FLOW_NONE },
+	{ "BIT 7, L", "BIT_7_L", 2, FLOW_NONE },
+	{ "BIT 7, (HL)", "BIT_7_HLp", 2, FLOW_NONE },
+	{ "BIT 7, A", "BIT_7_A", 2, FLOW_NONE },
+	{ "RES 0, B", "RES_0_B", 2, FLOW_NONE },
+	{ "RES 0, C", "RES_0_C", 2, FLOW_NONE },
+	{ "RES 0, D", "RES_0_D", 2, FLOW_NONE },
+	{ "RES 0, E", "RES_0_E", 2, FLOW_NONE },
+	{ "RES 0, H", "RES_0_H", 2, FLOW_NONE },
+	{ "RES 0, L", "RES_0_L", 2, FLOW_NONE },
+	{ "RES 0, (HL)", "RES_0_HLp", 2, FLOW_NONE },
+	{ "RES 0, A", "RES_0_A", 2, FLOW_NONE },
+	{ "RES 1, B", "RES_1_B", 2, FLOW_NONE },
+	{ "RES 1, C", "RES_1_C", 2, FLOW_NONE },
+	{ "RES 1, D", "RES_1_D", 2, FLOW_NONE },
+	{ "RES 1, E", "RES_1_E", 2, FLOW_NONE },
+	{ "RES 1, H", "RES_1_H", 2, FLOW_NONE },
+	{ "RES 1, L", "RES_1_L", 2, FLOW_NONE },
+	{ "RES 1, (HL)", "RES_1_HLp", 2, FLOW_NONE },
+	{ "RES 1, A", "RES_1_A", 2, FLOW_NONE },
+	{ "RES 2, B", "RES_2_B", 2, FLOW_NONE },
+	{ "RES 2, C", "RES_2_C", 2, FLOW_NONE },
+	{ "RES 2, D", "RES_2_D", 2, FLOW_NONE },
+	{ "RES 2, E", "RES_2_E", 2, FLOW_NONE },
+	{ "RES 2, H", "RES_2_H", 2, FLOW_NONE },
+	{ "RES 2, L", "RES_2_L", 2, FLOW_NONE },
+	{ "RES 2, (HL)", "RES_2_HLp", 2, FLOW_NONE },
+	{ "RES 2, A", "RES_2_A", 2, FLOW_NONE },
+	{ "RES 3, B", "RES_3_B", 2, FLOW_NONE },
+	{ "RES 3, C", "RES_3_C", 2, FLOW_NONE },
+	{ "RES 3, D", "RES_3_D", 2, FLOW_NONE },
+	{ "RES 3, E", "RES_3_E", 2, FLOW_NONE },
+	{ "RES 3, H", "RES_3_H", 2, FLOW_NONE },
+	{ "RES 3, L", "RES_3_L", 2, FLOW_NONE },
+	{ "RES 3, (HL)", "RES_3_HLp", 2, FLOW_NONE },
+	{ "RES 3, A", "RES_3_A", 2, FLOW_NONE },
+	{ "RES 4, B", "RES_4_B", 2, FLOW_NONE },
+	{ "RES 4, C", "RES_4_C", 2, FLOW_NONE },
+	{ "RES 4, D", "RES_4_D", 2, FLOW_NONE },
+	{ "RES 4, E", "RES_4_E", 2, FLOW_NONE },
+	{ "RES 4, H", "RES_4_H", 2, FLOW_NONE },
+	{ "RES 4, L", "RES_4_L", 2, FLOW_NONE },
+	{ "RES 4, (HL)", "RES_4_HLp", 2, FLOW_NONE },
+	{ "RES 4, A", "RES_4_A", 2, FLOW_NONE },
+	{ "RES 5, B", "RES_5_B", 2, FLOW_NONE },
+	{ "RES 5, C", "RES_5_C", 2, FLOW_NONE },
+	{ "RES 5, D", "RES_5_D", 2, FLOW_NONE },
+	{ "RES 5, E", "RES_5_E", 2, FLOW_NONE },
+	{ "RES 5, H", "RES_5_H", 2, FLOW_NONE },
+	{ "RES 5, L", "RES_5_L", 2, FLOW_NONE },
+	{ "RES 5, (HL)", "RES_5_HLp", 2, FLOW_NONE },
+	{ "RES 5, A", "RES_5_A", 2, FLOW_NONE },
+	{ "RES 6, B", "RES_6_B", 2, FLOW_NONE },
+	{ "RES 6, C", "RES_6_C", 2, FLOW_NONE },
+	{ "RES 6, D", "RES_6_D", 2, FLOW_NONE },
+	{ "RES 6, E", "RES_6_E", 2, FLOW_NONE },
+	{ "RES 6, H", "RES_6_H", 2, FLOW_NONE },
+	{ "RES 6, L", "RES_6_L", 2, FLOW_NONE },
+	{ "RES 6, (HL)", "RES_6_HLp", 2, FLOW_NONE },
+	{ "RES 6, A", "RES_6_A", 2, FLOW_NONE },
+	{ "RES 7, B", "RES_7_B", 2, FLOW_NONE },
+	{ "RES 7, C", "RES_7_C", 2, FLOW_NONE },
+	{ "RES 7, D", "RES_7_D", 2, FLOW_NONE },
+	{ "RES 7, E", "RES_7_E", 2, FLOW_NONE },
+	{ "RES 7, H", "RES_7_H", 2, FLOW_NONE },
+	{ "RES 7, L", "RES_7_L", 2, FLOW_NONE },
+	{ "RES 7, (HL)", "RES_7_HLp", 2, FLOW_NONE },
+	{ "RES 7, A", "RES_7_A", 2, FLOW_NONE },
+	{ "SET 0, B", "SET_0_B", 2, FLOW_NONE },
+	{ "SET 0, C", "SET_0_C", 2, FLOW_NONE },
+	{ "SET 0, D", "SET_0_D", 2, FLOW_NONE },
+	{ "SET 0, E", "SET_0_E", 2, FLOW_NONE },
+	{ "SET 0, H", "SET_0_H", 2, FLOW_NONE },
+	{ "SET 0, L", "SET_0_L", 2, FLOW_NONE },
+	{ "SET 0, (HL)", "SET_0_HLp", 2, FLOW_NONE },
+	{ "SET 0, A", "SET_0_A", 2, FLOW_NONE },
+	{ "SET 1, B", "SET_1_B", 2, FLOW_NONE },
+	{ "SET 1, C", "SET_1_C", 2, FLOW_NONE },
+	{ "SET 1, D", "SET_1_D", 2, FLOW_NONE },
+	{ "SET 1, E", "SET_1_E", 2, FLOW_NONE },
+	{ "SET 1, H", "SET_1_H", 2, FLOW_NONE },
+	{ "SET 1, L", "SET_1_L", 2, FLOW_NONE },
+	{ "SET 1, (HL)", "SET_1_HLp", 2, FLOW_NONE },
+	{ "SET 1, A", "SET_1_A", 2, FLOW_NONE },
+	{ "SET 2, B", "SET_2_B", 2, FLOW_NONE },
+	{ "SET 2, C", "SET_2_C", 2, FLOW_NONE },
+	{ "SET 2, D", "SET_2_D", 2, FLOW_NONE },
+	{ "SET 2, E", "SET_2_E", 2, FLOW_NONE },
+	{ "SET 2, H", "SET_2_H", 2, FLOW_NONE },
+	{ "SET 2, L", "SET_2_L", 2, FLOW_NONE },
+	{ "SET 2, (HL)", "SET_2_HLp", 2, FLOW_NONE },
+	{ "SET 2, A", "SET_2_A", 2, FLOW_NONE },
+	{ "SET 3, B", "SET_3_B", 2, FLOW_NONE },
+	{ "SET 3, C", "SET_3_C", 2, FLOW_NONE },
+	{ "SET 3, D", "SET_3_D", 2, FLOW_NONE },
+	{ "SET 3, E", "SET_3_E", 2, FLOW_NONE },
+	{ "SET 3, H", "SET_3_H", 2, FLOW_NONE },
+	{ "SET 3, L", "SET_3_L", 2, FLOW_NONE },
+	{ "SET 3, (HL)", "SET_3_HLp", 2, FLOW_NONE },
+	{ "SET 3, A", "SET_3_A", 2, FLOW_NONE },
+	{ "SET 4, B", "SET_4_B", 2, FLOW_NONE },
+	{ "SET 4, C", "SET_4_C", 2, FLOW_NONE },
+	{ "SET 4, D", "SET_4_D", 2, FLOW_NONE },
+	{ "SET 4, E", "SET_4_E", 2, FLOW_NONE },
+	{ "SET 4, H", "SET_4_H", 2, FLOW_NONE },
+	{ "SET 4, L", "SET_4_L", 2, FLOW_NONE },
+	{ "SET 4, (HL)", "SET_4_HLp", 2, FLOW_NONE },
+	{ "SET 4, A", "SET_4_A", 2, FLOW_NONE },
+	{ "SET 5, B", "SET_5_B", 2, FLOW_NONE },
+	{ "SET 5, C", "SET_5_C", 2, FLOW_NONE },
+	{ "SET 5, D", "SET_5_D", 2, FLOW_NONE },
+	{ "SET 5, E", "SET_5_E", 2, FLOW_NONE },
+	{ "SET 5, H", "SET_5_H", 2, FLOW_NONE },
+	{ "SET 5, L", "SET_5_L", 2, FLOW_NONE },
+	{ "SET 5, (HL)", "SET_5_HLp", 2, FLOW_NONE },
+	{ "SET 5, A", "SET_5_A", 2, FLOW_NONE },
+	{ "SET 6, B", "SET_6_B", 2, FLOW_NONE },
+	{ "SET 6, C", "SET_6_C", 2, FLOW_NONE },
+	{ "SET 6, D", "SET_6_D", 2, FLOW_NONE },
+	{ "SET 6, E", "SET_6_E", 2, FLOW_NONE },
+	{ "SET 6, H", "SET_6_H", 2, FLOW_NONE },
+	{ "SET 6, L", "SET_6_L", 2, FLOW_NONE },
+	{ "SET 6, (HL)", "SET_6_HLp", 2, FLOW_NONE },
+	{ "SET 6, A", "SET_6_A", 2, FLOW_NONE },
+	{ "SET 7, B", "SET_7_B", 2, FLOW_NONE },
+	{ "SET 7, C", "SET_7_C", 2, FLOW_NONE },
+	{ "SET 7, D", "SET_7_D", 2, FLOW_NONE },
+	{ "SET 7, E", "SET_7_E", 2, FLOW_NONE },
+	{ "SET 7, H", "SET_7_H", 2, FLOW_NONE },
+	{ "SET 7, L", "SET_7_L", 2, FLOW_NONE },
+	{ "SET 7, (HL)", "SET_7_HLp", 2, FLOW_NONE },
+	{ "SET 7, A", "SET_7_A", 2, FLOW_NONE }
+};
+
+int formatInstruction(const Byte* bytes, Word address, char* buffer, size_t size)
+{
+	const OpcodeInfo& info = (bytes[0] == 0xCB) ? prefixedOpcodeTable[bytes[1]] : opcodeTable[bytes[0]];
+	const char* mnemonic = info.mnemonic;
+	const char* operand;
+	char value[16];
+
+	// Replace the operand placeholder with its value
+	if ((operand = strstr(mnemonic, "u16")))
+		snprintf(value, sizeof(value), "$%04X", bytes[1] | (bytes[2] << 8));
+	else if ((operand = strstr(mnemonic, "u8")))
+		snprintf(value, sizeof(value), "$%02X", bytes[1]);
+	else if ((operand = strstr(mnemonic, "i8")))
+	{
+		// JR targets are more useful than offsets
+		if (info.flow == FLOW_JUMP_RELATIVE || info.flow == FLOW_JUMP_RELATIVE_CONDITIONAL)
+			snprintf(value, sizeof(value), "$%04X", (Word)(address + 2 + (SByte)bytes[1]));
+		else
+			snprintf(value, sizeof(value), "%d", (SByte)bytes[1]);
+	}
+
+	if (operand)
+	{
+		int prefix = (int)(operand - mnemonic);
+		int suffix = (operand[1] == '1') ? 3 : 2;
+		snprintf(buffer, size, "%.*s%s%s", prefix, mnemonic, value, operand + suffix);
+	}
+	else
+		snprintf(buffer, size, "%s", mnemonic);
+
+	return info.length;
+}
\ No newline at end of file
@@ -0,0 +1,55 @@
+#pragma once
+#include "types.h"
+#include <stddef.h>
+
+// Static description of the SM83 instruction set
+// Pulled from https://izik1.github.io/gbops/index.html
+// Used by tools that need to decode code without executing it
+
+// How an instruction affects the flow of control
+// Naming convention is: FLOW_<behaviour>
+enum OpcodeFlow
+{
+	FLOW_NONE,
+	FLOW_JUMP,
+	FLOW_JUMP_CONDITIONAL,
+	FLOW_JUMP_RELATIVE,
+	FLOW_JUMP_RELATIVE_CONDITIONAL,
+	FLOW_JUMP_INDIRECT,
+	FLOW_CALL,
+	FLOW_CALL_CONDITIONAL,
+	FLOW_RETURN,
+	FLOW_RETURN_CONDITIONAL,
+	FLOW_RESTART,
+	FLOW_STOP,
+	FLOW_ILLEGAL
+};
+
+struct OpcodeInfo
+{
+	// Mnemonic with operand placeholders u8, i8 and u16
+	const char* mnemonic;
+
+	// Name of the CPU method executing the opcode
+	const char* handler;
+
+	// Length in bytes including the opcode
+	Byte length;
+
+	// Effect on the flow of control
+	OpcodeFlow flow;
+};
+
+// Opcodes 0x00 - 0xFF
+extern const OpcodeInfo opcodeTable[0x100];
+
+// CB prefixed opcodes 0xCB00 - 0xCBFF
+// Length includes the 0xCB prefix
+extern const OpcodeInfo prefixedOpcodeTable[0x100];
+
+
+// Writes the disassembly of the instruction in bytes to buffer
+// bytes must hold the whole instruction, at most 3 bytes
+// address is used to resolve relative jumps
+// Returns the length of the instruction
+int formatInstruction(const Byte* bytes, Word address, char* buffer, size_t size);
\ No newline at end of file
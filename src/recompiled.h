@@ -0,0 +1,68 @@
+#pragma once
+#include "types.h"
+
+// Interface between the emulator and ROMs recompiled by gbrecomp
+// A recompiled module is a shared library exporting RECOMPILED_MODULE_SYMBOL
+// which returns a RecompiledModule describing every block it contains
+
+class CPU;
+
+// Executes a recompiled block starting at the current PC
+// Returns the cycles taken, exactly like a CPU opcode method
+typedef int (*RecompiledFunction)(CPU*);
+
+struct RecompiledBlock
+{
+	// Address of the first instruction of the block
+	Word address;
+
+	// Native code of the block
+	RecompiledFunction execute;
+};
+
+struct RecompiledModule
+{
+	// Must match RECOMPILED_MODULE_VERSION
+	unsigned int version;
+
+	// RECOMPILED_MODULE_ABI of the gbrecomp that generated the module
+	// The CPU and MemoryMap are compiled into the module, so it
+	// only works with an emulator built from the same sources
+	const char* abi;
+
+	// hashBytes() of the first 32 KB of the ROM the module was built from
+	unsigned long long romHash;
+
+	unsigned int blockCount;
+	const RecompiledBlock* blocks;
+};
+
+#define RECOMPILED_MODULE_VERSION 4
+#define RECOMPILED_MODULE_SYMBOL "gbeRecompiledModule"
+
+// Compiler and hash of the sources compiled into modules, set by CMake
+// Builds without it never load a module
+#ifndef RECOMPILED_MODULE_ABI
+#define RECOMPILED_MODULE_ABI ""
+#endif
+
+#ifdef _WIN32
+#define RECOMPILED_MODULE_EXTENSION ".dll"
+#define RECOMPILED_EXPORT extern "C" __declspec(dllexport)
+#else
+#define RECOMPILED_MODULE_EXTENSION ".so"
+#define RECOMPILED_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+// Returns true if address is an I/O port or IE
+// These change or raise interrupts as the timer and PPU run, which
+// only happens between blocks, so blocks never access them past their
+// first instruction, see Recompiler::getIOAccess()
+inline bool isIOAddress(Word address)
+{
+	return (address >= 0xFF00 && address < 0xFF80) || address == 0xFFFF;
+}
+
+// Size of the ROM area covered by recompiled modules
+// Only ROM bank 0 and 1 are analysed
+#define RECOMPILED_ROM_SIZE 0x8000
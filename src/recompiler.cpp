@@ -0,0 +1,326 @@
+#include "recompiler.h"
+#include "recompiled.h"
+#include "opcodes.h"
+#include "hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+bool Recompiler::loadRom(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		printf("ROM file %s not opened\n", path);
+		return false;
+	}
+
+	Byte buffer[0x4000];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		rom.insert(rom.end(), buffer, buffer + read);
+	fclose(file);
+
+	romPath = path;
+	return !rom.empty();
+}
+
+bool Recompiler::isDecodable(Word address)
+{
+	if (address >= RECOMPILED_ROM_SIZE || address >= rom.size())
+		return false;
+
+	Byte length = opcodeTable[rom[address]].length;
+	return (address + length) <= RECOMPILED_ROM_SIZE && (address + length) <= rom.size();
+}
+
+void Recompiler::addLeader(Word address)
+{
+	if (!isDecodable(address))
+		return;
+
+	// Already known, nothing to do
+	if (!leaders.insert(address).second)
+		return;
+
+	worklist.push_back(address);
+}
+
+void Recompiler::analyse()
+{
+	// The cartridge entry point
+	// Pulled from https://gbdev.io/pandocs/The_Cartridge_Header.html
+	addLeader(0x0100);
+
+	// Interrupt vectors, see CPU::interrupts
+	for (Word vector = 0x0040; vector <= 0x0060; vector += 0x08)
+		addLeader(vector);
+
+	while (!worklist.empty())
+	{
+		Word address = worklist.back();
+		worklist.pop_back();
+		decodeBlock(address);
+	}
+}
+
+Recompiler::IOAccess Recompiler::getIOAccess(Word address, std::string& guard)
+{
+	Byte opcode = rom[address];
+	const OpcodeInfo& info = (opcode == 0xCB) ? prefixedOpcodeTable[rom[address + 1]] : opcodeTable[opcode];
+	std::string mnemonic = info.mnemonic;
+
+	// Immediate addresses are known now
+	if (mnemonic.find("(FF00+u8)") != std::string::npos)
+		return isIOAddress(0xFF00 + rom[address + 1]) ? IO_ALWAYS : IO_NONE;
+	if (mnemonic.find("(u16)") != std::string::npos)
+	{
+		// LD (u16), SP writes 2 bytes
+		Word immediate = rom[address + 1] | (rom[address + 2] << 8);
+		return (isIOAddress(immediate) || (opcode == 0x08 && isIOAddress(immediate + 1))) ? IO_ALWAYS : IO_NONE;
+	}
+
+	// Addresses in registers are checked when the block runs
+	if (mnemonic.find("(FF00+C)") != std::string::npos)
+		guard = "isIOAddress(0xFF00 + cpu->reg_BC.lo)";
+	else if (mnemonic.find("(HL") != std::string::npos)
+		guard = "isIOAddress(cpu->reg_HL.dat)";
+	else if (mnemonic.find("(BC)") != std::string::npos)
+		guard = "isIOAddress(cpu->reg_BC.dat)";
+	else if (mnemonic.find("(DE)") != std::string::npos)
+		guard = "isIOAddress(cpu->reg_DE.dat)";
+	else if (mnemonic.rfind("PUSH", 0) == 0 || info.flow == FLOW_CALL || info.flow == FLOW_CALL_CONDITIONAL || info.flow == FLOW_RESTART)
+		guard = "isIOAddress(cpu->reg_SP.dat - 1) || isIOAddress(cpu->reg_SP.dat - 2)";
+	else if (mnemonic.rfind("POP", 0) == 0 || info.flow == FLOW_RETURN || info.flow == FLOW_RETURN_CONDITIONAL)
+		guard = "isIOAddress(cpu->reg_SP.dat) || isIOAddress(cpu->reg_SP.dat + 1)";
+	else
+		return IO_NONE;
+
+	return IO_DYNAMIC;
+}
+
+bool Recompiler::isStore(Word address)
+{
+	Byte opcode = rom[address];
+	const OpcodeInfo& info = (opcode == 0xCB) ? prefixedOpcodeTable[rom[address + 1]] : opcodeTable[opcode];
+	std::string mnemonic = info.mnemonic;
+
+	// Pushes onto the stack
+	if (mnemonic.rfind("PUSH", 0) == 0 || info.flow == FLOW_CALL || info.flow == FLOW_CALL_CONDITIONAL || info.flow == FLOW_RESTART)
+		return true;
+
+	// RES and SET write their result back to (HL)
+	if (mnemonic.rfind("RES", 0) == 0 || mnemonic.rfind("SET", 0) == 0)
+		return true;
+
+	// Otherwise memory is written when it is the first operand
+	size_t operands = mnemonic.find(' ');
+	return operands != std::string::npos && mnemonic[operands + 1] == '(';
+}
+
+void Recompiler::decodeBlock(Word address)
+{
+	std::vector<Word>& block = blocks[address];
+	Word pc = address;
+
+	while ((int)block.size() < maxBlockLength)
+	{
+		if (!isDecodable(pc))
+			return;
+
+		// Bank 1 is only checked at the start of a block
+		if (pc == 0x4000 && address < 0x4000)
+		{
+			addLeader(pc);
+			return;
+		}
+
+		const OpcodeInfo& info = opcodeTable[rom[pc]];
+
+		// Leave illegal opcodes to the interpreter
+		if (info.flow == FLOW_ILLEGAL)
+			return;
+
+		// Known I/O accesses start a block of their own
+		// so that the timer and PPU are up to date for them
+		std::string guard;
+		IOAccess io = getIOAccess(pc, guard);
+		if (io == IO_ALWAYS && pc != address)
+		{
+			addLeader(pc);
+			return;
+		}
+
+		block.push_back(pc);
+
+		Word next = pc + info.length;
+		Word immediate = (info.length == 3) ? (rom[pc + 1] | (rom[pc + 2] << 8)) : 0;
+		Word relative = next + (SByte)rom[pc + 1];
+
+		switch (info.flow)
+		{
+		case FLOW_NONE:
+			// and end it, a write may raise an interrupt
+			if (io == IO_ALWAYS)
+			{
+				addLeader(next);
+				return;
+			}
+			pc = next;
+			continue;
+		case FLOW_JUMP:
+			addLeader(immediate);
+			return;
+		case FLOW_JUMP_CONDITIONAL:
+			addLeader(immediate);
+			addLeader(next);
+			return;
+		case FLOW_JUMP_RELATIVE:
+			addLeader(relative);
+			return;
+		case FLOW_JUMP_RELATIVE_CONDITIONAL:
+			addLeader(relative);
+			addLeader(next);
+			return;
+		case FLOW_CALL:
+		case FLOW_CALL_CONDITIONAL:
+			functions.insert(immediate);
+			addLeader(immediate);
+			addLeader(next);
+			return;
+		case FLOW_RESTART:
+			functions.insert(rom[pc] & 0x38);
+			addLeader(rom[pc] & 0x38);
+			addLeader(next);
+			return;
+		case FLOW_RETURN_CONDITIONAL:
+		case FLOW_STOP:
+			addLeader(next);
+			return;
+		default:
+			// Returns and JP HL have no static successor
+			return;
+		}
+	}
+
+	// Block is too long, continue in a new one
+	addLeader(pc);
+}
+
+bool Recompiler::emit(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (file == NULL)
+	{
+		printf("Output file %s not opened\n", path);
+		return false;
+	}
+
+	size_t hashedSize = rom.size() < RECOMPILED_ROM_SIZE ? rom.size() : RECOMPILED_ROM_SIZE;
+
+	fprintf(file, "// Generated by gbrecomp from %s\n", romPath.c_str());
+	fprintf(file, "// Do not edit, regenerate instead\n\n");
+
+	// The CPU and MemoryMap sources are compiled into the module
+	// so that the opcode methods can be inlined into the blocks
+	fprintf(file, "#include \"cpu.cpp\"\n");
+	fprintf(file, "#include \"mmap.cpp\"\n");
+	fprintf(file, "#include \"recompiled.h\"\n\n");
+
+	fprintf(file, "struct RecompiledBlocks\n{\n");
+	for (auto& [address, instructions] : blocks)
+	{
+		if (functions.count(address))
+			fprintf(file, "\t// Function 0x%04X\n", address);
+		fprintf(file, "\tstatic int block_%04X(CPU* cpu)\n\t{\n", address);
+		fprintf(file, "\t\tint cycles = 0;\n");
+		fprintf(file, "\t\tint budget = cpu->mMap->getPendingInterrupts() ? 0 : cpu->cyclesToNextEvent();\n");
+		for (Word pc : instructions)
+		{
+			// Past the first instruction, go back to the dispatcher when
+			// an event is due or the instruction reaches the I/O ports
+			// A pending interrupt may be serviced after any instruction
+			// The rest of the block is interpreted
+			if (pc != address)
+			{
+				std::string guard;
+				if (getIOAccess(pc, guard) == IO_DYNAMIC)
+					fprintf(file, "\t\tif (cycles >= budget || %s)\n\t\t\treturn cycles;\n", guard.c_str());
+				else
+					fprintf(file, "\t\tif (cycles >= budget)\n\t\t\treturn cycles;\n");
+			}
+
+			Byte opcode = rom[pc];
+			if (opcode == 0xCB)
+			{
+				// Inline PREFIX_CB to skip the second dispatch
+				const OpcodeInfo& info = prefixedOpcodeTable[rom[pc + 1]];
+				fprintf(file, "\t\t// 0x%04X: %s\n", pc, info.mnemonic);
+				fprintf(file, "\t\tcpu->reg_PC.dat += 1;\n");
+				fprintf(file, "\t\tcycles += 4 + cpu->%s();\n", info.handler);
+			}
+			else
+			{
+				const OpcodeInfo& info = opcodeTable[opcode];
+				fprintf(file, "\t\t// 0x%04X: %s\n", pc, info.mnemonic);
+				fprintf(file, "\t\tcycles += cpu->%s();\n", info.handler);
+			}
+
+			// A store through a register may have started an OAM DMA
+			// which the interpreter has to run, see CPU::executeNextInstruction()
+			// Past the first instruction the guard above already left for any
+			// other I/O, the first may also have moved the next event
+			std::string guard;
+			if (getIOAccess(pc, guard) == IO_DYNAMIC && isStore(pc))
+			{
+				fprintf(file, "\t\tif (cpu->mMap->isDMAActive())\n\t\t\treturn cycles;\n");
+				if (pc == address)
+					fprintf(file, "\t\tbudget = cpu->mMap->getPendingInterrupts() ? 0 : cpu->cyclesToNextEvent();\n");
+			}
+		}
+		fprintf(file, "\t\treturn cycles;\n\t}\n\n");
+	}
+	fprintf(file, "};\n\n");
+
+	fprintf(file, "static const RecompiledBlock blocks[] = {\n");
+	for (auto& [address, instructions] : blocks)
+		fprintf(file, "\t{ 0x%04X, &RecompiledBlocks::block_%04X },\n", address, address);
+	fprintf(file, "};\n\n");
+
+	fprintf(file, "static const RecompiledModule module = {\n");
+	fprintf(file, "\tRECOMPILED_MODULE_VERSION,\n");
+	fprintf(file, "\t\"%s\",\n", RECOMPILED_MODULE_ABI);
+	fprintf(file, "\t0x%016llXULL,\n", hashBytes(rom.data(), hashedSize));
+	fprintf(file, "\t%zu,\n", blocks.size());
+	fprintf(file, "\tblocks\n};\n\n");
+
+	fprintf(file, "RECOMPILED_EXPORT const RecompiledModule* %s()\n{\n\treturn &module;\n}\n", RECOMPILED_MODULE_SYMBOL);
+
+	fclose(file);
+	return true;
+}
+
+bool Recompiler::build(const char* source, const char* library)
+{
+	// Build with the compiler and headers gbemu itself was configured with
+	std::string command = GBRECOMP_CXX;
+	command += " -std=c++20 -O2 -shared -fPIC -fvisibility=hidden";
+	command += " -I\"" GBRECOMP_SOURCE_DIR "\"";
+
+	// GBRECOMP_INCLUDE_DIRS is a CMake list separated by ';'
+	std::string includes = GBRECOMP_INCLUDE_DIRS;
+	size_t start = 0;
+	while (start < includes.size())
+	{
+		size_t end = includes.find(';', start);
+		if (end == std::string::npos)
+			end = includes.size();
+		if (end > start)
+			command += " -I\"" + includes.substr(start, end - start) + "\"";
+		start = end + 1;
+	}
+
+	command += " \"" + std::string(source) + "\" -o \"" + library + "\"";
+
+	printf("%s\n", command.c_str());
+	return system(command.c_str()) == 0;
+}
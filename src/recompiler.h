@@ -0,0 +1,83 @@
+#pragma once
+#include "types.h"
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Offline static recompiler
+// Walks the reachable control flow of a ROM from its entry point
+// and interrupt vectors, and emits every discovered basic block as C++
+// calling the same CPU methods the interpreter dispatches to
+// The result is built into a shared library loaded by CPU::loadRecompiledModule()
+//
+// Only ROM bank 0 and 1 (0x0000 - 0x7FFF) are analysed
+// Code in RAM and blocks that were not discovered are left to the interpreter
+
+class Recompiler
+{
+private:
+	// Contents of the ROM file
+	std::vector<Byte> rom;
+
+	// Path of the ROM file, used in the generated comments
+	std::string romPath;
+
+	// Addresses at which a basic block starts
+	std::set<Word> leaders;
+
+	// Addresses that still have to be decoded
+	std::vector<Word> worklist;
+
+	// Addresses reached by a CALL or RST
+	// Only used to annotate the generated code
+	std::set<Word> functions;
+
+	// Instructions of each basic block keyed by the leader address
+	std::map<Word, std::vector<Word>> blocks;
+
+	// Upper bound on instructions per block
+	// Blocks return to the dispatcher early when the timer or PPU
+	// has an event due, see CPU::cyclesToNextEvent()
+	const int maxBlockLength = 32;
+
+	// How an instruction may reach the I/O ports or IE
+	enum IOAccess
+	{
+		IO_NONE,
+		IO_ALWAYS,
+		IO_DYNAMIC
+	};
+
+	// Returns how the instruction at address reaches an address isIOAddress() is true for
+	// For IO_DYNAMIC guard is set to C++ that is true when it does
+	IOAccess getIOAccess(Word address, std::string& guard);
+
+	// Returns true if the instruction at address writes to memory
+	bool isStore(Word address);
+
+	// Queue an address to be decoded as a block leader
+	void addLeader(Word address);
+
+	// Decode the block starting at address
+	void decodeBlock(Word address);
+
+	// Returns true if the whole instruction at address lies in the ROM
+	bool isDecodable(Word address);
+
+public:
+	// Read the ROM file
+	bool loadRom(const char* path);
+
+	// Discover all reachable blocks
+	void analyse();
+
+	// Write the C++ source of the module
+	bool emit(const char* path);
+
+	// Compile the emitted source into a shared library
+	bool build(const char* source, const char* library);
+
+	// Number of discovered blocks
+	size_t getBlockCount() const { return blocks.size(); }
+};
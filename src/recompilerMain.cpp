@@ -0,0 +1,53 @@
+#include "recompiler.h"
+#include "recompiled.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+// gbrecomp
+// Usage: gbrecomp [--emit-only] <rom> [output]
+// Writes <output>.cpp and builds <output> (default <rom>.so)
+// which the emulator loads automatically when it sits next to the ROM
+
+int main(int argc, char** argv)
+{
+	bool emitOnly = false;
+	int arg = 1;
+
+	if (arg < argc && strcmp(argv[arg], "--emit-only") == 0)
+	{
+		emitOnly = true;
+		arg++;
+	}
+
+	if (arg >= argc)
+	{
+		printf("Usage: %s [--emit-only] <rom> [output]\n", argv[0]);
+		return 1;
+	}
+
+	const char* romPath = argv[arg++];
+	std::string library = (arg < argc) ? argv[arg] : std::string(romPath) + RECOMPILED_MODULE_EXTENSION;
+	std::string source = library + ".cpp";
+
+	Recompiler recompiler;
+	if (!recompiler.loadRom(romPath))
+		return 1;
+
+	recompiler.analyse();
+	printf("Discovered %zu blocks\n", recompiler.getBlockCount());
+
+	if (!recompiler.emit(source.c_str()))
+		return 1;
+
+	if (emitOnly)
+		return 0;
+
+	if (!recompiler.build(source.c_str(), library.c_str()))
+	{
+		printf("Building %s failed\n", library.c_str());
+		return 1;
+	}
+
+	return 0;
+}
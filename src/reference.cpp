@@ -0,0 +1,699 @@
+#include "reference.h"
+
+// Flags in the F register
+#define REF_Z 0x80
+#define REF_N 0x40
+#define REF_H 0x20
+#define REF_C 0x10
+
+// Register indices
+#define REF_HL_INDIRECT 6
+#define REF_A 7
+
+ReferenceCPU::ReferenceCPU()
+{
+	// x = 0, z = 7, y >= 4
+	static const Byte accumulatorOperations[4] = { OP_DAA, OP_CPL, OP_SCF, OP_CCF };
+
+	// x = 3, z = 0, y >= 4
+	static const Byte highLoadOperations[4] = { OP_LDH_U8_A, OP_ADD_SP_I8, OP_LDH_A_U8, OP_LD_HL_SP_I8 };
+	static const Byte highLoadCycles[4] = { 12, 16, 12, 12 };
+
+	// x = 3, z = 1, q = 1
+	static const Byte returnOperations[4] = { OP_RET, OP_RETI, OP_JP_HL, OP_LD_SP_HL };
+	static const Byte returnCycles[4] = { 16, 16, 4, 8 };
+
+	// x = 3, z = 2, y >= 4
+	static const Byte indirectLoadOperations[4] = { OP_LDH_C_A, OP_LD_U16_A, OP_LDH_A_C, OP_LD_A_U16 };
+	static const Byte indirectLoadCycles[4] = { 8, 16, 8, 16 };
+
+	for (int opcode = 0; opcode < 0x100; opcode++)
+	{
+		Decoded& d = table[opcode];
+		int x = opcode >> 6;
+		d.y = (opcode >> 3) & 7;
+		d.z = opcode & 7;
+		d.p = d.y >> 1;
+		d.q = d.y & 1;
+		d.cycles = 4;
+		d.cyclesTaken = 4;
+
+		// (HL) operands take an extra memory access
+		bool indirectY = (d.y == REF_HL_INDIRECT);
+		bool indirectZ = (d.z == REF_HL_INDIRECT);
+
+		if (x == 0)
+		{
+			switch (d.z)
+			{
+			case 0:
+				if (d.y == 0)
+					d.operation = OP_NOP;
+				else if (d.y == 1)
+				{
+					d.operation = OP_LD_U16_SP;
+					d.cycles = 20;
+				}
+				else if (d.y == 2)
+					d.operation = OP_STOP;
+				else
+				{
+					d.operation = OP_JR;
+					d.cycles = (d.y == 3) ? 12 : 8;
+					d.cyclesTaken = 12;
+				}
+				break;
+			case 1:
+				d.operation = d.q ? OP_ADD_HL_RR : OP_LD_RR_U16;
+				d.cycles = d.q ? 8 : 12;
+				break;
+			case 2:
+				d.operation = d.q ? OP_LD_A_IND : OP_LD_IND_A;
+				d.cycles = 8;
+				break;
+			case 3:
+				d.operation = d.q ? OP_DEC_RR : OP_INC_RR;
+				d.cycles = 8;
+				break;
+			case 4:
+				d.operation = OP_INC_R;
+				d.cycles = indirectY ? 12 : 4;
+				break;
+			case 5:
+				d.operation = OP_DEC_R;
+				d.cycles = indirectY ? 12 : 4;
+				break;
+			case 6:
+				d.operation = OP_LD_R_U8;
+				d.cycles = indirectY ? 12 : 8;
+				break;
+			case 7:
+				if (d.y < 4)
+					d.operation = OP_ROTATE_A;
+				else
+					d.operation = accumulatorOperations[d.y - 4];
+				break;
+			}
+		}
+		else if (x == 1)
+		{
+			d.operation = (opcode == 0x76) ? OP_HALT : OP_LD_R_R;
+			d.cycles = (indirectY || indirectZ) ? 8 : 4;
+		}
+		else if (x == 2)
+		{
+			d.operation = OP_ALU_R;
+			d.cycles = indirectZ ? 8 : 4;
+		}
+		else
+		{
+			switch (d.z)
+			{
+			case 0:
+				if (d.y < 4)
+				{
+					d.operation = OP_RET;
+					d.cycles = 8;
+					d.cyclesTaken = 20;
+				}
+				else
+				{
+					d.operation = highLoadOperations[d.y - 4];
+					d.cycles = highLoadCycles[d.y - 4];
+				}
+				break;
+			case 1:
+				if (!d.q)
+				{
+					d.operation = OP_POP;
+					d.cycles = 12;
+				}
+				else
+				{
+					d.operation = returnOperations[d.p];
+					d.cycles = returnCycles[d.p];
+					d.cyclesTaken = d.cycles;
+				}
+				break;
+			case 2:
+				if (d.y < 4)
+				{
+					d.operation = OP_JP;
+					d.cycles = 12;
+					d.cyclesTaken = 16;
+				}
+				else
+				{
+					d.operation = indirectLoadOperations[d.y - 4];
+					d.cycles = indirectLoadCycles[d.y - 4];
+				}
+				break;
+			case 3:
+				d.operation = OP_ILLEGAL;
+				if (d.y == 0)
+				{
+					d.operation = OP_JP;
+					d.cycles = d.cyclesTaken = 16;
+				}
+				else if (d.y == 1)
+					d.operation = OP_PREFIX;
+				else if (d.y == 6)
+					d.operation = OP_DI;
+				else if (d.y == 7)
+					d.operation = OP_EI;
+				break;
+			case 4:
+				d.operation = (d.y < 4) ? OP_CALL : OP_ILLEGAL;
+				d.cycles = 12;
+				d.cyclesTaken = 24;
+				break;
+			case 5:
+				if (!d.q)
+				{
+					d.operation = OP_PUSH;
+					d.cycles = 16;
+				}
+				else
+				{
+					d.operation = (d.p == 0) ? OP_CALL : OP_ILLEGAL;
+					d.cycles = d.cyclesTaken = 24;
+				}
+				break;
+			case 6:
+				d.operation = OP_ALU_U8;
+				d.cycles = 8;
+				break;
+			case 7:
+				d.operation = OP_RST;
+				d.cycles = 16;
+				break;
+			}
+		}
+	}
+
+	for (int i = 0; i < 8; i++)
+		r[i] = 0;
+	F = 0;
+	SP = 0;
+	PC = 0;
+	IME = false;
+	imeDelay = 0;
+	halted = false;
+	haltBug = false;
+	locked = false;
+	mMap = nullptr;
+}
+
+Byte ReferenceCPU::fetch()
+{
+	Byte value = mMap->readMemory(PC);
+	if (haltBug)
+		haltBug = false;
+	else
+		PC++;
+	return value;
+}
+
+Word ReferenceCPU::fetchWord()
+{
+	Byte lo = fetch();
+	return lo | (fetch() << 8);
+}
+
+Byte ReferenceCPU::readR(int index)
+{
+	if (index == REF_HL_INDIRECT)
+		return mMap->readMemory(readRR(2));
+	return r[index];
+}
+
+void ReferenceCPU::writeR(int index, Byte value)
+{
+	if (index == REF_HL_INDIRECT)
+		mMap->writeMemory(readRR(2), value);
+	else
+		r[index] = value;
+}
+
+// 0 BC, 1 DE, 2 HL, 3 SP
+Word ReferenceCPU::readRR(int index)
+{
+	if (index == 3)
+		return SP;
+	return (r[index * 2] << 8) | r[index * 2 + 1];
+}
+
+void ReferenceCPU::writeRR(int index, Word value)
+{
+	if (index == 3)
+	{
+		SP = value;
+		return;
+	}
+	r[index * 2] = value >> 8;
+	r[index * 2 + 1] = value & 0xFF;
+}
+
+// 0 NZ, 1 Z, 2 NC, 3 C
+bool ReferenceCPU::condition(int index)
+{
+	bool set = (index < 2) ? (F & REF_Z) : (F & REF_C);
+	return (index & 1) ? set : !set;
+}
+
+void ReferenceCPU::push(Word value)
+{
+	mMap->writeMemory(--SP, value >> 8);
+	mMap->writeMemory(--SP, value & 0xFF);
+}
+
+Word ReferenceCPU::pop()
+{
+	Byte lo = mMap->readMemory(SP++);
+	return lo | (mMap->readMemory(SP++) << 8);
+}
+
+void ReferenceCPU::setFlags(bool z, bool n, bool h, bool c)
+{
+	F = (z ? REF_Z : 0) | (n ? REF_N : 0) | (h ? REF_H : 0) | (c ? REF_C : 0);
+}
+
+// ADD, ADC, SUB, SBC, AND, XOR, OR, CP
+void ReferenceCPU::alu(int operation, Byte value)
+{
+	int a = r[REF_A];
+	int carry = (F & REF_C) ? 1 : 0;
+	int result;
+
+	switch (operation)
+	{
+	case 0:
+	case 1:
+		carry = (operation == 1) ? carry : 0;
+		result = a + value + carry;
+		setFlags(!(result & 0xFF), false, ((a & 0xF) + (value & 0xF) + carry) > 0xF, result > 0xFF);
+		break;
+	case 2:
+	case 3:
+	case 7:
+		carry = (operation == 3) ? carry : 0;
+		result = a - value - carry;
+		setFlags(!(result & 0xFF), true, (a & 0xF) < ((value & 0xF) + carry), a < (value + carry));
+		break;
+	case 4:
+		result = a & value;
+		setFlags(!result, false, true, false);
+		break;
+	case 5:
+		result = a ^ value;
+		setFlags(!result, false, false, false);
+		break;
+	default:
+		result = a | value;
+		setFlags(!result, false, false, false);
+		break;
+	}
+
+	// CP only sets the flags
+	if (operation != 7)
+		r[REF_A] = result & 0xFF;
+}
+
+int ReferenceCPU::executePrefixed()
+{
+	Byte opcode = fetch();
+	int x = opcode >> 6;
+	int y = (opcode >> 3) & 7;
+	int z = opcode & 7;
+	int value = readR(z);
+	bool carry = F & REF_C;
+
+	if (x == 1)
+	{
+		// BIT keeps the carry
+		F = (F & REF_C) | REF_H | ((value >> y) & 1 ? 0 : REF_Z);
+		return (z == REF_HL_INDIRECT) ? 12 : 8;
+	}
+
+	if (x == 0)
+	{
+		int result;
+		bool out;
+		switch (y)
+		{
+		case 0: // RLC
+			out = value & 0x80;
+			result = (value << 1) | (value >> 7);
+			break;
+		case 1: // RRC
+			out = value & 1;
+			result = (value >> 1) | (value << 7);
+			break;
+		case 2: // RL
+			out = value & 0x80;
+			result = (value << 1) | carry;
+			break;
+		case 3: // RR
+			out = value & 1;
+			result = (value >> 1) | (carry << 7);
+			break;
+		case 4: // SLA
+			out = value & 0x80;
+			result = value << 1;
+			break;
+		case 5: // SRA
+			out = value & 1;
+			result = (value >> 1) | (value & 0x80);
+			break;
+		case 6: // SWAP
+			out = false;
+			result = (value >> 4) | (value << 4);
+			break;
+		default: // SRL
+			out = value & 1;
+			result = value >> 1;
+			break;
+		}
+		result &= 0xFF;
+		setFlags(!result, false, false, out);
+		writeR(z, result);
+	}
+	else if (x == 2)
+		writeR(z, value & ~(1 << y));
+	else
+		writeR(z, value | (1 << y));
+
+	return (z == REF_HL_INDIRECT) ? 16 : 8;
+}
+
+int ReferenceCPU::execute()
+{
+	if (locked)
+		return 4;
+
+	Byte opcode = fetch();
+	const Decoded& d = table[opcode];
+	int value;
+	Word address;
+
+	switch (d.operation)
+	{
+	case OP_NOP:
+		break;
+	case OP_LD_R_R:
+		writeR(d.y, readR(d.z));
+		break;
+	case OP_LD_R_U8:
+		writeR(d.y, fetch());
+		break;
+	case OP_LD_RR_U16:
+		writeRR(d.p, fetchWord());
+		break;
+	case OP_LD_U16_SP:
+		address = fetchWord();
+		mMap->writeMemory(address, SP & 0xFF);
+		mMap->writeMemory(address + 1, SP >> 8);
+		break;
+	case OP_LD_IND_A:
+	case OP_LD_A_IND:
+		// (BC), (DE), (HL+), (HL-)
+		address = readRR(d.p < 2 ? d.p : 2);
+		if (d.operation == OP_LD_IND_A)
+			mMap->writeMemory(address, r[REF_A]);
+		else
+			r[REF_A] = mMap->readMemory(address);
+		if (d.p == 2)
+			writeRR(2, address + 1);
+		else if (d.p == 3)
+			writeRR(2, address - 1);
+		break;
+	case OP_INC_R:
+		value = (readR(d.y) + 1) & 0xFF;
+		F = (F & REF_C) | (value ? 0 : REF_Z) | ((value & 0xF) == 0 ? REF_H : 0);
+		writeR(d.y, value);
+		break;
+	case OP_DEC_R:
+		value = (readR(d.y) - 1) & 0xFF;
+		F = (F & REF_C) | REF_N | (value ? 0 : REF_Z) | ((value & 0xF) == 0xF ? REF_H : 0);
+		writeR(d.y, value);
+		break;
+	case OP_INC_RR:
+		writeRR(d.p, readRR(d.p) + 1);
+		break;
+	case OP_DEC_RR:
+		writeRR(d.p, readRR(d.p) - 1);
+		break;
+	case OP_ADD_HL_RR:
+	{
+		int hl = readRR(2);
+		int rr = readRR(d.p);
+		F = (F & REF_Z) | (((hl & 0xFFF) + (rr & 0xFFF)) > 0xFFF ? REF_H : 0) | ((hl + rr) > 0xFFFF ? REF_C : 0);
+		writeRR(2, hl + rr);
+		break;
+	}
+	case OP_ALU_R:
+		alu(d.y, readR(d.z));
+		break;
+	case OP_ALU_U8:
+		alu(d.y, fetch());
+		break;
+	case OP_ROTATE_A:
+	{
+		// RLCA, RRCA, RLA, RRA
+		int a = r[REF_A];
+		int carry = (F & REF_C) ? 1 : 0;
+		bool out = (d.y & 1) ? (a & 1) : (a & 0x80);
+		if (d.y == 0)
+			a = (a << 1) | (a >> 7);
+		else if (d.y == 1)
+			a = (a >> 1) | (a << 7);
+		else if (d.y == 2)
+			a = (a << 1) | carry;
+		else
+			a = (a >> 1) | (carry << 7);
+		r[REF_A] = a & 0xFF;
+		setFlags(false, false, false, out);
+		break;
+	}
+	case OP_DAA:
+	{
+		int a = r[REF_A];
+		bool carry = F & REF_C;
+		if (!(F & REF_N))
+		{
+			if (carry || a > 0x99)
+			{
+				a += 0x60;
+				carry = true;
+			}
+			if ((F & REF_H) || (a & 0xF) > 0x9)
+				a += 0x6;
+		}
+		else
+		{
+			if (carry)
+				a -= 0x60;
+			if (F & REF_H)
+				a -= 0x6;
+		}
+		r[REF_A] = a & 0xFF;
+		F = (F & REF_N) | (r[REF_A] ? 0 : REF_Z) | (carry ? REF_C : 0);
+		break;
+	}
+	case OP_CPL:
+		r[REF_A] = ~r[REF_A];
+		F |= REF_N | REF_H;
+		break;
+	case OP_SCF:
+		F = (F & REF_Z) | REF_C;
+		break;
+	case OP_CCF:
+		F = (F & REF_Z) | ((F & REF_C) ? 0 : REF_C);
+		break;
+	case OP_JR:
+		value = (SByte)fetch();
+		// JR i8 is encoded with y = 3, the rest are conditional
+		if (d.y == 3 || condition(d.y - 4))
+		{
+			PC += value;
+			return d.cyclesTaken;
+		}
+		break;
+	case OP_JP:
+		address = fetchWord();
+		// JP u16 is encoded with z = 3
+		if (d.z == 3 || condition(d.y))
+		{
+			PC = address;
+			return d.cyclesTaken;
+		}
+		break;
+	case OP_JP_HL:
+		PC = readRR(2);
+		break;
+	case OP_CALL:
+		address = fetchWord();
+		// CALL u16 is encoded with z = 5
+		if (d.z == 5 || condition(d.y))
+		{
+			push(PC);
+			PC = address;
+			return d.cyclesTaken;
+		}
+		break;
+	case OP_RET:
+		// RET is encoded with z = 1
+		if (d.z == 1 || condition(d.y))
+		{
+			PC = pop();
+			return d.cyclesTaken;
+		}
+		break;
+	case OP_RETI:
+		PC = pop();
+		IME = true;
+		imeDelay = 0;
+		break;
+	case OP_RST:
+		push(PC);
+		PC = d.y * 8;
+		break;
+	case OP_PUSH:
+		if (d.p == 3)
+			push((r[REF_A] << 8) | F);
+		else
+			push(readRR(d.p));
+		break;
+	case OP_POP:
+		if (d.p == 3)
+		{
+			Word af = pop();
+			r[REF_A] = af >> 8;
+			F = af & 0xF0;
+		}
+		else
+			writeRR(d.p, pop());
+		break;
+	case OP_LDH_U8_A:
+		mMap->writeMemory(0xFF00 + fetch(), r[REF_A]);
+		break;
+	case OP_LDH_A_U8:
+		r[REF_A] = mMap->readMemory(0xFF00 + fetch());
+		break;
+	case OP_LDH_C_A:
+		mMap->writeMemory(0xFF00 + r[1], r[REF_A]);
+		break;
+	case OP_LDH_A_C:
+		r[REF_A] = mMap->readMemory(0xFF00 + r[1]);
+		break;
+	case OP_LD_U16_A:
+		mMap->writeMemory(fetchWord(), r[REF_A]);
+		break;
+	case OP_LD_A_U16:
+		r[REF_A] = mMap->readMemory(fetchWord());
+		break;
+	case OP_ADD_SP_I8:
+	case OP_LD_HL_SP_I8:
+	{
+		Byte offset = fetch();
+		Word result = SP + (SByte)offset;
+		setFlags(false, false, ((SP & 0xF) + (offset & 0xF)) > 0xF, ((SP & 0xFF) + offset) > 0xFF);
+		if (d.operation == OP_ADD_SP_I8)
+			SP = result;
+		else
+			writeRR(2, result);
+		break;
+	}
+	case OP_LD_SP_HL:
+		SP = readRR(2);
+		break;
+	case OP_DI:
+		IME = false;
+		imeDelay = 0;
+		break;
+	case OP_EI:
+		// Takes effect after the next instruction
+		if (!IME)
+			imeDelay = 2;
+		break;
+	case OP_HALT:
+		// The HALT bug, the next opcode is read twice
+		if (!IME && (mMap->readMemory(0xFF0F) & mMap->readMemory(0xFFFF) & 0x1F))
+			haltBug = true;
+		else
+			halted = true;
+		break;
+	case OP_STOP:
+		fetch();
+		break;
+	case OP_PREFIX:
+		return executePrefixed();
+	default:
+		locked = true;
+		break;
+	}
+
+	return d.cycles;
+}
+
+int ReferenceCPU::serviceInterrupts()
+{
+	if (imeDelay && --imeDelay == 0)
+		IME = true;
+
+	Byte pending = mMap->readMemory(0xFF0F) & mMap->readMemory(0xFFFF) & 0x1F;
+	if (!pending)
+		return 0;
+
+	// Any pending interrupt ends HALT, even with IME disabled
+	halted = false;
+	if (!IME)
+		return 0;
+
+	// Lowest bit has the highest priority
+	int bit = 0;
+	while (!((pending >> bit) & 1))
+		bit++;
+
+	IME = false;
+	mMap->writeMemory(0xFF0F, 0xE0 | (mMap->readMemory(0xFF0F) & 0x1F & ~(1 << bit)));
+	push(PC);
+	PC = 0x40 + bit * 8;
+	return 20;
+}
+
+int ReferenceCPU::step()
+{
+	int cycles = halted ? 4 : execute();
+	return cycles + serviceInterrupts();
+}
+
+CPUState ReferenceCPU::getState()
+{
+	CPUState state;
+	state.AF = (r[REF_A] << 8) | F;
+	state.BC = readRR(0);
+	state.DE = readRR(1);
+	state.HL = readRR(2);
+	state.SP = SP;
+	state.PC = PC;
+	state.IME = IME;
+	state.halted = halted;
+	return state;
+}
+
+void ReferenceCPU::setState(const CPUState& state)
+{
+	r[REF_A] = state.AF >> 8;
+	F = state.AF & 0xF0;
+	writeRR(0, state.BC);
+	writeRR(1, state.DE);
+	writeRR(2, state.HL);
+	SP = state.SP;
+	PC = state.PC;
+	IME = state.IME;
+	imeDelay = 0;
+	halted = state.halted;
+	haltBug = false;
+	locked = false;
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include "types.h"
+#include "cpu.h"
+#include "mmap.h"
+
+// Reference model of the SM83
+// Written independently of CPU from https://gbdev.io/pandocs/CPU_Instruction_Set.html
+// and https://izik1.github.io/gbops/index.html to serve as an oracle for it
+// Opcodes are decoded once into a table of generic operations on
+// register indices instead of one method per opcode
+
+class ReferenceCPU
+{
+private:
+	// Generic operations every opcode decodes to
+	// Naming convention is: OP_<operation>_<operands>
+	enum Operation
+	{
+		OP_NOP,
+		OP_LD_R_R,
+		OP_LD_R_U8,
+		OP_LD_RR_U16,
+		OP_LD_U16_SP,
+		OP_LD_IND_A,
+		OP_LD_A_IND,
+		OP_INC_R,
+		OP_DEC_R,
+		OP_INC_RR,
+		OP_DEC_RR,
+		OP_ADD_HL_RR,
+		OP_ALU_R,
+		OP_ALU_U8,
+		OP_ROTATE_A,
+		OP_DAA,
+		OP_CPL,
+		OP_SCF,
+		OP_CCF,
+		OP_JR,
+		OP_JP,
+		OP_JP_HL,
+		OP_CALL,
+		OP_RET,
+		OP_RETI,
+		OP_RST,
+		OP_PUSH,
+		OP_POP,
+		OP_LDH_U8_A,
+		OP_LDH_A_U8,
+		OP_LDH_C_A,
+		OP_LDH_A_C,
+		OP_LD_U16_A,
+		OP_LD_A_U16,
+		OP_ADD_SP_I8,
+		OP_LD_HL_SP_I8,
+		OP_LD_SP_HL,
+		OP_DI,
+		OP_EI,
+		OP_HALT,
+		OP_STOP,
+		OP_PREFIX,
+		OP_ILLEGAL
+	};
+
+	// A decoded opcode
+	// y, z, p, q are the fields of the opcode
+	// Pulled from https://gbdev.io/gb-opcodes/optables/octal
+	struct Decoded
+	{
+		Byte operation;
+		Byte y;
+		Byte z;
+		Byte p;
+		Byte q;
+
+		// Cycles taken, and taken when a condition holds
+		Byte cycles;
+		Byte cyclesTaken;
+	};
+
+	Decoded table[0x100];
+
+	// Register file in the order of the opcode encoding
+	// B, C, D, E, H, L, unused (HL), A
+	Byte r[8];
+	Byte F;
+	Word SP;
+	Word PC;
+
+	bool IME;
+
+	// Instructions left until EI takes effect
+	int imeDelay;
+
+	bool halted;
+
+	// The next opcode fetch does not increment PC
+	bool haltBug;
+
+	// An illegal opcode hangs the CPU
+	bool locked;
+
+	MemoryMap* mMap;
+
+	Byte fetch();
+	Word fetchWord();
+	Byte readR(int index);
+	void writeR(int index, Byte value);
+	Word readRR(int index);
+	void writeRR(int index, Word value);
+	bool condition(int index);
+	void push(Word value);
+	Word pop();
+	void setFlags(bool z, bool n, bool h, bool c);
+	void alu(int operation, Byte value);
+	int executePrefixed();
+	int execute();
+	int serviceInterrupts();
+
+public:
+	ReferenceCPU();
+
+	void setMemory(MemoryMap* memory) { mMap = memory; }
+
+	// Execute one instruction and service interrupts
+	// Returns the cycles taken
+	int step();
+
+	CPUState getState();
+	void setState(const CPUState& state);
+};